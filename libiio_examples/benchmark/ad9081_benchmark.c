@@ -0,0 +1,429 @@
+/*
+ * Benchmark application measuring the sustained throughput and per-call
+ * latency of AD9081 Rx refills and Tx pushes across buffer sizes, channel
+ * counts and IIO contexts.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include <iio.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* Length of temporary buffers for holding channel names */
+#define TEMP_BUFF_LEN	64
+
+/* Limits on the number of values which can be swept for each parameter */
+#define MAX_SWEEP_VALS	8
+
+/* Defaults when a parameter is not given on the command line */
+#define DEFAULT_ITERATIONS	200
+#define DEFAULT_WARMUP		5
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	fprintf(stderr, "%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+#define info(...) \
+	fprintf(stderr, "%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+/* Direction of a benchmark run */
+typedef enum {
+	DIR_RX = 0,	/* iio_buffer_refill() on the Rx device */
+	DIR_TX,		/* iio_buffer_push() on the Tx device */
+} bench_dir_t;
+
+static const char* const dir_names[] = { "rx", "tx" };
+
+/* Parameters for the whole sweep, as given on the command line */
+typedef struct {
+	const char* uris[MAX_SWEEP_VALS];
+	int num_uris;
+	size_t samples[MAX_SWEEP_VALS];
+	int num_samples;
+	int channels[MAX_SWEEP_VALS];
+	int num_channels;
+	bool dirs[2];
+	int iterations;
+	int warmup;
+} bench_config_t;
+
+/* Results of a single point in the sweep */
+typedef struct {
+	double msps;		/* Mega-samples per second, per channel */
+	double mbps;		/* Megabytes per second over all channels */
+	double lat_min_us;
+	double lat_p50_us;
+	double lat_p99_us;
+	double lat_p999_us;
+	double lat_max_us;
+	double cpu_pct;		/* Process CPU time (user + sys) over wall time */
+} bench_result_t;
+
+static bool stop_loop = false;
+
+/**
+ * Handle keyboard interrupts to gracefully exit.
+ */
+static void handle_sig(int sig)
+{
+	stop_loop = true;
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s [-u uri]... [-s samples]... [-n channels]... [-d rx|tx|both]\n"
+		"          [-i iterations] [-w warmup] [-o file.csv]\n"
+		"  -u uri       IIO context URI (i.e. local:, ip:192.168.1.155). May be\n"
+		"               repeated. Default is the default context (IIOD_REMOTE)\n"
+		"  -s samples   Buffer size in samples. May be repeated.\n"
+		"               Default 65536, 262144, 524288, 1048576\n"
+		"  -n channels  Number of I&Q channel pairs to enable. May be repeated.\n"
+		"               Default 4, 8\n"
+		"  -d dir       Direction to benchmark: rx, tx or both (default both)\n"
+		"  -i count     Timed calls per point (default %d)\n"
+		"  -w count     Untimed warmup calls per point (default %d)\n"
+		"  -o file      Write CSV results to a file instead of stdout\n",
+		name, DEFAULT_ITERATIONS, DEFAULT_WARMUP);
+}
+
+/**
+ * Helper to get the monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Helper to get the CPU time (user + system) used by the process in nanoseconds
+ */
+static uint64_t cpu_ns(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t va = *(const uint64_t*)a;
+	uint64_t vb = *(const uint64_t*)b;
+	return (va > vb) - (va < vb);
+}
+
+/**
+ * Returns the requested percentile (0-100) of a sorted set of latencies, in
+ * microseconds. Uses the nearest-rank method.
+ */
+static double percentile_us(const uint64_t* sorted, int count, double pct)
+{
+	int rank = (int)((pct / 100.0) * count + 0.999999);
+	if(rank < 1) {
+		rank = 1;
+	}
+	if(rank > count) {
+		rank = count;
+	}
+	return sorted[rank - 1] / 1000.0;
+}
+
+/**
+ * Enables the first num_ch I&Q pairs of a device, and disables the rest so the
+ * sample size of the buffer matches what's being measured.
+ */
+static int enable_channels(struct iio_device* dev, int num_ch, bool output)
+{
+	int i;
+	unsigned int c;
+	char ch_buff[TEMP_BUFF_LEN];
+	struct iio_channel* ch;
+
+	for(c = 0; c < iio_device_get_channels_count(dev); c++) {
+		ch = iio_device_get_channel(dev, c);
+		if(iio_channel_is_scan_element(ch)) {
+			iio_channel_disable(ch);
+		}
+	}
+
+	for(i = 0; i < num_ch; i++) {
+		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_i", i);
+		if((ch = iio_device_find_channel(dev, ch_buff, output)) == NULL) {
+			return -1;
+		}
+		iio_channel_enable(ch);
+
+		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_q", i);
+		if((ch = iio_device_find_channel(dev, ch_buff, output)) == NULL) {
+			return -1;
+		}
+		iio_channel_enable(ch);
+	}
+	return 0;
+}
+
+/**
+ * Runs a single point of the sweep. The buffer is created fresh for each point,
+ * given a few untimed warmup calls, then each refill/push is timed individually.
+ */
+static int run_point(struct iio_device* dev, bench_dir_t dir, int num_ch,
+		     size_t samples, const bench_config_t* cfg,
+		     uint64_t* lat, bench_result_t* res)
+{
+	int i;
+	ssize_t result;
+	uint64_t t_start, t_call, t_total;
+	uint64_t cpu_start;
+	size_t buff_bytes;
+	struct iio_buffer* buff;
+
+	if(enable_channels(dev, num_ch, dir == DIR_TX) < 0) {
+		error("Device does not have %d channel pairs\n", num_ch);
+		return -1;
+	}
+
+	if((buff = iio_device_create_buffer(dev, samples, false)) == NULL) {
+		error("Could not create a %zu sample buffer\n", samples);
+		return -1;
+	}
+	buff_bytes = (uint8_t*)iio_buffer_end(buff) - (uint8_t*)iio_buffer_start(buff);
+
+	//Tx data content doesn't matter for timing, but don't send garbage
+	if(dir == DIR_TX) {
+		memset(iio_buffer_start(buff), 0, buff_bytes);
+	}
+
+	for(i = 0; i < cfg->warmup && !stop_loop; i++) {
+		result = (dir == DIR_RX) ? iio_buffer_refill(buff) : iio_buffer_push(buff);
+		if(result < 0) {
+			goto fail;
+		}
+	}
+
+	cpu_start = cpu_ns();
+	t_start = now_ns();
+	for(i = 0; i < cfg->iterations && !stop_loop; i++) {
+		t_call = now_ns();
+		result = (dir == DIR_RX) ? iio_buffer_refill(buff) : iio_buffer_push(buff);
+		lat[i] = now_ns() - t_call;
+		if(result < 0) {
+			goto fail;
+		}
+	}
+	t_total = now_ns() - t_start;
+	iio_buffer_destroy(buff);
+
+	if(i == 0) {
+		return -1;
+	}
+
+	qsort(lat, i, sizeof(*lat), compare_u64);
+	res->msps = ((double)samples * i) / (t_total / 1e9) / 1e6;
+	res->mbps = ((double)buff_bytes * i) / (t_total / 1e9) / 1e6;
+	res->lat_min_us = lat[0] / 1000.0;
+	res->lat_p50_us = percentile_us(lat, i, 50.0);
+	res->lat_p99_us = percentile_us(lat, i, 99.0);
+	res->lat_p999_us = percentile_us(lat, i, 99.9);
+	res->lat_max_us = lat[i - 1] / 1000.0;
+	res->cpu_pct = 100.0 * (cpu_ns() - cpu_start) / t_total;
+	return i;
+
+fail:
+	error("Error code %zd from %s\n", result,
+	      (dir == DIR_RX) ? "iio_buffer_refill" : "iio_buffer_push");
+	iio_buffer_destroy(buff);
+	return -1;
+}
+
+/**
+ * Runs the full sweep of directions, channel counts and buffer sizes for one
+ * context, writing one CSV row per point.
+ */
+static int run_context(const char* uri, const bench_config_t* cfg,
+		       uint64_t* lat, FILE* csv)
+{
+	int d, n, s;
+	int count;
+	int failures = 0;
+	const char* ctx_name;
+	struct iio_context* ctx;
+	struct iio_device* devs[2];
+	struct iio_channel* dds_ctrl;
+	bench_result_t res;
+
+	if(uri) {
+		ctx = iio_create_context_from_uri(uri);
+		ctx_name = uri;
+	} else {
+		ctx = iio_create_default_context();
+		ctx_name = getenv("IIOD_REMOTE") ? getenv("IIOD_REMOTE") : "default";
+	}
+	if(!ctx) {
+		error("Could not create IIO context %s\n", ctx_name);
+		return -1;
+	}
+
+	devs[DIR_RX] = iio_context_find_device(ctx, "axi-ad9081-rx-hpc");
+	devs[DIR_TX] = iio_context_find_device(ctx, "axi-ad9081-tx-hpc");
+	if(!devs[DIR_RX] || !devs[DIR_TX]) {
+		error("Could not find AD9081 Devices on %s\n", ctx_name);
+		iio_context_destroy(ctx);
+		return -1;
+	}
+
+	//Tx buffers need the DDS out of the way, same as the multich_tx example
+	if(cfg->dirs[DIR_TX]) {
+		dds_ctrl = iio_device_find_channel(devs[DIR_TX], "altvoltage0", true);
+		if(!dds_ctrl || iio_channel_attr_write_bool(dds_ctrl, "raw", false) < 0) {
+			error("Could not set raw mode. Tx results may be invalid\n");
+		}
+	}
+
+	for(d = DIR_RX; d <= DIR_TX; d++) {
+		if(!cfg->dirs[d]) {
+			continue;
+		}
+		for(n = 0; n < cfg->num_channels; n++) {
+			for(s = 0; s < cfg->num_samples && !stop_loop; s++) {
+				info("%s: %s, %d channels, %zu samples\n", ctx_name,
+				     dir_names[d], cfg->channels[n], cfg->samples[s]);
+				count = run_point(devs[d], d, cfg->channels[n],
+						  cfg->samples[s], cfg, lat, &res);
+				if(count < 0) {
+					failures++;
+					continue;
+				}
+				fprintf(csv, "%s,%s,%d,%zu,%d,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+					ctx_name, dir_names[d], cfg->channels[n],
+					cfg->samples[s], count, res.msps, res.mbps,
+					res.lat_min_us, res.lat_p50_us, res.lat_p99_us,
+					res.lat_p999_us, res.lat_max_us, res.cpu_pct);
+				fflush(csv);
+			}
+		}
+	}
+
+	iio_context_destroy(ctx);
+	return failures ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	int ret = EXIT_SUCCESS;
+	int opt;
+	int i;
+	FILE* csv = stdout;
+	uint64_t* lat = NULL;
+	bench_config_t cfg = {
+		.iterations = DEFAULT_ITERATIONS,
+		.warmup = DEFAULT_WARMUP,
+	};
+
+	while((opt = getopt(argc, argv, "u:s:n:d:i:w:o:h")) != -1) {
+		switch(opt) {
+		case 'u':
+			if(cfg.num_uris < MAX_SWEEP_VALS) {
+				cfg.uris[cfg.num_uris++] = optarg;
+			}
+			break;
+		case 's':
+			if(cfg.num_samples < MAX_SWEEP_VALS) {
+				cfg.samples[cfg.num_samples++] = strtoul(optarg, NULL, 0);
+			}
+			break;
+		case 'n':
+			if(cfg.num_channels < MAX_SWEEP_VALS) {
+				cfg.channels[cfg.num_channels++] = atoi(optarg);
+			}
+			break;
+		case 'd':
+			cfg.dirs[DIR_RX] = !strcmp(optarg, "rx") || !strcmp(optarg, "both");
+			cfg.dirs[DIR_TX] = !strcmp(optarg, "tx") || !strcmp(optarg, "both");
+			if(!cfg.dirs[DIR_RX] && !cfg.dirs[DIR_TX]) {
+				error("Direction must be rx, tx or both, not %s\n", optarg);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'i':
+			cfg.iterations = atoi(optarg);
+			break;
+		case 'w':
+			cfg.warmup = atoi(optarg);
+			break;
+		case 'o':
+			if((csv = fopen(optarg, "w")) == NULL) {
+				error("Couldn't create file %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	//Fill in defaults for anything not swept explicitly
+	if(cfg.num_uris == 0) {
+		cfg.uris[cfg.num_uris++] = NULL;
+	}
+	if(cfg.num_samples == 0) {
+		cfg.samples[cfg.num_samples++] = 0x10000;
+		cfg.samples[cfg.num_samples++] = 0x40000;
+		cfg.samples[cfg.num_samples++] = 0x80000;
+		cfg.samples[cfg.num_samples++] = 1024 * 1024;
+	}
+	if(cfg.num_channels == 0) {
+		cfg.channels[cfg.num_channels++] = 4;
+		cfg.channels[cfg.num_channels++] = 8;
+	}
+	if(!cfg.dirs[DIR_RX] && !cfg.dirs[DIR_TX]) {
+		cfg.dirs[DIR_RX] = cfg.dirs[DIR_TX] = true;
+	}
+	if(cfg.iterations <= 0) {
+		error("Iterations must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	if((lat = malloc(cfg.iterations * sizeof(*lat))) == NULL) {
+		error("Could not allocate latency storage\n");
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, handle_sig);
+
+	fprintf(csv, "context,direction,channels,samples,iterations,msps,mbps,"
+		"lat_min_us,lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us,cpu_pct\n");
+	for(i = 0; i < cfg.num_uris && !stop_loop; i++) {
+		if(run_context(cfg.uris[i], &cfg, lat, csv) < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	free(lat);
+	if(csv != stdout) {
+		fclose(csv);
+	}
+	return ret;
+}
@@ -11,6 +11,7 @@
  *
  * Author: Brent Kowal <brent.kowal@analog.com>
  */
+#define _GNU_SOURCE     /* O_DIRECT */
 #include <iio.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -19,51 +20,2648 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <ifaddrs.h>
+#include "ad9081_rt.h"
+#include "ad9081_trace.h"
+
+/* Pick the vector unit for the streaming pattern verifier and the format
+ * conversion. NEON on the A53/A72, SSE2 when built for an x86 host with a
+ * remote context. Everything else only uses the scalar code.
+ */
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CAPTURE_VEC_NAME     "NEON"
+#define VERIFY_VEC_LANES    8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CAPTURE_VEC_NAME     "SSE2"
+#define VERIFY_VEC_LANES    8
+#else
+#define CAPTURE_VEC_NAME     "scalar"
+#endif
 
 #define ARGS(fmt, ...)	__VA_ARGS__
 #define FMT(fmt, ...)	fmt
 #define error(...) \
 	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
 
-#define info(...) \
-	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+#define info(...) \
+	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+
+#define NUM_SAMPLE_LOOPS    20
+
+/* Number of samples requested per IIO buffer refill */
+#define SAMPLES_PER_BUFF    (1024*1024)
+
+/* Upper bound on the number of blocks in the pipelined capture ring */
+#define MAX_RING_BLOCKS     64
+
+/* O_DIRECT requires the memory, length and file offset of every write to be
+ * aligned to the logical block size of the underlying device. 4K covers the
+ * SD cards, eMMC and NVMe drives commonly found on the carriers.
+ */
+#define DIRECT_IO_ALIGN     4096
+
+/* The output file is grown ahead of the write offset in chunks of this size so
+ * the filesystem can allocate contiguous extents instead of growing per write.
+ */
+#define OUTPUT_PREALLOC_BYTES   (256ULL * 1024 * 1024)
+
+/* Size of the window of the output file mapped at once by the mmap back end */
+#define OUTPUT_MMAP_WINDOW      (64ULL * 1024 * 1024)
+
+/* Send buffer requested for the net back end. Enough to keep a 10GbE link busy
+ * for several ms while the writer waits on the next block. The kernel caps it
+ * at net.core.wmem_max, so the size actually granted is reported.
+ */
+#define NET_SOCKET_BUFFER_BYTES (8 * 1024 * 1024)
+
+/* Most kernel DMA blocks that can be requested with -k */
+#define MAX_KERNEL_BLOCKS       64
+
+/* Over a network context, the kernel DMA blocks queued on the target when -k
+ * isn't given, and the libiio timeout of a request to iiod. The timeout is
+ * raised to NET_TIMEOUT_BLOCKS blocks at the -L rate when that takes longer
+ */
+#define NET_KERNEL_BLOCKS       8
+#define NET_DEFAULT_TIMEOUT_MS  5000
+#define NET_TIMEOUT_BLOCKS      4
+
+/* DMA status register of the Rx (AXI ADC) core. OVF is set when the DMA could
+ * not keep up with the converter and samples were lost. Write 1 to clear.
+ * Without the PCORE bit, cf_axi_adc hands the access to the register of the
+ * same address in the AD9081 itself.
+ */
+#define DEBUGFS_DRA_PCORE_REG_MAGIC 0x80000000
+#define RX_DMA_STATUS_REG   (DEBUGFS_DRA_PCORE_REG_MAGIC | 0x88)
+#define RX_DMA_STATUS_OVF   (1 << 2)
+
+/* The metadata sidecar file is a capture_meta_header_t followed by one
+ * capture_meta_record_t per refilled block, in host (little endian) order.
+ */
+#define META_MAGIC          "AD9081MD"
+#define META_VERSION        1
+
+/* capture_meta_header_t flags */
+#define META_HDR_OVF_VALID  (1 << 0)    /* Rx DMA status was readable */
+
+/* capture_meta_record_t flags */
+#define META_REC_OVF        (1 << 0)    /* Rx DMA overflow since the last record */
+#define META_REC_NOT_WRITTEN (1 << 1)   /* Block is missing from the data file */
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t flags;
+    uint32_t sample_size;       /* Bytes per sample of all enabled channels */
+    uint32_t samples_per_block; /* Samples requested per refill */
+} capture_meta_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t sequence;      /* Refill number, counting from 0 */
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC when the refill returned */
+    uint64_t offset;        /* Byte offset of the block in the data file */
+    uint32_t bytes;
+    uint32_t refill_ns;     /* Time spent in iio_buffer_refill(), saturated */
+    uint32_t flags;
+    uint32_t reserved;
+} capture_meta_record_t;
+
+/* State of the metadata sidecar. Records are only written by one thread, the
+ * refill thread in inline mode or the writer thread in pipelined mode.
+ */
+typedef struct {
+    FILE* file;
+    struct iio_device* dev;
+    bool ovf_valid;
+    uint32_t pending_flags;     /* Flags of dropped blocks, for the next record */
+    unsigned long long records;
+    unsigned long long write_errors;
+} capture_meta_t;
+
+/* Formats the samples can be written in */
+typedef enum {
+    FORMAT_RAW = 0,     /* Interleaved int16 frames, as captured */
+    FORMAT_PLANAR,      /* One int16 file per channel */
+    FORMAT_CS16,        /* One interleaved I/Q int16 file per I/Q pair */
+    FORMAT_CF32,        /* One interleaved I/Q float file per I/Q pair */
+    FORMAT_PACK12,      /* Interleaved frames of 12 bit samples, 2 per 3 bytes */
+} format_t;
+
+static const char* const format_names[] = { "raw", "planar", "cs16", "cf32", "pack12" };
+
+/* Frames converted per pass. With 4 channels the input of a pass is 32KB, so
+ * it stays in cache while it is split out into the per stream buffers.
+ */
+#define CONVERT_CHUNK_FRAMES    4096
+
+/* Most interleaved channels which can be converted */
+#define CONVERT_MAX_CH          16
+
+/* A pack12 file is a capture_pack12_header_t, zero padded to
+ * PACK12_HEADER_SIZE so the samples after it stay aligned for O_DIRECT,
+ * followed by the interleaved frames. Each pair of samples is stored as 12
+ * bits of each, (a >> shift) | (b >> shift) << 12, in 3 little endian bytes.
+ * The shift comes from the data format of the channels, and is at most
+ * PACK12_MAX_SHIFT, so the bits above the 12 stored are the sign.
+ */
+#define PACK12_MAGIC        "AD9081PK"
+#define PACK12_VERSION      1
+#define PACK12_HEADER_SIZE  4096
+#define PACK12_BITS         12
+#define PACK12_MAX_SHIFT    (16 - PACK12_BITS)
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       /* Offset of the first frame */
+    uint32_t num_ch;            /* Interleaved channels per frame, always even */
+    uint32_t bits;              /* Bits stored per sample */
+    uint32_t shift;             /* Right shift of the int16 samples stored */
+    uint32_t reserved;
+    uint64_t sample_rate;       /* Rx sampling_frequency in Hz, 0 if unknown */
+    char channels[CONVERT_MAX_CH][16];  /* Channel ids, in frame order */
+} capture_pack12_header_t;
+
+/* Full scale of the cf32 format, +-1.0 */
+#define CONVERT_CF32_SCALE      (1.0f / 32768.0f)
+
+struct capture_convert;
+
+/* Supported back ends for writing data to the output file */
+typedef enum {
+    OUTPUT_STDIO = 0,   /* Buffered stdio fwrite() */
+    OUTPUT_DIRECT,      /* O_DIRECT writes straight from the sample memory */
+    OUTPUT_MMAP,        /* Sliding mmap() window over a preallocated file */
+    OUTPUT_NET,         /* TCP stream to host:port */
+} output_type_t;
+
+static const char* const output_names[] = { "stdio", "direct", "mmap", "net" };
+
+/* State for an open output file, for whichever back end is in use */
+typedef struct {
+    output_type_t type;
+    FILE* file;             /* OUTPUT_STDIO */
+    int fd;                 /* OUTPUT_DIRECT, OUTPUT_MMAP and OUTPUT_NET */
+    uint64_t offset;        /* Logical bytes written so far */
+    uint64_t allocated;     /* Bytes preallocated in the file */
+    uint8_t* bounce;        /* OUTPUT_DIRECT staging for unaligned data */
+    size_t bounce_size;
+    size_t bounce_used;
+    unsigned long long bounce_copies;
+    uint8_t* map;           /* OUTPUT_MMAP current window */
+    uint64_t map_offset;
+    unsigned int link_mbps; /* OUTPUT_NET speed of the interface, 0 if unknown */
+    uint64_t stored;        /* Bytes in the files of a converted format, once closed */
+    struct capture_convert* conv;   /* Set when writing a converted format */
+} capture_output_t;
+
+/* Converts interleaved blocks into one output per stream. Blocks are done a
+ * chunk of CONVERT_CHUNK_FRAMES at a time through fixed staging buffers, so
+ * memory use doesn't depend on the block size or the length of the capture.
+ */
+typedef struct capture_convert {
+    format_t format;
+    unsigned int num_ch;        /* Interleaved int16 channels per frame */
+    unsigned int num_streams;
+    size_t stage_size;          /* Bytes per stream for a whole chunk */
+    capture_output_t streams[CONVERT_MAX_CH];
+    uint8_t* stage[CONVERT_MAX_CH];
+    unsigned int pack_shift;    /* pack12 right shift of each sample stored */
+    uint16_t lost_bits;         /* pack12 bits of the first block which can't be stored */
+} capture_convert_t;
+
+/* A preallocated block handed from the refill thread to the writer thread */
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    capture_meta_record_t meta;
+} capture_block_t;
+
+/* Lock-free single producer/single consumer ring of capture blocks.
+ * head and tail are free running counters. Only the refill thread advances
+ * head and only the writer thread advances tail, so the ring is full when
+ * (head - tail) == num_blocks and empty when head == tail. The semaphore only
+ * exists to let the writer sleep while the ring is empty.
+ */
+typedef struct {
+    capture_block_t blocks[MAX_RING_BLOCKS];
+    unsigned int num_blocks;
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_bool done;
+    sem_t filled;
+} capture_ring_t;
+
+/* Settings and state of a triggered capture. Every refilled block is kept in
+ * a history of the last pre_blocks blocks, and nothing is written until the
+ * trigger fires. Then the history, the triggering block and the next
+ * post_blocks blocks are handed to the writer thread.
+ */
+typedef struct {
+    unsigned int pre_blocks;
+    unsigned int post_blocks;
+    uint32_t level_sq;          /* Squared I/Q magnitude to trigger on, 0 if unused */
+    int gpio_fd;                /* sysfs GPIO value file to trigger on, -1 if unused */
+    capture_block_t hist[MAX_RING_BLOCKS];
+    unsigned int hist_head;     /* Free running count of blocks put in the history */
+    unsigned int hist_count;    /* Blocks in the history, up to pre_blocks */
+    unsigned int post_left;     /* Blocks left to write after the last trigger */
+    unsigned long long events;
+    unsigned long long discarded;   /* Blocks never written, as nothing triggered */
+} capture_trigger_t;
+
+/* Statistics for a capture run. The refill thread owns the first group, the
+ * writer thread owns the second, so neither needs to be atomic.
+ */
+typedef struct {
+    unsigned long long blocks_captured;
+    unsigned long long overruns;        /* Ring was full when a block arrived */
+    unsigned long long ovf_blocks;      /* Blocks with the Rx DMA overflow flag */
+    uint64_t first_ns;                  /* Completion of the first and last refill */
+    uint64_t last_ns;
+    uint64_t interval_min_ns;           /* Between consecutive refill completions */
+    uint64_t interval_max_ns;
+    unsigned long long blocks_written;
+    unsigned long long bytes_written;
+    unsigned long long write_errors;    /* Blocks lost to a short fwrite */
+} capture_stats_t;
+
+/* Arguments for the writer thread */
+typedef struct {
+    capture_ring_t* ring;
+    capture_output_t* out;
+    capture_meta_t* meta;
+    capture_stats_t* stats;
+} writer_args_t;
+
+/* Test patterns the streaming verifier can check. PN sequences are checked
+ * with the earliest bit of each sample in the MSB.
+ */
+typedef enum {
+    VERIFY_NONE = 0,
+    VERIFY_RAMP,        /* Every channel counts up by 1 per sample */
+    VERIFY_PN9,         /* x^9 + x^5 + 1 */
+    VERIFY_PN23,        /* x^23 + x^18 + 1 */
+} verify_mode_t;
+
+/* Names of the patterns, which are also the test_mode attribute values */
+static const char* const verify_names[] = { "off", "ramp", "pn9", "pn23" };
+
+/* Most interleaved channels the verifier tracks */
+#define VERIFY_MAX_CH       16
+
+/* Seconds between the running totals printed while verifying */
+#define VERIFY_REPORT_SEC   10
+
+/* Where a channel is in following its pattern */
+typedef enum {
+    VERIFY_LOCKING = 0, /* Collecting the first words to predict from */
+    VERIFY_LOCKED,      /* Every word matched the prediction */
+    VERIFY_SUSPECT,     /* The last word did not match */
+    VERIFY_RELOCKING,   /* Lost the pattern, looking for it again */
+} verify_state_t;
+
+typedef struct {
+    verify_state_t state;
+    uint32_t hist;      /* Last two words received, most recent in the low half */
+    unsigned int valid; /* Words collected while locking */
+    uint16_t bad;       /* Word which put the channel into VERIFY_SUSPECT */
+    unsigned long long errors;  /* Words which did not match the pattern */
+    unsigned long long slips;   /* Times the pattern continued from a new position */
+} verify_chan_t;
+
+/* State of the streaming verifier. A channel's state carries from one block to
+ * the next, so a gap between refills is found the same as one within a block.
+ */
+typedef struct {
+    verify_mode_t mode;
+    unsigned int num_ch;
+    unsigned int lock_words;    /* Words needed before the next can be predicted */
+    uint16_t syndrome;          /* 0xFFFF for an inverted PN sequence, else 0 */
+    bool polarity_known;
+    unsigned long long words;   /* Words checked over all channels */
+    verify_chan_t ch[VERIFY_MAX_CH];
+} verifier_t;
+
+static bool stop_loop = false;
+static bool trigger_signal = false;
+
+static struct iio_context *ctx = NULL;
+
+//CPU and priority placement of the refill and writer threads
+static ad9081_rt_t rt;
+
+/**
+ * Handle keyboard interrupts to gracefully exit.
+ */
+static void handle_sig(int sig)
+{
+    stop_loop = true;
+}
+
+/**
+ * Handle SIGUSR1 as an external trigger
+ */
+static void handle_trigger_sig(int sig)
+{
+    trigger_signal = true;
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+    printf("Usage: %s [-c] [-p blocks] [-o backend] [-f format] [-m metafile]\n"
+           "          [-r pre:post [-T level] [-g gpio]] [-k blocks] [-L mbps]\n"
+           "          [-a cpus] [-P prio] [-M] [-I cpu] [-J blocks] <filename>\n"
+           "       %s [-c] [-k blocks] [-L mbps] [-a cpus] [-P prio] [-M] [-I cpu]\n"
+           "          [-J blocks] -v pattern\n"
+           "       %s [-o backend] -U packedfile <filename>\n"
+           "  -c         Capture continuously until Ctrl+C instead of %d refills\n"
+           "  -p blocks  Pipelined capture. Refill and file writes are done on\n"
+           "             separate threads through a ring of 'blocks' buffers\n"
+           "             (2 = double buffered, 3 = triple buffered, max %d)\n"
+           "  -o backend Output file back end: stdio (default), direct, mmap or\n"
+           "             net, which streams to a host:port given as the filename\n"
+           "  -f format  Sample format: raw (default, interleaved as captured),\n"
+           "             planar (a file per channel), cs16 or cf32 (a complex\n"
+           "             int16 or float file per I/Q pair), or pack12 (12 bits of\n"
+           "             each sample, 2 samples in 3 bytes, stopping on the first\n"
+           "             block which doesn't fit in 12 bits)\n"
+           "  -m file    Write a record per refilled block with its time, sequence,\n"
+           "             size and Rx DMA overflow flag to a metadata sidecar file\n"
+           "  -r pre:post Triggered capture. Keeps the last 'pre' blocks in memory\n"
+           "             and only writes them, the triggering block and 'post'\n"
+           "             blocks after it when triggered. SIGUSR1 always triggers\n"
+           "  -T level   Trigger when the I/Q magnitude of any channel is above\n"
+           "             level, in ADC codes\n"
+           "  -g gpio    Trigger while a GPIO value file, i.e.\n"
+           "             /sys/class/gpio/gpioN/value, reads 1\n"
+           "  -v pattern Set the ramp, pn9 or pn23 test mode and verify every block\n"
+           "             as it arrives instead of writing the samples to a file\n"
+           "  -k blocks  Number of kernel DMA blocks queued at once, 1-%d\n"
+           "             (default is the libiio default, %d over a network context)\n"
+           "  -L mbps    Link rate in Mb/s to report the utilization against, and,\n"
+           "             over a network context, to size the iiod timeout by. Found\n"
+           "             from the interface for the net back end when not given\n"
+           "  -U file    Unpack a pack12 capture back into raw frames in <filename>\n"
+           "  -a cpus    Pin the refill thread to the first CPU of a comma separated\n"
+           "             list, i.e. 3,2, and the writer thread to the next\n"
+           "  -P prio    Run the refill thread SCHED_FIFO at prio, 1-99, and the\n"
+           "             writer one below it\n"
+           "  -M         Lock all the memory of the process, mlockall()\n"
+           "  -I cpu     Move the AXI DMA interrupts to cpu while capturing\n"
+           "  -J blocks  Blocks captured before the placement is applied, after the\n"
+           "             kernel blocks, to compare the refill jitter against\n"
+           "             (default %d, 0 applies it first)\n",
+           name, name, name, NUM_SAMPLE_LOOPS, MAX_RING_BLOCKS, MAX_KERNEL_BLOCKS, NET_KERNEL_BLOCKS,
+           AD9081_RT_DEFAULT_BASELINE);
+}
+
+/**
+ * Helper to get the monotonic time in seconds
+ */
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Helper to get the monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Prints the results of a capture run
+ */
+static void print_stats(const capture_stats_t* stats, const capture_output_t* out,
+                        const capture_meta_t* meta, double elapsed)
+{
+    info("Blocks captured: %llu\n", stats->blocks_captured);
+    info("Blocks written:  %llu (%llu bytes)\n", stats->blocks_written,
+         stats->bytes_written);
+    if(out->stored) {
+        info("Stored:          %llu bytes\n", (unsigned long long)out->stored);
+    }
+    info("Overruns:        %llu\n", stats->overruns);
+    info("Dropped blocks:  %llu\n", stats->overruns + stats->write_errors);
+    if(out->type == OUTPUT_DIRECT) {
+        info("Bounce copies:   %llu\n", out->bounce_copies);
+    }
+    if(elapsed > 0.0) {
+        info("Throughput:      %.1f MB/s (%s)\n",
+             stats->bytes_written / elapsed / 1e6, output_names[out->type]);
+    }
+    if(meta->file == NULL) {
+        return;
+    }
+    info("Meta records:    %llu (%llu write errors)\n", meta->records, meta->write_errors);
+    if(meta->ovf_valid) {
+        info("Rx overflows:    %llu blocks\n", stats->ovf_blocks);
+    }
+    if(stats->blocks_captured > 1) {
+        info("Refill interval: min %.3f ms, avg %.3f ms, max %.3f ms\n",
+             stats->interval_min_ns / 1e6,
+             (stats->last_ns - stats->first_ns) / 1e6 / (stats->blocks_captured - 1),
+             stats->interval_max_ns / 1e6);
+    }
+}
+
+/**
+ * Prints the rate data crossed a network link at and, when the link rate is
+ * known, how much of it was used. Only payload bytes are counted, so the
+ * TCP/IP and iiod framing on top puts the wire a few percent higher.
+ */
+static void print_link(const char* what, unsigned long long bytes, double elapsed,
+                       unsigned int link_mbps)
+{
+    double mbps;
+
+    if(elapsed <= 0.0) {
+        return;
+    }
+    mbps = bytes * 8.0 / elapsed / 1e6;
+    if(link_mbps) {
+        info("Link (%s):      %.1f Mb/s, %.1f%% of %u Mb/s\n", what, mbps,
+             mbps * 100.0 / link_mbps, link_mbps);
+    } else {
+        info("Link (%s):      %.1f Mb/s\n", what, mbps);
+    }
+}
+
+/**
+ * Opens the metadata sidecar and writes its header. The Rx DMA status is read
+ * once here to find out if it is accessible at all, which also clears any
+ * overflow left over from before the capture.
+ */
+static int meta_open(capture_meta_t* meta, const char* filename, struct iio_device* dev)
+{
+    capture_meta_header_t hdr;
+    uint32_t status;
+
+    memset(meta, 0, sizeof(*meta));
+    meta->dev = dev;
+    if((meta->file = fopen(filename, "wb")) == NULL) {
+        return -1;
+    }
+
+    if(iio_device_reg_read(dev, RX_DMA_STATUS_REG, &status) == 0) {
+        meta->ovf_valid = true;
+        iio_device_reg_write(dev, RX_DMA_STATUS_REG, RX_DMA_STATUS_OVF);
+    } else {
+        info("Rx DMA status is not readable, overflows will not be flagged\n");
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, META_MAGIC, sizeof(hdr.magic));
+    hdr.version = META_VERSION;
+    hdr.header_size = sizeof(hdr);
+    hdr.record_size = sizeof(capture_meta_record_t);
+    hdr.flags = meta->ovf_valid ? META_HDR_OVF_VALID : 0;
+    hdr.sample_size = iio_device_get_sample_size(dev);
+    hdr.samples_per_block = SAMPLES_PER_BUFF;
+    if(fwrite(&hdr, sizeof(hdr), 1, meta->file) != 1) {
+        fclose(meta->file);
+        meta->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fills in the record of a block which has just been refilled, and updates the
+ * refill timing. t_start is when iio_buffer_refill() was called. The Rx DMA
+ * overflow flag is read and cleared each block, so it covers the time since
+ * the previous refill.
+ */
+static void meta_refill(capture_meta_t* meta, capture_stats_t* stats, uint64_t t_start,
+                        size_t len, capture_meta_record_t* rec)
+{
+    uint64_t t_end = now_ns();
+    uint64_t interval;
+    uint32_t status;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->sequence = stats->blocks_captured - 1;
+    rec->timestamp_ns = t_end;
+    rec->bytes = len;
+    rec->refill_ns = (t_end - t_start) > UINT32_MAX ? UINT32_MAX : (t_end - t_start);
+    rec->flags = meta->pending_flags;
+    meta->pending_flags = 0;
+
+    if(meta->ovf_valid && iio_device_reg_read(meta->dev, RX_DMA_STATUS_REG, &status) == 0 &&
+       (status & RX_DMA_STATUS_OVF)) {
+        iio_device_reg_write(meta->dev, RX_DMA_STATUS_REG, RX_DMA_STATUS_OVF);
+        rec->flags |= META_REC_OVF;
+        stats->ovf_blocks++;
+    }
+
+    if(stats->blocks_captured == 1) {
+        stats->first_ns = t_end;
+    } else {
+        interval = t_end - stats->last_ns;
+        if(stats->blocks_captured == 2 || interval < stats->interval_min_ns) {
+            stats->interval_min_ns = interval;
+        }
+        if(interval > stats->interval_max_ns) {
+            stats->interval_max_ns = interval;
+        }
+    }
+    stats->last_ns = t_end;
+}
+
+/**
+ * Appends a block record to the sidecar
+ */
+static void meta_write(capture_meta_t* meta, const capture_meta_record_t* rec)
+{
+    if(fwrite(rec, sizeof(*rec), 1, meta->file) != 1) {
+        meta->write_errors++;
+    } else {
+        meta->records++;
+    }
+}
+
+static void meta_close(capture_meta_t* meta)
+{
+    if(meta->file) {
+        fclose(meta->file);
+        meta->file = NULL;
+    }
+}
+
+/**
+ * Makes sure at least 'needed' bytes of the output file are allocated,
+ * growing it in OUTPUT_PREALLOC_BYTES steps
+ */
+static int output_reserve(capture_output_t* out, uint64_t needed)
+{
+    uint64_t grow_to;
+    int result;
+
+    if(needed <= out->allocated) {
+        return 0;
+    }
+    grow_to = needed + OUTPUT_PREALLOC_BYTES - (needed % OUTPUT_PREALLOC_BYTES);
+    if((result = posix_fallocate(out->fd, out->allocated, grow_to - out->allocated)) != 0) {
+        error("Could not preallocate the output file: %s\n", strerror(result));
+        return -1;
+    }
+    out->allocated = grow_to;
+    return 0;
+}
+
+/**
+ * Finds the speed of the interface a connected socket goes out through, from
+ * /sys/class/net. Returns 0 when it isn't known, i.e. for loopback.
+ */
+static unsigned int net_link_speed(int fd)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    struct ifaddrs* ifs;
+    struct ifaddrs* ifa;
+    char path[128];
+    FILE* f;
+    int speed = 0;
+
+    if(getsockname(fd, (struct sockaddr*)&local, &len) < 0 || getifaddrs(&ifs) < 0) {
+        return 0;
+    }
+    for(ifa = ifs; ifa; ifa = ifa->ifa_next) {
+        if(ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != local.ss_family) {
+            continue;
+        }
+        if(local.ss_family == AF_INET &&
+           ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr ==
+           ((struct sockaddr_in*)&local)->sin_addr.s_addr) {
+            break;
+        }
+        if(local.ss_family == AF_INET6 &&
+           memcmp(&((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr,
+                  &((struct sockaddr_in6*)&local)->sin6_addr, sizeof(struct in6_addr)) == 0) {
+            break;
+        }
+    }
+    if(ifa) {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/speed", ifa->ifa_name);
+        if((f = fopen(path, "r")) != NULL) {
+            if(fscanf(f, "%d", &speed) != 1 || speed < 0) {
+                speed = 0;
+            }
+            fclose(f);
+        }
+    }
+    freeifaddrs(ifs);
+    return speed;
+}
+
+/**
+ * Connects the net back end to a host:port, with a send buffer large enough to
+ * ride out the gaps between refills without the link going idle
+ */
+static int net_open(capture_output_t* out, const char* dest)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res;
+    struct addrinfo* ai;
+    char host[256];
+    const char* port;
+    int size = NET_SOCKET_BUFFER_BYTES;
+    socklen_t len = sizeof(size);
+    int result;
+
+    //The last ':' splits the port off, so the host may be a name or address
+    if((port = strrchr(dest, ':')) == NULL || port == dest ||
+       (size_t)(port - dest) >= sizeof(host)) {
+        error("Net output must be host:port, not %s\n", dest);
+        return -1;
+    }
+    memcpy(host, dest, port - dest);
+    host[port - dest] = '\0';
+    port++;
+
+    if((result = getaddrinfo(host, port, &hints, &res)) != 0) {
+        error("Could not resolve %s: %s\n", dest, gai_strerror(result));
+        return -1;
+    }
+    for(ai = res; ai; ai = ai->ai_next) {
+        if((out->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+            continue;
+        }
+        //Has to be set before connecting for the window scaling to use it
+        setsockopt(out->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        if(connect(out->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(out->fd);
+        out->fd = -1;
+    }
+    freeaddrinfo(res);
+    if(out->fd < 0) {
+        error("Could not connect to %s\n", dest);
+        return -1;
+    }
+
+    //Linux reports double the size granted, to allow for its own overhead
+    getsockopt(out->fd, SOL_SOCKET, SO_SNDBUF, &size, &len);
+    out->link_mbps = net_link_speed(out->fd);
+    info("Streaming to %s, %d KB send buffer\n", dest, size / 2 / 1024);
+    return 0;
+}
+
+/**
+ * Sends a block over the net back end, however many calls it takes
+ */
+static int output_write_net(capture_output_t* out, const uint8_t* data, size_t len)
+{
+    ssize_t n;
+
+    while(len) {
+        //A closed receiver is an error on this block, not a SIGPIPE
+        if((n = send(out->fd, data, len, MSG_NOSIGNAL)) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        out->offset += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Opens the output file with the requested back end
+ */
+static int output_open(capture_output_t* out, output_type_t type, const char* filename)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    memset(out, 0, sizeof(*out));
+    out->type = type;
+    out->fd = -1;
+
+    switch(type) {
+    case OUTPUT_STDIO:
+        if((out->file = fopen(filename, "wb")) == NULL) {
+            return -1;
+        }
+        break;
+    case OUTPUT_DIRECT:
+        flags |= O_DIRECT;
+        /* fall through */
+    case OUTPUT_MMAP:
+        //A shared writable mapping needs the file opened for reading as well
+        if(type == OUTPUT_MMAP) {
+            flags = (flags & ~O_WRONLY) | O_RDWR;
+        }
+        if((out->fd = open(filename, flags, 0644)) < 0) {
+            return -1;
+        }
+        break;
+    case OUTPUT_NET:
+        return net_open(out, filename);
+    }
+    return 0;
+}
+
+/**
+ * Writes through the O_DIRECT back end. Blocks that are already aligned are
+ * written straight from the caller's memory. Anything else is staged through
+ * an aligned bounce buffer until a full aligned chunk is available.
+ */
+static int output_write_direct(capture_output_t* out, const uint8_t* data, size_t len)
+{
+    size_t n;
+    uint64_t file_pos = out->offset - out->bounce_used;
+
+    if(out->bounce_used == 0 && ((uintptr_t)data % DIRECT_IO_ALIGN) == 0 &&
+       (len % DIRECT_IO_ALIGN) == 0) {
+        if(output_reserve(out, out->offset + len) < 0) {
+            return -1;
+        }
+        if(pwrite(out->fd, data, len, out->offset) != (ssize_t)len) {
+            return -1;
+        }
+        out->offset += len;
+        return 0;
+    }
+
+    if(out->bounce == NULL) {
+        out->bounce_size = (len + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+        if(posix_memalign((void**)&out->bounce, DIRECT_IO_ALIGN, out->bounce_size) != 0) {
+            out->bounce = NULL;
+            return -1;
+        }
+    }
+
+    out->bounce_copies++;
+    while(len) {
+        n = out->bounce_size - out->bounce_used;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(out->bounce + out->bounce_used, data, n);
+        out->bounce_used += n;
+        out->offset += n;
+        data += n;
+        len -= n;
+
+        if(out->bounce_used == out->bounce_size) {
+            if(output_reserve(out, file_pos + out->bounce_size) < 0 ||
+               pwrite(out->fd, out->bounce, out->bounce_size, file_pos) != (ssize_t)out->bounce_size) {
+                return -1;
+            }
+            file_pos += out->bounce_size;
+            out->bounce_used = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes through the mmap back end by copying into a sliding window mapped over
+ * the preallocated file. Completed windows are left to the kernel writeback.
+ */
+static int output_write_mmap(capture_output_t* out, const uint8_t* data, size_t len)
+{
+    size_t n;
+
+    while(len) {
+        if(out->map == NULL || out->offset >= out->map_offset + OUTPUT_MMAP_WINDOW) {
+            if(out->map) {
+                munmap(out->map, OUTPUT_MMAP_WINDOW);
+                out->map = NULL;
+            }
+            out->map_offset = out->offset - (out->offset % OUTPUT_MMAP_WINDOW);
+            if(output_reserve(out, out->map_offset + OUTPUT_MMAP_WINDOW) < 0) {
+                return -1;
+            }
+            out->map = mmap(NULL, OUTPUT_MMAP_WINDOW, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, out->fd, out->map_offset);
+            if(out->map == MAP_FAILED) {
+                out->map = NULL;
+                return -1;
+            }
+            madvise(out->map, OUTPUT_MMAP_WINDOW, MADV_SEQUENTIAL);
+        }
+
+        n = out->map_offset + OUTPUT_MMAP_WINDOW - out->offset;
+        if(n > len) {
+            n = len;
+        }
+        memcpy(out->map + (out->offset - out->map_offset), data, n);
+        out->offset += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int convert_write(capture_convert_t* cv, const uint8_t* data, size_t len);
+static void convert_close(capture_output_t* out);
+
+/**
+ * Writes a block of samples to the output file. For a converted format, the
+ * offset still counts the interleaved bytes taken in.
+ */
+static int output_write(capture_output_t* out, const void* data, size_t len)
+{
+    if(out->conv) {
+        if(convert_write(out->conv, data, len) < 0) {
+            return -1;
+        }
+        out->offset += len;
+        return 0;
+    }
+
+    switch(out->type) {
+    case OUTPUT_STDIO:
+        if(fwrite(data, 1, len, out->file) != len) {
+            return -1;
+        }
+        out->offset += len;
+        return 0;
+    case OUTPUT_DIRECT:
+        return output_write_direct(out, data, len);
+    case OUTPUT_MMAP:
+        return output_write_mmap(out, data, len);
+    case OUTPUT_NET:
+        return output_write_net(out, data, len);
+    }
+    return -1;
+}
+
+/**
+ * Flushes anything pending, trims the preallocated file down to the data
+ * actually written and closes it
+ */
+static void output_close(capture_output_t* out)
+{
+    size_t padded;
+
+    if(out->conv) {
+        convert_close(out);
+        return;
+    }
+    //Wait for the writeback too, so the sustained rate is the disk's and not
+    //the rate of copying into the page cache
+    if(out->file) {
+        if(fflush(out->file) != 0 || (fsync(fileno(out->file)) < 0 && errno != EINVAL)) {
+            error("Could not flush the output file\n");
+        }
+        fclose(out->file);
+        out->file = NULL;
+    }
+    if(out->fd < 0) {
+        return;
+    }
+    if(out->type == OUTPUT_NET) {
+        close(out->fd);
+        out->fd = -1;
+        return;
+    }
+
+    //O_DIRECT can only write whole aligned chunks, so pad the tail and trim it
+    if(out->bounce_used) {
+        padded = (out->bounce_used + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1);
+        memset(out->bounce + out->bounce_used, 0, padded - out->bounce_used);
+        if(pwrite(out->fd, out->bounce, padded, out->offset - out->bounce_used) != (ssize_t)padded) {
+            error("Could not write the final partial block\n");
+        }
+    }
+    if(out->map) {
+        if(msync(out->map, OUTPUT_MMAP_WINDOW, MS_SYNC) < 0) {
+            error("Could not flush the output mapping\n");
+        }
+        munmap(out->map, OUTPUT_MMAP_WINDOW);
+    }
+    if(ftruncate(out->fd, out->offset) < 0) {
+        error("Could not trim the output file\n");
+    }
+    if(fsync(out->fd) < 0 && errno != EINVAL) {
+        error("Could not flush the output file\n");
+    }
+    close(out->fd);
+    free(out->bounce);
+    out->fd = -1;
+    out->bounce = NULL;
+    out->map = NULL;
+}
+
+/**
+ * Scalar conversions of frames interleaved frames of num_ch channels, for any
+ * channel count
+ */
+static void convert_planar(const int16_t* in, unsigned int num_ch, uint8_t* const* out,
+                           size_t frames)
+{
+    size_t f;
+    unsigned int c;
+
+    for(f = 0; f < frames; f++) {
+        for(c = 0; c < num_ch; c++) {
+            ((int16_t*)out[c])[f] = *in++;
+        }
+    }
+}
+
+static void convert_cs16(const int16_t* in, unsigned int num_ch, uint8_t* const* out,
+                         size_t frames)
+{
+    const uint32_t* in32 = (const uint32_t*)in;
+    size_t f;
+    unsigned int k;
+
+    //An I/Q pair is moved as one 32 bit word
+    for(f = 0; f < frames; f++) {
+        for(k = 0; k < num_ch / 2; k++) {
+            ((uint32_t*)out[k])[f] = *in32++;
+        }
+    }
+}
+
+static void convert_cf32(const int16_t* in, unsigned int num_ch, uint8_t* const* out,
+                         size_t frames)
+{
+    size_t f;
+    unsigned int k;
+
+    for(f = 0; f < frames; f++) {
+        for(k = 0; k < num_ch / 2; k++) {
+            ((float*)out[k])[2 * f] = *in++ * CONVERT_CF32_SCALE;
+            ((float*)out[k])[2 * f + 1] = *in++ * CONVERT_CF32_SCALE;
+        }
+    }
+}
+
+/**
+ * Vector conversions of 4 interleaved channels, the layout this example
+ * captures. frames must be a multiple of 8.
+ */
+#if defined(__ARM_NEON)
+static void convert_planar4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    int16x8x4_t v;
+    size_t f;
+    unsigned int c;
+
+    for(f = 0; f < frames; f += 8, in += 32) {
+        v = vld4q_s16(in);
+        for(c = 0; c < 4; c++) {
+            vst1q_s16((int16_t*)out[c] + f, v.val[c]);
+        }
+    }
+}
+
+static void convert_cs16_4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    uint32x4x2_t v;
+    size_t f;
+
+    for(f = 0; f < frames; f += 4, in += 16) {
+        v = vld2q_u32((const uint32_t*)in);
+        vst1q_u32((uint32_t*)out[0] + f, v.val[0]);
+        vst1q_u32((uint32_t*)out[1] + f, v.val[1]);
+    }
+}
+
+static void convert_cf32_4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    int16x8x4_t v;
+    float32x4x2_t lo, hi;
+    size_t f;
+    unsigned int k;
+
+    for(f = 0; f < frames; f += 8, in += 32) {
+        v = vld4q_s16(in);
+        for(k = 0; k < 2; k++) {
+            lo.val[0] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[2 * k]))),
+                                    CONVERT_CF32_SCALE);
+            lo.val[1] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[2 * k + 1]))),
+                                    CONVERT_CF32_SCALE);
+            hi.val[0] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[2 * k]))),
+                                    CONVERT_CF32_SCALE);
+            hi.val[1] = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[2 * k + 1]))),
+                                    CONVERT_CF32_SCALE);
+            vst2q_f32((float*)out[k] + 2 * f, lo);
+            vst2q_f32((float*)out[k] + 2 * f + 8, hi);
+        }
+    }
+}
+#elif defined(__SSE2__)
+static void convert_planar4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    __m128i a, b, c, d, t0, t1, t2, t3, u0, u1, u2, u3;
+    size_t f;
+
+    //8 frames at a time. Two rounds of 16 bit unpacks gather 4 frames of each
+    //channel together, and a 64 bit unpack joins the two halves
+    for(f = 0; f < frames; f += 8, in += 32) {
+        a = _mm_loadu_si128((const __m128i*)in);
+        b = _mm_loadu_si128((const __m128i*)(in + 8));
+        c = _mm_loadu_si128((const __m128i*)(in + 16));
+        d = _mm_loadu_si128((const __m128i*)(in + 24));
+        t0 = _mm_unpacklo_epi16(a, b);
+        t1 = _mm_unpackhi_epi16(a, b);
+        t2 = _mm_unpacklo_epi16(c, d);
+        t3 = _mm_unpackhi_epi16(c, d);
+        u0 = _mm_unpacklo_epi16(t0, t1);
+        u1 = _mm_unpackhi_epi16(t0, t1);
+        u2 = _mm_unpacklo_epi16(t2, t3);
+        u3 = _mm_unpackhi_epi16(t2, t3);
+        _mm_storeu_si128((__m128i*)((int16_t*)out[0] + f), _mm_unpacklo_epi64(u0, u2));
+        _mm_storeu_si128((__m128i*)((int16_t*)out[1] + f), _mm_unpackhi_epi64(u0, u2));
+        _mm_storeu_si128((__m128i*)((int16_t*)out[2] + f), _mm_unpacklo_epi64(u1, u3));
+        _mm_storeu_si128((__m128i*)((int16_t*)out[3] + f), _mm_unpackhi_epi64(u1, u3));
+    }
+}
+
+/**
+ * Splits 4 frames of 2 I/Q pairs into 4 of each pair, as 32 bit words
+ */
+static inline void convert_pairs4(const int16_t* in, __m128i* p0, __m128i* p1)
+{
+    __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)in), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(in + 8)), _MM_SHUFFLE(3, 1, 2, 0));
+
+    *p0 = _mm_unpacklo_epi64(a, b);
+    *p1 = _mm_unpackhi_epi64(a, b);
+}
+
+static void convert_cs16_4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    __m128i p0, p1;
+    size_t f;
+
+    for(f = 0; f < frames; f += 4, in += 16) {
+        convert_pairs4(in, &p0, &p1);
+        _mm_storeu_si128((__m128i*)((uint32_t*)out[0] + f), p0);
+        _mm_storeu_si128((__m128i*)((uint32_t*)out[1] + f), p1);
+    }
+}
+
+/**
+ * Stores 4 I/Q pairs as 8 floats
+ */
+static inline void convert_store_cf32(float* out, __m128i iq)
+{
+    __m128 scale = _mm_set1_ps(CONVERT_CF32_SCALE);
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(iq, iq), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(iq, iq), 16);
+
+    _mm_storeu_ps(out, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(out + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+
+static void convert_cf32_4(const int16_t* in, uint8_t* const* out, size_t frames)
+{
+    __m128i p0, p1;
+    size_t f;
+
+    for(f = 0; f < frames; f += 4, in += 16) {
+        convert_pairs4(in, &p0, &p1);
+        convert_store_cf32((float*)out[0] + 2 * f, p0);
+        convert_store_cf32((float*)out[1] + 2 * f, p1);
+    }
+}
+#endif
+
+/**
+ * The int16 sample a stored 12 bit value v comes back as. The 12 bits go back
+ * to where they were taken from, and the bits above them are their sign.
+ */
+static inline int16_t unpack12_sample(uint16_t v, unsigned int shift)
+{
+    return (int16_t)(uint16_t)(v << PACK12_MAX_SHIFT) >> (PACK12_MAX_SHIFT - shift);
+}
+
+/**
+ * Scalar pack12 of n int16 samples, n even, shifted right by shift. Returns
+ * the OR of the bits of every sample which don't come back when unpacked, 0
+ * when the packing is lossless.
+ */
+static uint16_t pack12_scalar(const int16_t* in, size_t n, uint8_t* out, unsigned int shift)
+{
+    uint16_t lost = 0;
+    uint16_t a, b;
+    size_t i;
+
+    for(i = 0; i < n; i += 2) {
+        a = ((uint16_t)in[i] >> shift) & 0x0FFF;
+        b = ((uint16_t)in[i + 1] >> shift) & 0x0FFF;
+        lost |= (uint16_t)(in[i] ^ unpack12_sample(a, shift)) |
+                (uint16_t)(in[i + 1] ^ unpack12_sample(b, shift));
+        *out++ = (uint8_t)a;
+        *out++ = (uint8_t)((a >> 8) | (b << 4));
+        *out++ = (uint8_t)(b >> 4);
+    }
+    return lost;
+}
+
+/**
+ * The OR of the bits of n int16 samples which pack12 would lose, without
+ * packing them, so a block can be checked whole before any of it is written
+ */
+static uint16_t pack12_lost(const int16_t* in, size_t n, unsigned int shift)
+{
+    uint16_t lost = 0;
+    size_t i;
+
+    for(i = 0; i < n; i++) {
+        lost |= (uint16_t)(in[i] ^ unpack12_sample(((uint16_t)in[i] >> shift) & 0x0FFF, shift));
+    }
+    return lost;
+}
+
+/**
+ * Scalar unpack of n pack12 samples back to int16, n even
+ */
+static void unpack12_scalar(const uint8_t* in, size_t n, int16_t* out, unsigned int shift)
+{
+    size_t i;
+
+    for(i = 0; i < n; i += 2, in += 3) {
+        out[i] = unpack12_sample(in[0] | (in[1] & 0x0F) << 8, shift);
+        out[i + 1] = unpack12_sample(in[1] >> 4 | in[2] << 4, shift);
+    }
+}
+
+/**
+ * Vector pack12 and unpack. Both run a whole number of vectors and leave the
+ * tail to the scalar code.
+ */
+#if defined(__ARM_NEON)
+/* 12 bit values in each lane back to the int16 samples, as unpack12_sample() */
+static inline uint16x8_t unpack12_vec(uint16x8_t v, int16x8_t back)
+{
+    return vreinterpretq_u16_s16(vshlq_s16(vreinterpretq_s16_u16(vshlq_n_u16(v, PACK12_MAX_SHIFT)),
+                                           back));
+}
+
+static uint16_t pack12(const int16_t* in, size_t n, uint8_t* out, unsigned int shift)
+{
+    const int16x8_t right = vdupq_n_s16(-(int16_t)shift);
+    const int16x8_t back = vdupq_n_s16(-(int16_t)(PACK12_MAX_SHIFT - shift));
+    const uint16x8_t mask = vdupq_n_u16(0x0FFF);
+    uint16x8x2_t v;
+    uint16x8_t a, b;
+    uint16x8_t lost = vdupq_n_u16(0);
+    uint8x8x3_t p;
+    uint16_t lanes[8];
+    uint16_t lost_bits = 0;
+    size_t i;
+    unsigned int k;
+
+    //16 samples at a time. vld2q splits the even and odd samples of each pair,
+    //and vst3 interleaves the three bytes of each pair back together
+    for(i = 0; i + 16 <= n; i += 16, out += 24) {
+        v = vld2q_u16((const uint16_t*)in + i);
+        a = vandq_u16(vshlq_u16(v.val[0], right), mask);
+        b = vandq_u16(vshlq_u16(v.val[1], right), mask);
+        lost = vorrq_u16(lost, vorrq_u16(veorq_u16(v.val[0], unpack12_vec(a, back)),
+                                         veorq_u16(v.val[1], unpack12_vec(b, back))));
+        p.val[0] = vmovn_u16(a);
+        p.val[1] = vmovn_u16(vorrq_u16(vshrq_n_u16(a, 8), vshlq_n_u16(b, 4)));
+        p.val[2] = vshrn_n_u16(b, 4);
+        vst3_u8(out, p);
+    }
+    vst1q_u16(lanes, lost);
+    for(k = 0; k < 8; k++) {
+        lost_bits |= lanes[k];
+    }
+    return lost_bits | pack12_scalar(in + i, n - i, out, shift);
+}
+
+static void unpack12(const uint8_t* in, size_t n, int16_t* out, unsigned int shift)
+{
+    const int16x8_t back = vdupq_n_s16(-(int16_t)(PACK12_MAX_SHIFT - shift));
+    uint8x8x3_t p;
+    uint16x8_t b1;
+    uint16x8x2_t v;
+    size_t i;
+
+    for(i = 0; i + 16 <= n; i += 16, in += 24) {
+        p = vld3_u8(in);
+        b1 = vmovl_u8(p.val[1]);
+        v.val[0] = unpack12_vec(vorrq_u16(vmovl_u8(p.val[0]),
+                                          vshlq_n_u16(vandq_u16(b1, vdupq_n_u16(0x0F)), 8)), back);
+        v.val[1] = unpack12_vec(vorrq_u16(vshrq_n_u16(b1, 4), vshlq_n_u16(vmovl_u8(p.val[2]), 4)),
+                                back);
+        vst2q_u16((uint16_t*)out + i, v);
+    }
+    unpack12_scalar(in, n - i, out + i, shift);
+}
+#elif defined(__SSE2__)
+static uint16_t pack12(const int16_t* in, size_t n, uint8_t* out, unsigned int shift)
+{
+    const __m128i right = _mm_cvtsi32_si128(shift);
+    const __m128i back = _mm_cvtsi32_si128(PACK12_MAX_SHIFT - shift);
+    const __m128i mask = _mm_set1_epi16(0x0FFF);
+    const __m128i mask_a = _mm_set1_epi32(0x00000FFF);
+    const __m128i mask_b = _mm_set1_epi32(0x00FFF000);
+    const __m128i mask_w0 = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m128i mask_w1 = _mm_set1_epi64x(0x0000FFFFFF000000LL);
+    __m128i x, s;
+    __m128i lost = _mm_setzero_si128();
+    uint64_t w[2];
+    uint16_t lanes[8];
+    uint16_t lost_bits = 0;
+    size_t i;
+    unsigned int k;
+
+    //8 samples at a time. Each pair is joined into a 24 bit word in its 32 bit
+    //lane, then each two words into 48 bits of a 64 bit lane, and the 6 low
+    //bytes of each lane are the packed output
+    for(i = 0; i + 8 <= n; i += 8, out += 12) {
+        s = _mm_loadu_si128((const __m128i*)(in + i));
+        x = _mm_and_si128(_mm_srl_epi16(s, right), mask);
+        lost = _mm_or_si128(lost, _mm_xor_si128(s, _mm_sra_epi16(_mm_slli_epi16(x, PACK12_MAX_SHIFT),
+                                                                 back)));
+        x = _mm_or_si128(_mm_and_si128(x, mask_a), _mm_and_si128(_mm_srli_epi32(x, 4), mask_b));
+        x = _mm_or_si128(_mm_and_si128(x, mask_w0), _mm_and_si128(_mm_srli_epi64(x, 8), mask_w1));
+        _mm_storeu_si128((__m128i*)w, x);
+        memcpy(out, &w[0], 6);
+        memcpy(out + 6, &w[1], 6);
+    }
+    _mm_storeu_si128((__m128i*)lanes, lost);
+    for(k = 0; k < 8; k++) {
+        lost_bits |= lanes[k];
+    }
+    return lost_bits | pack12_scalar(in + i, n - i, out, shift);
+}
+
+static void unpack12(const uint8_t* in, size_t n, int16_t* out, unsigned int shift)
+{
+    const __m128i back = _mm_cvtsi32_si128(PACK12_MAX_SHIFT - shift);
+    const __m128i mask_a = _mm_set1_epi32(0x00000FFF);
+    const __m128i mask_b = _mm_set1_epi32(0x0FFF0000);
+    const __m128i mask_w0 = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m128i mask_w1 = _mm_set1_epi64x(0x00FFFFFF00000000LL);
+    __m128i x;
+    size_t i;
+
+    //The reverse of pack12, 8 samples from 12 bytes at a time. The 16 byte
+    //load reads past those 12, so the last vector is left to the scalar code
+    for(i = 0; i + 16 <= n; i += 8, in += 12) {
+        x = _mm_loadu_si128((const __m128i*)in);
+        x = _mm_unpacklo_epi64(x, _mm_srli_si128(x, 6));
+        x = _mm_or_si128(_mm_and_si128(x, mask_w0), _mm_and_si128(_mm_slli_epi64(x, 8), mask_w1));
+        x = _mm_or_si128(_mm_and_si128(x, mask_a), _mm_and_si128(_mm_slli_epi32(x, 4), mask_b));
+        _mm_storeu_si128((__m128i*)(out + i),
+                         _mm_sra_epi16(_mm_slli_epi16(x, PACK12_MAX_SHIFT), back));
+    }
+    unpack12_scalar(in, n - i, out + i, shift);
+}
+#else
+#define pack12 pack12_scalar
+#define unpack12 unpack12_scalar
+#endif
+
+/**
+ * Converts one chunk of frames into the staging buffers
+ */
+static void convert_chunk(capture_convert_t* cv, const int16_t* in, size_t frames)
+{
+    //pack12 picks its own kernel and handles any length
+    if(cv->format == FORMAT_PACK12) {
+        cv->lost_bits |= pack12(in, frames * cv->num_ch, cv->stage[0], cv->pack_shift);
+        return;
+    }
+#ifdef VERIFY_VEC_LANES
+    if(cv->num_ch == 4 && (frames % 8) == 0) {
+        switch(cv->format) {
+        case FORMAT_PLANAR:
+            convert_planar4(in, cv->stage, frames);
+            return;
+        case FORMAT_CS16:
+            convert_cs16_4(in, cv->stage, frames);
+            return;
+        case FORMAT_CF32:
+            convert_cf32_4(in, cv->stage, frames);
+            return;
+        default:
+            return;
+        }
+    }
+#endif
+    switch(cv->format) {
+    case FORMAT_PLANAR:
+        convert_planar(in, cv->num_ch, cv->stage, frames);
+        break;
+    case FORMAT_CS16:
+        convert_cs16(in, cv->num_ch, cv->stage, frames);
+        break;
+    case FORMAT_CF32:
+        convert_cf32(in, cv->num_ch, cv->stage, frames);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Converts a block of interleaved frames and writes each stream out, a chunk
+ * at a time. Blocks are always whole frames.
+ */
+static int convert_write(capture_convert_t* cv, const uint8_t* data, size_t len)
+{
+    size_t frame_size = cv->num_ch * sizeof(int16_t);
+    size_t frames = len / frame_size;
+    size_t n, bytes;
+    unsigned int s;
+    int ret = 0;
+
+    if(cv->lost_bits) {
+        return -1;
+    }
+    //The whole block is checked first, so none of a lossy block is written and
+    //the capture stops here instead
+    if(cv->format == FORMAT_PACK12) {
+        cv->lost_bits = pack12_lost((const int16_t*)data, frames * cv->num_ch, cv->pack_shift);
+        if(cv->lost_bits) {
+            error("Samples have bits 0x%04X set which pack12 can't store, stopping\n",
+                  cv->lost_bits);
+            stop_loop = true;
+            return -1;
+        }
+    }
+    while(frames) {
+        n = frames < CONVERT_CHUNK_FRAMES ? frames : CONVERT_CHUNK_FRAMES;
+        convert_chunk(cv, (const int16_t*)data, n);
+        bytes = cv->stage_size / CONVERT_CHUNK_FRAMES * n;
+        for(s = 0; s < cv->num_streams; s++) {
+            if(output_write(&cv->streams[s], cv->stage[s], bytes) < 0) {
+                ret = -1;
+            }
+        }
+        data += n * frame_size;
+        frames -= n;
+    }
+    return ret;
+}
+
+/**
+ * Writes the header of a pack12 file, with the channel layout and the sample
+ * rate read from the first channel
+ */
+static int pack12_header(capture_output_t* out, struct iio_channel* const* chans,
+                         unsigned int num_ch, unsigned int shift)
+{
+    capture_pack12_header_t* hdr;
+    long long rate;
+    unsigned int c;
+    int ret;
+
+    //A whole aligned header, so O_DIRECT writes it without a bounce copy
+    if(posix_memalign((void**)&hdr, DIRECT_IO_ALIGN, PACK12_HEADER_SIZE) != 0) {
+        return -1;
+    }
+    memset(hdr, 0, PACK12_HEADER_SIZE);
+    memcpy(hdr->magic, PACK12_MAGIC, sizeof(hdr->magic));
+    hdr->version = PACK12_VERSION;
+    hdr->header_size = PACK12_HEADER_SIZE;
+    hdr->num_ch = num_ch;
+    hdr->bits = PACK12_BITS;
+    hdr->shift = shift;
+    if(iio_channel_attr_read_longlong(chans[0], "sampling_frequency", &rate) == 0 && rate > 0) {
+        hdr->sample_rate = rate;
+    }
+    for(c = 0; c < num_ch; c++) {
+        snprintf(hdr->channels[c], sizeof(hdr->channels[c]), "%s", iio_channel_get_id(chans[c]));
+    }
+    ret = output_write(out, hdr, PACK12_HEADER_SIZE);
+    free(hdr);
+    return ret;
+}
+
+/**
+ * Picks the shift of pack12 from the data format of the channels, so the 12
+ * bits stored are the top of the bits the channels carry. Channels of more
+ * than 12 bits are packed too, but only for as long as their low bits are
+ * zero. Returns the shift, or negative if the format can't be packed.
+ */
+static int pack12_shift(struct iio_channel* const* chans, unsigned int num_ch)
+{
+    const struct iio_data_format* fmt = iio_channel_get_data_format(chans[0]);
+    const struct iio_data_format* other;
+    unsigned int c;
+    int shift;
+
+    for(c = 1; c < num_ch; c++) {
+        other = iio_channel_get_data_format(chans[c]);
+        if(other->length != fmt->length || other->bits != fmt->bits ||
+           other->shift != fmt->shift || other->is_signed != fmt->is_signed) {
+            error("pack12 needs the same format on every channel, %s and %s differ\n",
+                  iio_channel_get_id(chans[0]), iio_channel_get_id(chans[c]));
+            return -1;
+        }
+    }
+    if(fmt->length != 16 || !fmt->is_signed || fmt->bits == 0 || fmt->bits + fmt->shift > 16) {
+        error("pack12 needs signed samples in 16 bits, %s is %c%u/%u>>%u\n",
+              iio_channel_get_id(chans[0]), fmt->is_signed ? 's' : 'u', fmt->bits,
+              fmt->length, fmt->shift);
+        return -1;
+    }
+    if(fmt->bits > PACK12_BITS) {
+        shift = fmt->shift + fmt->bits - PACK12_BITS;
+        info("%s carries %u bits, pack12 stops if any of the low %d are set\n",
+             iio_channel_get_id(chans[0]), fmt->bits, shift - (int)fmt->shift);
+    } else {
+        shift = fmt->shift < PACK12_MAX_SHIFT ? fmt->shift : PACK12_MAX_SHIFT;
+    }
+    return shift;
+}
+
+/**
+ * Opens the output for a converted format. Each stream gets its own file,
+ * named after the channel, or the I channel of the pair without the _i:
+ * <filename>.voltage0_i for planar, <filename>.voltage0 for cs16 and cf32.
+ * pack12 is a single stream, written to <filename> after its header. Every
+ * stream uses the same back end.
+ */
+static int convert_open(capture_output_t* out, format_t format, output_type_t type,
+                        const char* filename, struct iio_channel* const* chans,
+                        unsigned int num_ch)
+{
+    capture_convert_t* cv;
+    char name[256];
+    const char* id;
+    unsigned int s;
+    size_t id_len;
+    int shift = 0;
+
+    memset(out, 0, sizeof(*out));
+    out->type = type;
+    out->fd = -1;
+    if(num_ch > CONVERT_MAX_CH || (format != FORMAT_PLANAR && (num_ch % 2) != 0)) {
+        return -1;
+    }
+    if(format == FORMAT_PACK12 && (shift = pack12_shift(chans, num_ch)) < 0) {
+        return -1;
+    }
+    if((cv = calloc(1, sizeof(*cv))) == NULL) {
+        return -1;
+    }
+    out->conv = cv;
+    cv->format = format;
+    cv->pack_shift = shift;
+    cv->num_ch = num_ch;
+    cv->num_streams = (format == FORMAT_PLANAR) ? num_ch : num_ch / 2;
+    switch(format) {
+    case FORMAT_PLANAR:
+        cv->stage_size = CONVERT_CHUNK_FRAMES * sizeof(int16_t);
+        break;
+    case FORMAT_CS16:
+        cv->stage_size = CONVERT_CHUNK_FRAMES * 2 * sizeof(int16_t);
+        break;
+    case FORMAT_PACK12:
+        cv->num_streams = 1;
+        cv->stage_size = CONVERT_CHUNK_FRAMES * num_ch * 3 / 2;
+        break;
+    default:
+        cv->stage_size = CONVERT_CHUNK_FRAMES * 2 * sizeof(float);
+        break;
+    }
+
+    for(s = 0; s < cv->num_streams; s++) {
+        cv->streams[s].fd = -1;
+    }
+    for(s = 0; s < cv->num_streams; s++) {
+        //Staging is aligned so the O_DIRECT back end needs no bounce copy
+        if(posix_memalign((void**)&cv->stage[s], DIRECT_IO_ALIGN, cv->stage_size) != 0) {
+            cv->stage[s] = NULL;
+            return -1;
+        }
+        if(format == FORMAT_PACK12) {
+            if(output_open(&cv->streams[s], type, filename) < 0 ||
+               pack12_header(&cv->streams[s], chans, num_ch, cv->pack_shift) < 0) {
+                error("Couldn't create file %s\n", filename);
+                return -1;
+            }
+            continue;
+        }
+        id = iio_channel_get_id(chans[format == FORMAT_PLANAR ? s : s * 2]);
+        id_len = strlen(id);
+        if(format != FORMAT_PLANAR && id_len > 2 && strcmp(id + id_len - 2, "_i") == 0) {
+            id_len -= 2;
+        }
+        snprintf(name, sizeof(name), "%s.%.*s", filename, (int)id_len, id);
+        if(output_open(&cv->streams[s], type, name) < 0) {
+            error("Couldn't create file %s\n", name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Closes every stream of a converted output and frees it
+ */
+static void convert_close(capture_output_t* out)
+{
+    capture_convert_t* cv = out->conv;
+    unsigned int s;
+
+    for(s = 0; s < cv->num_streams; s++) {
+        output_close(&cv->streams[s]);
+        out->bounce_copies += cv->streams[s].bounce_copies;
+        out->stored += cv->streams[s].offset;
+        free(cv->stage[s]);
+    }
+    out->link_mbps = cv->streams[0].link_mbps;
+    free(cv);
+    out->conv = NULL;
+}
+
+/**
+ * Original single threaded capture. Each refill is written to the file before
+ * the next refill is requested.
+ */
+static int capture_inline(struct iio_buffer* sample_buff, capture_output_t* out,
+                          capture_meta_t* meta, bool continuous, capture_stats_t* stats)
+{
+    int i;
+    ssize_t refill_size;
+    uint64_t t_start;
+    capture_meta_record_t rec = { 0 };
 
+    for(i = 0; (continuous || i < NUM_SAMPLE_LOOPS) && !stop_loop; i++) {
+        t_start = now_ns();
+        refill_size = AD9081_TRACED(AD9081_TP_REFILL, SAMPLES_PER_BUFF * iio_buffer_step(sample_buff),
+                                    iio_buffer_refill(sample_buff));
+        if(refill_size < 0) {
+            error("Error code %ld when refilling buffer\n", refill_size);
+            return -1;
+        }
+        ad9081_rt_mark(&rt, now_ns());
+        stats->blocks_captured++;
+        if(meta->file) {
+            meta_refill(meta, stats, t_start, refill_size, &rec);
+            rec.offset = out->offset;
+        }
+        if(output_write(out, iio_buffer_start(sample_buff), refill_size) < 0) {
+            stats->write_errors++;
+            rec.flags |= META_REC_NOT_WRITTEN;
+        } else {
+            stats->blocks_written++;
+            stats->bytes_written += refill_size;
+        }
+        if(meta->file) {
+            meta_write(meta, &rec);
+        }
+    }
+    return 0;
+}
 
-#define NUM_SAMPLE_LOOPS    20
+/**
+ * Writer thread for the pipelined capture. Drains filled blocks from the ring
+ * to the file until the refill thread signals it is done and the ring is empty.
+ */
+static void* writer_thread(void* arg)
+{
+    writer_args_t* args = (writer_args_t*)arg;
+    capture_ring_t* ring = args->ring;
+    capture_block_t* block;
+    unsigned int tail;
 
-static struct iio_context *ctx = NULL;
+    while(true) {
+        sem_wait(&ring->filled);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if(tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            //Only woken without data when the refill side is finished
+            if(atomic_load(&ring->done)) {
+                break;
+            }
+            continue;
+        }
 
-int main(int argc, char* argv[])
+        block = &ring->blocks[tail % ring->num_blocks];
+        block->meta.offset = args->out->offset;
+        if(output_write(args->out, block->data, block->len) < 0) {
+            args->stats->write_errors++;
+            block->meta.flags |= META_REC_NOT_WRITTEN;
+        } else {
+            args->stats->blocks_written++;
+            args->stats->bytes_written += block->len;
+        }
+        if(args->meta->file) {
+            meta_write(args->meta, &block->meta);
+        }
+
+        //Hand the block back to the refill thread
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+/**
+ * Checks if any I/Q pair of p, n interleaved int16 words, has a squared
+ * magnitude above level_sq. I and Q of a channel are next to each other in
+ * the frame, so pairs never need deinterleaving.
+ */
+static bool trigger_level(const int16_t* p, size_t n, uint32_t level_sq)
+{
+    size_t k = 0;
+#if defined(__ARM_NEON)
+    uint32x4_t thr = vdupq_n_u32(level_sq);
+    int16x8x2_t v;
+    uint32x4_t lo, hi;
+    uint64x2_t hit;
+
+    //The sum of two squares fits in 32 bits, unsigned
+    for(; k + 16 <= n; k += 16) {
+        v = vld2q_s16(p + k);
+        lo = vreinterpretq_u32_s32(vmlal_s16(vmull_s16(vget_low_s16(v.val[0]), vget_low_s16(v.val[0])),
+                                             vget_low_s16(v.val[1]), vget_low_s16(v.val[1])));
+        hi = vreinterpretq_u32_s32(vmlal_s16(vmull_s16(vget_high_s16(v.val[0]), vget_high_s16(v.val[0])),
+                                             vget_high_s16(v.val[1]), vget_high_s16(v.val[1])));
+        hit = vreinterpretq_u64_u32(vorrq_u32(vcgtq_u32(lo, thr), vcgtq_u32(hi, thr)));
+        if(vgetq_lane_u64(hit, 0) | vgetq_lane_u64(hit, 1)) {
+            return true;
+        }
+    }
+#elif defined(__SSE2__)
+    //SSE2 only compares signed, so both sides are biased by 2^31
+    __m128i bias = _mm_set1_epi32((int)0x80000000);
+    __m128i thr = _mm_set1_epi32((int)(level_sq ^ 0x80000000));
+    __m128i v;
+
+    for(; k + 8 <= n; k += 8) {
+        v = _mm_loadu_si128((const __m128i*)(p + k));
+        v = _mm_xor_si128(_mm_madd_epi16(v, v), bias);
+        if(_mm_movemask_epi8(_mm_cmpgt_epi32(v, thr))) {
+            return true;
+        }
+    }
+#endif
+    for(; k + 2 <= n; k += 2) {
+        if((uint32_t)(p[k] * p[k]) + (uint32_t)(p[k + 1] * p[k + 1]) > level_sq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Checks every trigger source against a refilled block
+ */
+static bool trigger_check(capture_trigger_t* trig, const uint8_t* data, size_t len)
+{
+    char value;
+
+    if(trigger_signal) {
+        trigger_signal = false;
+        return true;
+    }
+    if(trig->gpio_fd >= 0 && pread(trig->gpio_fd, &value, 1, 0) == 1 && value == '1') {
+        return true;
+    }
+    return trig->level_sq && trigger_level((const int16_t*)data, len / sizeof(int16_t),
+                                           trig->level_sq);
+}
+
+/**
+ * Hands a history block to the writer thread. The buffers of the history block
+ * and the free ring slot are swapped, so the data isn't copied again.
+ */
+static void trigger_hand_over(capture_ring_t* ring, capture_block_t* block,
+                              capture_stats_t* stats)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    capture_block_t free_block;
+
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->num_blocks) {
+        stats->overruns++;
+        return;
+    }
+    free_block = ring->blocks[head % ring->num_blocks];
+    ring->blocks[head % ring->num_blocks] = *block;
+    *block = free_block;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    sem_post(&ring->filled);
+}
+
+/**
+ * Decides what happens to a refilled block in a triggered capture. Returns
+ * true if it is to be written, like any block in a pipelined capture. If not,
+ * it is copied into the history. A trigger while the post-trigger blocks are
+ * being written extends the window.
+ */
+static bool trigger_block(capture_trigger_t* trig, capture_ring_t* ring, const uint8_t* data,
+                          size_t len, const capture_meta_record_t* rec,
+                          capture_stats_t* stats)
+{
+    bool fired = trigger_check(trig, data, len);
+    capture_block_t* block;
+    unsigned int i;
+
+    if(trig->post_left) {
+        trig->post_left = fired ? trig->post_blocks : trig->post_left - 1;
+        return true;
+    }
+    if(fired) {
+        trig->events++;
+        info("Trigger %llu at block %llu\n", trig->events, stats->blocks_captured - 1);
+        //Oldest first
+        for(i = trig->hist_count; i > 0; i--) {
+            trigger_hand_over(ring, &trig->hist[(trig->hist_head - i) % trig->pre_blocks], stats);
+        }
+        trig->hist_count = 0;
+        trig->post_left = trig->post_blocks;
+        return true;
+    }
+
+    if(trig->pre_blocks == 0) {
+        trig->discarded++;
+        return false;
+    }
+    if(trig->hist_count == trig->pre_blocks) {
+        trig->discarded++;
+    } else {
+        trig->hist_count++;
+    }
+    block = &trig->hist[trig->hist_head++ % trig->pre_blocks];
+    memcpy(block->data, data, len);
+    block->len = len;
+    block->meta = *rec;
+    return false;
+}
+
+/**
+ * Pipelined capture. The calling thread only refills and copies into the next
+ * free block of the ring. A dedicated thread writes blocks to the file, so a
+ * slow write no longer delays the next refill. If the writer falls behind far
+ * enough that the ring is full, the new block is dropped and counted as an
+ * overrun rather than stalling the refill. Dropped blocks have no metadata
+ * record, so they show up as a gap in the record sequence numbers.
+ * With trig, only the blocks around each trigger are written.
+ */
+static int capture_pipelined(struct iio_buffer* sample_buff, capture_output_t* out,
+                             capture_meta_t* meta, bool continuous,
+                             unsigned int num_blocks, capture_trigger_t* trig,
+                             capture_stats_t* stats)
+{
+    int i;
+    int ret = 0;
+    ssize_t refill_size;
+    size_t block_size;
+    unsigned int b;
+    unsigned int head;
+    uint64_t t_start;
+    capture_meta_record_t rec = { 0 };
+    capture_ring_t* ring;
+    writer_args_t args;
+    pthread_t writer;
+
+    if((ring = calloc(1, sizeof(*ring))) == NULL) {
+        error("Could not allocate the capture ring\n");
+        return -1;
+    }
+
+    //Preallocate every block up front, sized to a full IIO buffer. Blocks are
+    //aligned so the O_DIRECT back end can write them without a bounce copy
+    block_size = (uint8_t*)iio_buffer_end(sample_buff) - (uint8_t*)iio_buffer_start(sample_buff);
+    ring->num_blocks = num_blocks;
+    for(b = 0; b < num_blocks; b++) {
+        if(posix_memalign((void**)&ring->blocks[b].data, DIRECT_IO_ALIGN, block_size) != 0) {
+            ring->blocks[b].data = NULL;
+            error("Could not allocate capture block %u\n", b);
+            ret = -1;
+            goto clean;
+        }
+    }
+    for(b = 0; trig && b < trig->pre_blocks; b++) {
+        if(posix_memalign((void**)&trig->hist[b].data, DIRECT_IO_ALIGN, block_size) != 0) {
+            trig->hist[b].data = NULL;
+            error("Could not allocate history block %u\n", b);
+            ret = -1;
+            goto clean;
+        }
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->done, false);
+    sem_init(&ring->filled, 0, 0);
+
+    args.ring = ring;
+    args.out = out;
+    args.meta = meta;
+    args.stats = stats;
+    if(pthread_create(&writer, NULL, writer_thread, &args) != 0) {
+        error("Could not start the writer thread\n");
+        sem_destroy(&ring->filled);
+        ret = -1;
+        goto clean;
+    }
+    ad9081_rt_add_thread(&rt, writer, "writer");
+
+    for(i = 0; (continuous || i < NUM_SAMPLE_LOOPS) && !stop_loop; i++) {
+        t_start = now_ns();
+        refill_size = AD9081_TRACED(AD9081_TP_REFILL, SAMPLES_PER_BUFF * iio_buffer_step(sample_buff),
+                                    iio_buffer_refill(sample_buff));
+        if(refill_size < 0) {
+            error("Error code %ld when refilling buffer\n", refill_size);
+            ret = -1;
+            break;
+        }
+        ad9081_rt_mark(&rt, now_ns());
+        stats->blocks_captured++;
+        if(meta->file) {
+            meta_refill(meta, stats, t_start, refill_size, &rec);
+        }
+        if(trig && !trigger_block(trig, ring, iio_buffer_start(sample_buff), refill_size,
+                                  &rec, stats)) {
+            continue;
+        }
+
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->num_blocks) {
+            stats->overruns++;
+            //Keep an overflow seen with this block for the next record
+            meta->pending_flags |= rec.flags & META_REC_OVF;
+            continue;
+        }
+
+        memcpy(ring->blocks[head % ring->num_blocks].data,
+               iio_buffer_start(sample_buff), refill_size);
+        ring->blocks[head % ring->num_blocks].len = refill_size;
+        ring->blocks[head % ring->num_blocks].meta = rec;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        sem_post(&ring->filled);
+    }
+
+    //Let the writer drain whatever is left, then stop it
+    atomic_store(&ring->done, true);
+    sem_post(&ring->filled);
+    pthread_join(writer, NULL);
+    sem_destroy(&ring->filled);
+
+clean:
+    for(b = 0; b < num_blocks; b++) {
+        free(ring->blocks[b].data);
+    }
+    for(b = 0; trig && b < trig->pre_blocks; b++) {
+        free(trig->hist[b].data);
+        trig->hist[b].data = NULL;
+    }
+    if(trig) {
+        //Whatever is still in the history was never triggered
+        trig->discarded += trig->hist_count;
+        trig->hist_count = 0;
+    }
+    free(ring);
+    return ret;
+}
+
+/**
+ * Sets up the verifier for num_ch interleaved channels of a pattern
+ */
+static void verify_init(verifier_t* v, verify_mode_t mode, unsigned int num_ch)
+{
+    memset(v, 0, sizeof(*v));
+    v->mode = mode;
+    v->num_ch = num_ch;
+    //PN23 looks back 23 bits, which needs two 16 bit words
+    v->lock_words = (mode == VERIFY_PN23) ? 2 : 1;
+    v->polarity_known = (mode == VERIFY_RAMP);
+}
+
+/**
+ * Predicts the next word of a channel from the words before it. PN sequences
+ * are generated a bit at a time, which is only done on the slow path.
+ */
+static uint16_t verify_predict(const verifier_t* v, uint32_t hist)
+{
+    unsigned int tap_a = (v->mode == VERIFY_PN9) ? 9 : 23;
+    unsigned int tap_b = (v->mode == VERIFY_PN9) ? 5 : 18;
+    uint64_t h = hist;
+    unsigned int i;
+
+    if(v->mode == VERIFY_RAMP) {
+        return (uint16_t)(hist + 1);
+    }
+    for(i = 0; i < 16; i++) {
+        h = (h << 1) | (((h >> (tap_a - 1)) ^ (h >> (tap_b - 1)) ^ v->syndrome) & 1);
+    }
+    return (uint16_t)h;
+}
+
+/**
+ * Checks one word of a channel against its pattern. A single wrong word is an
+ * error. If the words after it carry on from the wrong word instead of from
+ * where the pattern should have been, the stream has slipped, i.e. samples
+ * were lost or repeated. Returns true only if the word matched while locked.
+ */
+static bool verify_word(verifier_t* v, verify_chan_t* ch, uint16_t w)
+{
+    uint16_t pred;
+    uint32_t ref;
+
+    if(ch->state == VERIFY_LOCKING) {
+        ch->hist = (ch->hist << 16) | w;
+        if(++ch->valid >= v->lock_words) {
+            ch->state = VERIFY_LOCKED;
+        }
+        return false;
+    }
+
+    v->words++;
+    pred = verify_predict(v, ch->hist);
+    if(!v->polarity_known && w != pred) {
+        //Some converters invert the PN sequence. Find out with the first word
+        v->syndrome ^= 0xFFFF;
+        pred = verify_predict(v, ch->hist);
+        if(w != pred) {
+            v->syndrome ^= 0xFFFF;
+        }
+    }
+    if(w == pred) {
+        v->polarity_known = true;
+    }
+
+    switch(ch->state) {
+    case VERIFY_LOCKED:
+        if(w == pred) {
+            ch->hist = (ch->hist << 16) | w;
+            return true;
+        }
+        ch->errors++;
+        ch->bad = w;
+        ch->state = VERIFY_SUSPECT;
+        return false;
+    case VERIFY_SUSPECT:
+        //Followed on from where the pattern should have been: one bad word
+        ref = (ch->hist << 16) | pred;
+        if(w == verify_predict(v, ref)) {
+            ch->hist = (ref << 16) | w;
+            ch->state = VERIFY_LOCKED;
+            return false;
+        }
+        //Followed on from the bad word: a slip
+        if(v->lock_words == 1 && w == verify_predict(v, ch->bad)) {
+            ch->slips++;
+            ch->hist = ((uint32_t)ch->bad << 16) | w;
+            ch->state = VERIFY_LOCKED;
+            return false;
+        }
+        ch->errors++;
+        ch->hist = ((uint32_t)ch->bad << 16) | w;
+        ch->state = VERIFY_RELOCKING;
+        return false;
+    case VERIFY_RELOCKING:
+        if(w == pred) {
+            ch->slips++;
+            ch->state = VERIFY_LOCKED;
+        } else {
+            ch->errors++;
+        }
+        ch->hist = (ch->hist << 16) | w;
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Checks word k against the words one and two frames before it, in the same
+ * channel, without any per channel state. This holds for every word while a
+ * channel follows its pattern.
+ */
+static inline bool verify_relation(const verifier_t* v, const uint16_t* p, size_t k)
+{
+    size_t n = v->num_ch;
+    uint32_t c;
+    uint64_t c64;
+
+    switch(v->mode) {
+    case VERIFY_RAMP:
+        return p[k] == (uint16_t)(p[k - n] + 1);
+    case VERIFY_PN9:
+        c = ((uint32_t)p[k - n] << 16) | p[k];
+        return (uint16_t)(c ^ (c >> 5) ^ (c >> 9)) == v->syndrome;
+    case VERIFY_PN23:
+        c64 = ((uint64_t)p[k - 2 * n] << 32) | ((uint64_t)p[k - n] << 16) | p[k];
+        return (uint16_t)(c64 ^ (c64 >> 18) ^ (c64 >> 23)) == v->syndrome;
+    default:
+        return false;
+    }
+}
+
+#if defined(__ARM_NEON)
+static inline bool verify_vec_zero(uint32x4_t x)
+{
+    uint64x2_t x64 = vreinterpretq_u64_u32(x);
+    return (vgetq_lane_u64(x64, 0) | vgetq_lane_u64(x64, 1)) == 0;
+}
+
+static inline bool verify_vec_ramp(const uint16_t* cur, const uint16_t* prev)
+{
+    uint16x8_t d = vsubq_u16(vld1q_u16(cur), vld1q_u16(prev));
+    return verify_vec_zero(vreinterpretq_u32_u16(veorq_u16(d, vdupq_n_u16(1))));
+}
+
+static inline bool verify_vec_pn9(const uint16_t* cur, const uint16_t* prev, uint16_t syndrome)
+{
+    uint16x8_t c = vld1q_u16(cur);
+    uint16x8_t p = vld1q_u16(prev);
+    uint32x4_t lo = vorrq_u32(vmovl_u16(vget_low_u16(c)), vshll_n_u16(vget_low_u16(p), 16));
+    uint32x4_t hi = vorrq_u32(vmovl_u16(vget_high_u16(c)), vshll_n_u16(vget_high_u16(p), 16));
+    uint32x4_t syn = vdupq_n_u32(syndrome);
+    uint32x4_t mask = vdupq_n_u32(0xFFFF);
+
+    lo = veorq_u32(veorq_u32(lo, syn), veorq_u32(vshrq_n_u32(lo, 5), vshrq_n_u32(lo, 9)));
+    hi = veorq_u32(veorq_u32(hi, syn), veorq_u32(vshrq_n_u32(hi, 5), vshrq_n_u32(hi, 9)));
+    return verify_vec_zero(vandq_u32(vorrq_u32(lo, hi), mask));
+}
+
+static inline uint64x2_t verify_vec_pn23_syn(uint32x2_t c32, uint32x2_t pp32, uint64x2_t syn)
+{
+    uint64x2_t c = vorrq_u64(vmovl_u32(c32), vshll_n_u32(pp32, 32));
+    return veorq_u64(veorq_u64(c, syn), veorq_u64(vshrq_n_u64(c, 18), vshrq_n_u64(c, 23)));
+}
+
+static inline bool verify_vec_pn23(const uint16_t* cur, const uint16_t* prev,
+                                   const uint16_t* prev2, uint16_t syndrome)
+{
+    uint16x8_t c = vld1q_u16(cur);
+    uint16x8_t p = vld1q_u16(prev);
+    uint16x8_t pp = vld1q_u16(prev2);
+    uint32x4_t lo = vorrq_u32(vmovl_u16(vget_low_u16(c)), vshll_n_u16(vget_low_u16(p), 16));
+    uint32x4_t hi = vorrq_u32(vmovl_u16(vget_high_u16(c)), vshll_n_u16(vget_high_u16(p), 16));
+    uint32x4_t pp_lo = vmovl_u16(vget_low_u16(pp));
+    uint32x4_t pp_hi = vmovl_u16(vget_high_u16(pp));
+    uint64x2_t syn = vdupq_n_u64(syndrome);
+    uint64x2_t x;
+
+    x = vorrq_u64(verify_vec_pn23_syn(vget_low_u32(lo), vget_low_u32(pp_lo), syn),
+                  verify_vec_pn23_syn(vget_high_u32(lo), vget_high_u32(pp_lo), syn));
+    x = vorrq_u64(x, verify_vec_pn23_syn(vget_low_u32(hi), vget_low_u32(pp_hi), syn));
+    x = vorrq_u64(x, verify_vec_pn23_syn(vget_high_u32(hi), vget_high_u32(pp_hi), syn));
+    return verify_vec_zero(vandq_u32(vreinterpretq_u32_u64(x),
+                                     vreinterpretq_u32_u64(vdupq_n_u64(0xFFFF))));
+}
+#elif defined(__SSE2__)
+static inline bool verify_vec_zero(__m128i x)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF;
+}
+
+static inline bool verify_vec_ramp(const uint16_t* cur, const uint16_t* prev)
+{
+    __m128i d = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)cur),
+                              _mm_loadu_si128((const __m128i*)prev));
+    return verify_vec_zero(_mm_xor_si128(d, _mm_set1_epi16(1)));
+}
+
+static inline bool verify_vec_pn9(const uint16_t* cur, const uint16_t* prev, uint16_t syndrome)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*)cur);
+    __m128i p = _mm_loadu_si128((const __m128i*)prev);
+    __m128i lo = _mm_unpacklo_epi16(c, p);
+    __m128i hi = _mm_unpackhi_epi16(c, p);
+    __m128i syn = _mm_set1_epi32(syndrome);
+
+    lo = _mm_xor_si128(_mm_xor_si128(lo, syn),
+                       _mm_xor_si128(_mm_srli_epi32(lo, 5), _mm_srli_epi32(lo, 9)));
+    hi = _mm_xor_si128(_mm_xor_si128(hi, syn),
+                       _mm_xor_si128(_mm_srli_epi32(hi, 5), _mm_srli_epi32(hi, 9)));
+    return verify_vec_zero(_mm_and_si128(_mm_or_si128(lo, hi), _mm_set1_epi32(0xFFFF)));
+}
+
+static inline __m128i verify_vec_pn23_syn(__m128i c, __m128i syn)
+{
+    return _mm_xor_si128(_mm_xor_si128(c, syn),
+                         _mm_xor_si128(_mm_srli_epi64(c, 18), _mm_srli_epi64(c, 23)));
+}
+
+static inline bool verify_vec_pn23(const uint16_t* cur, const uint16_t* prev,
+                                   const uint16_t* prev2, uint16_t syndrome)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*)cur);
+    __m128i p = _mm_loadu_si128((const __m128i*)prev);
+    __m128i pp = _mm_loadu_si128((const __m128i*)prev2);
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi16(c, p);
+    __m128i hi = _mm_unpackhi_epi16(c, p);
+    __m128i pp_lo = _mm_unpacklo_epi16(pp, zero);
+    __m128i pp_hi = _mm_unpackhi_epi16(pp, zero);
+    __m128i syn = _mm_set1_epi64x(syndrome);
+    __m128i x;
+
+    //64 bit lanes of (prev2 << 32) | (prev << 16) | cur
+    x = _mm_or_si128(verify_vec_pn23_syn(_mm_unpacklo_epi32(lo, pp_lo), syn),
+                     verify_vec_pn23_syn(_mm_unpackhi_epi32(lo, pp_lo), syn));
+    x = _mm_or_si128(x, verify_vec_pn23_syn(_mm_unpacklo_epi32(hi, pp_hi), syn));
+    x = _mm_or_si128(x, verify_vec_pn23_syn(_mm_unpackhi_epi32(hi, pp_hi), syn));
+    return verify_vec_zero(_mm_and_si128(x, _mm_set1_epi64x(0xFFFF)));
+}
+#endif
+
+/**
+ * Fast path of the verifier. Returns the first word from k on which fails
+ * verify_relation(), or n if they all pass. k must be at least two frames into
+ * the block. Whole vectors are checked at once and only a vector which fails
+ * is looked at word by word.
+ */
+static size_t verify_scan(const verifier_t* v, const uint16_t* p, size_t k, size_t n)
+{
+#ifdef VERIFY_VEC_LANES
+    size_t c = v->num_ch;
+
+    switch(v->mode) {
+    case VERIFY_RAMP:
+        for(; k + VERIFY_VEC_LANES <= n; k += VERIFY_VEC_LANES) {
+            if(!verify_vec_ramp(p + k, p + k - c)) {
+                break;
+            }
+        }
+        break;
+    case VERIFY_PN9:
+        for(; k + VERIFY_VEC_LANES <= n; k += VERIFY_VEC_LANES) {
+            if(!verify_vec_pn9(p + k, p + k - c, v->syndrome)) {
+                break;
+            }
+        }
+        break;
+    case VERIFY_PN23:
+        for(; k + VERIFY_VEC_LANES <= n; k += VERIFY_VEC_LANES) {
+            if(!verify_vec_pn23(p + k, p + k - c, p + k - 2 * c, v->syndrome)) {
+                break;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+#endif
+    for(; k < n; k++) {
+        if(!verify_relation(v, p, k)) {
+            break;
+        }
+    }
+    return k;
+}
+
+/**
+ * Verifies one refilled block of interleaved samples. Each channel is followed
+ * word by word until every channel has matched its pattern for two whole frames
+ * in a row. From there the block is checked with verify_scan(), which only
+ * compares the words of the block against each other, until it hits a word
+ * that doesn't fit. The channels pick up from the last good words and the
+ * word is handled one at a time again.
+ */
+static void verify_block(verifier_t* v, const uint16_t* p, size_t n)
+{
+    size_t span = 2 * v->num_ch;
+    size_t clean = 0;
+    size_t k = 0;
+    size_t end, j;
+
+    while(k < n) {
+        if(clean < span) {
+            if(verify_word(v, &v->ch[k % v->num_ch], p[k])) {
+                clean++;
+            } else {
+                clean = 0;
+            }
+            k++;
+            continue;
+        }
+
+        end = verify_scan(v, p, k, n);
+        v->words += end - k;
+        for(j = end - v->num_ch; j < end; j++) {
+            v->ch[j % v->num_ch].hist = ((uint32_t)p[j - v->num_ch] << 16) | p[j];
+        }
+        k = end;
+        clean = 0;
+    }
+}
+
+/**
+ * Totals the errors and slips over all channels
+ */
+static void verify_totals(const verifier_t* v, unsigned long long* errors,
+                          unsigned long long* slips)
+{
+    unsigned int i;
+
+    *errors = *slips = 0;
+    for(i = 0; i < v->num_ch; i++) {
+        *errors += v->ch[i].errors;
+        *slips += v->ch[i].slips;
+    }
+}
+
+/**
+ * Verifies the test pattern of every refilled block as it arrives, without
+ * writing anything to a file. Running totals are printed every
+ * VERIFY_REPORT_SEC seconds.
+ */
+static int capture_verify(struct iio_buffer* sample_buff, verifier_t* v,
+                          bool continuous, capture_stats_t* stats)
 {
-    int ret;
-    int result;
-    FILE* sample_file = NULL;
     int i;
     ssize_t refill_size;
+    double start = now_sec();
+    double next_report = start + VERIFY_REPORT_SEC;
+    unsigned long long errors, slips;
+
+    for(i = 0; (continuous || i < NUM_SAMPLE_LOOPS) && !stop_loop; i++) {
+        refill_size = AD9081_TRACED(AD9081_TP_REFILL, SAMPLES_PER_BUFF * iio_buffer_step(sample_buff),
+                                    iio_buffer_refill(sample_buff));
+        if(refill_size < 0) {
+            error("Error code %ld when refilling buffer\n", refill_size);
+            return -1;
+        }
+        ad9081_rt_mark(&rt, now_ns());
+        stats->blocks_captured++;
+        verify_block(v, iio_buffer_start(sample_buff), refill_size / sizeof(uint16_t));
+
+        if(now_sec() >= next_report) {
+            verify_totals(v, &errors, &slips);
+            info("%.0f s: %llu samples checked, %llu errors, %llu slips\n",
+                 now_sec() - start, v->words, errors, slips);
+            ad9081_trace_write_metrics();
+            next_report += VERIFY_REPORT_SEC;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints the results of verifying a capture, per channel
+ */
+static void print_verify(const verifier_t* v, struct iio_channel* const* chans,
+                         unsigned long long blocks, double elapsed)
+{
+    unsigned int i;
+
+    info("Blocks checked:  %llu (%s, %s)\n", blocks, verify_names[v->mode], CAPTURE_VEC_NAME);
+    for(i = 0; i < v->num_ch; i++) {
+        info("%-11s errors %llu, slips %llu%s\n", iio_channel_get_id(chans[i]),
+             v->ch[i].errors, v->ch[i].slips,
+             v->ch[i].state == VERIFY_LOCKED ? "" : " (not locked)");
+    }
+    if(v->syndrome) {
+        info("PN sequence is inverted\n");
+    }
+    if(elapsed > 0.0) {
+        info("Check rate:      %.1f MS/s per channel\n",
+             v->words / v->num_ch / elapsed / 1e6);
+    }
+}
+
+/**
+ * Unpacks a pack12 capture back into interleaved int16 frames, the same as a
+ * raw capture, and writes them to out. No hardware is needed.
+ */
+static int unpack_file(const char* name, capture_output_t* out)
+{
+    capture_pack12_header_t hdr;
+    FILE* in;
+    uint8_t* packed = NULL;
+    int16_t* frames = NULL;
+    size_t frame_bytes, n;
+    unsigned long long total = 0;
+    unsigned int c;
+    double start;
+    int ret = -1;
+
+    if((in = fopen(name, "rb")) == NULL) {
+        error("Couldn't open %s\n", name);
+        return -1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, PACK12_MAGIC, sizeof(hdr.magic)) != 0) {
+        error("%s is not a pack12 capture\n", name);
+        goto clean;
+    }
+    if(hdr.version != PACK12_VERSION || hdr.bits != PACK12_BITS || hdr.shift > PACK12_MAX_SHIFT ||
+       hdr.num_ch == 0 || hdr.num_ch > CONVERT_MAX_CH || (hdr.num_ch % 2) != 0 ||
+       fseek(in, hdr.header_size, SEEK_SET) != 0) {
+        error("Unsupported pack12 version %u, %u channels of %u bits >> %u\n", hdr.version,
+              hdr.num_ch, hdr.bits, hdr.shift);
+        goto clean;
+    }
+    info("%s: %u channels at %llu Hz\n", name, hdr.num_ch, (unsigned long long)hdr.sample_rate);
+    for(c = 0; c < hdr.num_ch; c++) {
+        info("  %u: %.16s\n", c, hdr.channels[c]);
+    }
+
+    //Output chunks are aligned like the conversion staging, for O_DIRECT
+    frame_bytes = hdr.num_ch * 3 / 2;
+    if((packed = malloc(CONVERT_CHUNK_FRAMES * frame_bytes)) == NULL ||
+       posix_memalign((void**)&frames, DIRECT_IO_ALIGN,
+                      CONVERT_CHUNK_FRAMES * hdr.num_ch * sizeof(int16_t)) != 0) {
+        error("Could not allocate the unpack buffers\n");
+        frames = NULL;
+        goto clean;
+    }
+
+    start = now_sec();
+    while((n = fread(packed, frame_bytes, CONVERT_CHUNK_FRAMES, in)) > 0 && !stop_loop) {
+        unpack12(packed, n * hdr.num_ch, frames, hdr.shift);
+        if(output_write(out, frames, n * hdr.num_ch * sizeof(int16_t)) < 0) {
+            error("Could not write the unpacked frames\n");
+            goto clean;
+        }
+        total += n;
+    }
+    info("Unpacked %llu frames in %.3f s (%s)\n", total, now_sec() - start, CAPTURE_VEC_NAME);
+    ret = 0;
+
+clean:
+    free(packed);
+    free(frames);
+    fclose(in);
+    return ret;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = EXIT_SUCCESS;
+    int result;
+    int opt;
+    bool continuous = false;
+    unsigned int num_blocks = 0;
+    unsigned int kernel_blocks = 0;
+    unsigned int link_mbps = 0;
+    unsigned long long timeout_ms;
+    bool remote;
+    output_type_t out_type = OUTPUT_STDIO;
+    format_t format = FORMAT_RAW;
+    capture_output_t out = { .fd = -1 };
+    capture_meta_t meta = { 0 };
+    const char* meta_filename = NULL;
+    const char* unpack_name = NULL;
+    verify_mode_t verify_mode = VERIFY_NONE;
+    verifier_t* verifier = NULL;
+    capture_trigger_t* trig = NULL;
+    unsigned int pre_blocks = 0, post_blocks = 0;
+    bool triggered = false;
+    char* end;
+    unsigned long level = 0;
+    const char* gpio_path = NULL;
+    const char* test_mode;
+    capture_stats_t stats = { 0 };
+    double start_time;
+    double elapsed;
     struct iio_device *ad9081 = NULL;
     struct iio_channel *adc0_i = NULL;
     struct iio_channel *adc0_q = NULL;
     struct iio_channel *adc1_i = NULL;
     struct iio_channel *adc1_q = NULL;
     struct iio_buffer  *sample_buff = NULL;
+    struct iio_channel *rx_chans[4];
+
+    ad9081_rt_init(&rt);
+    while((opt = getopt(argc, argv, "cp:o:f:m:r:T:g:v:k:L:U:a:P:MI:J:")) != -1) {
+        switch(opt) {
+        case 'c':
+            continuous = true;
+            break;
+        case 'p':
+            num_blocks = strtoul(optarg, NULL, 0);
+            if(num_blocks < 2 || num_blocks > MAX_RING_BLOCKS) {
+                error("Pipeline blocks must be 2-%d\n", MAX_RING_BLOCKS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            for(out_type = OUTPUT_STDIO; out_type <= OUTPUT_NET; out_type++) {
+                if(strcmp(optarg, output_names[out_type]) == 0) {
+                    break;
+                }
+            }
+            if(out_type > OUTPUT_NET) {
+                error("Unknown output back end %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            for(format = FORMAT_RAW; format <= FORMAT_PACK12; format++) {
+                if(strcmp(optarg, format_names[format]) == 0) {
+                    break;
+                }
+            }
+            if(format > FORMAT_PACK12) {
+                error("Unknown format %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            meta_filename = optarg;
+            break;
+        case 'r':
+            pre_blocks = strtoul(optarg, &end, 0);
+            if(*end == ':') {
+                post_blocks = strtoul(end + 1, &end, 0);
+            }
+            if(*end != '\0' || pre_blocks + post_blocks + 1 > MAX_RING_BLOCKS) {
+                error("Trigger window must be pre:post with pre + post below %d\n",
+                      MAX_RING_BLOCKS);
+                return EXIT_FAILURE;
+            }
+            triggered = true;
+            break;
+        case 'T':
+            level = strtoul(optarg, NULL, 0);
+            //The largest magnitude is sqrt(2) * 32768
+            if(level == 0 || level > 46340) {
+                error("Trigger level must be 1-46340\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            gpio_path = optarg;
+            break;
+        case 'v':
+            for(verify_mode = VERIFY_RAMP; verify_mode <= VERIFY_PN23; verify_mode++) {
+                if(strcmp(optarg, verify_names[verify_mode]) == 0) {
+                    break;
+                }
+            }
+            if(verify_mode > VERIFY_PN23) {
+                error("Unknown test pattern %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+            kernel_blocks = strtoul(optarg, NULL, 0);
+            if(kernel_blocks < 1 || kernel_blocks > MAX_KERNEL_BLOCKS) {
+                error("Kernel blocks must be 1-%d\n", MAX_KERNEL_BLOCKS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            link_mbps = strtoul(optarg, NULL, 0);
+            if(link_mbps == 0) {
+                error("Link rate must be at least 1 Mb/s\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'U':
+            unpack_name = optarg;
+            break;
+        case 'a':
+            if(ad9081_rt_parse_cpus(&rt, optarg) < 0) {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            rt.priority = strtoul(optarg, NULL, 0);
+            if(rt.priority < 1 || rt.priority > 99) {
+                error("Priority must be 1-99\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            rt.lock_memory = true;
+            break;
+        case 'I':
+            rt.irq_cpu = strtol(optarg, &end, 0);
+            if(*end != '\0' || rt.irq_cpu < 0 || rt.irq_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+                error("Interrupt CPU must be 0-%ld\n", sysconf(_SC_NPROCESSORS_CONF) - 1);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'J':
+            if(ad9081_rt_parse_baseline(&rt, optarg) < 0) {
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    //The refills of the blocks queued when the buffer is created aren't timed.
+    //A fixed number of refills ends before a long baseline, so place first
+    if(kernel_blocks) {
+        rt.warmup = kernel_blocks;
+    }
+    if(ad9081_rt_requested(&rt) && !continuous && rt.baseline &&
+       rt.warmup + rt.baseline >= NUM_SAMPLE_LOOPS) {
+        info("%d refills end within the %u block baseline, placing from the start (-c to compare)\n",
+             NUM_SAMPLE_LOOPS, rt.baseline);
+        rt.baseline = 0;
+    }
 
-    if(argc < 2) {
+    if(verify_mode != VERIFY_NONE) {
+        //Nothing is written to disk when verifying
+        if(num_blocks || out_type != OUTPUT_STDIO || format != FORMAT_RAW ||
+           meta_filename || triggered || optind < argc) {
+            error("-v can't be used with -p, -o, -f, -m, -r or a filename\n");
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    } else if(optind >= argc) {
         error("Not enough args. Expecting a filename\n");
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if(unpack_name) {
+        if(format != FORMAT_RAW || out_type == OUTPUT_NET) {
+            error("-U always writes a raw file\n");
+            return EXIT_FAILURE;
+        }
+        signal(SIGINT, handle_sig);
+        if(output_open(&out, out_type, argv[optind]) < 0) {
+            error("Couldn't create file %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        ret = unpack_file(unpack_name, &out) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+        output_close(&out);
+        return ret;
+    }
+    if(out_type == OUTPUT_NET && format != FORMAT_RAW && format != FORMAT_PACK12) {
+        //The other converted formats are a file per stream, which a socket can't be
+        error("-o net can only send the raw or pack12 formats\n");
+        return EXIT_FAILURE;
+    }
+    if(!triggered && (level || gpio_path)) {
+        error("-T and -g need a trigger window set with -r\n");
         return EXIT_FAILURE;
     }
+    if(triggered) {
+        //The writer thread needs room for a whole window at once
+        if(num_blocks < pre_blocks + post_blocks + 1) {
+            num_blocks = pre_blocks + post_blocks + 1 < 2 ? 2 : pre_blocks + post_blocks + 1;
+        }
+        if(num_blocks + pre_blocks > MAX_RING_BLOCKS) {
+            error("Trigger history and ring blocks must total at most %d\n", MAX_RING_BLOCKS);
+            return EXIT_FAILURE;
+        }
+        if((trig = calloc(1, sizeof(*trig))) == NULL) {
+            error("Could not allocate the trigger\n");
+            return EXIT_FAILURE;
+        }
+        trig->pre_blocks = pre_blocks;
+        trig->post_blocks = post_blocks;
+        trig->level_sq = level * level;
+        trig->gpio_fd = -1;
+        if(gpio_path && (trig->gpio_fd = open(gpio_path, O_RDONLY)) < 0) {
+            error("Couldn't open GPIO %s\n", gpio_path);
+            free(trig);
+            return EXIT_FAILURE;
+        }
+    }
 
-    if((sample_file = fopen(argv[1],"wb")) == NULL)
+    //Converted formats are opened once the channels are known
+    if(verify_mode == VERIFY_NONE && format == FORMAT_RAW &&
+       output_open(&out, out_type, argv[optind]) < 0)
     {
-        error("Couldn't create file %s\n", argv[1]);
+        error("Couldn't create file %s\n", argv[optind]);
         return EXIT_FAILURE;
     }
 
+    signal(SIGINT, handle_sig);
+    signal(SIGUSR1, handle_trigger_sig);
+    if(ad9081_trace_open() < 0) {
+        ret = EXIT_FAILURE;
+        goto clean;
+    }
+    ad9081_trace_thread_name("refill");
+
 	ctx = iio_create_default_context();
 	if (!ctx) {
 		error("Could not create IIO context\n");
         ret = EXIT_FAILURE;
 		goto clean;
 	}
+    remote = strcmp(iio_context_get_name(ctx), "network") == 0;
+    if(remote && rt.irq_cpu >= 0) {
+        //The DMA interrupts are on the target, with iiod doing the refills
+        info("-I only moves the interrupts of a local context, ignored\n");
+        rt.irq_cpu = -1;
+    }
 
     //Devices are found by their IIO name
 	ad9081 = iio_context_find_device(ctx, "axi-ad9081-rx-hpc");
@@ -84,9 +2682,23 @@ int main(int argc, char* argv[])
 		goto clean;
     }
 
-    //Set Ramp test mode. This is a channel attribute thats applied to all channels
-    if(iio_channel_attr_write(adc0_i, "test_mode", "ramp") < 0) {
-        error("Could not set the ramp test mode\n");
+    rx_chans[0] = adc0_i;
+    rx_chans[1] = adc0_q;
+    rx_chans[2] = adc1_i;
+    rx_chans[3] = adc1_q;
+    if(format != FORMAT_RAW && convert_open(&out, format, out_type, argv[optind], rx_chans, 4) < 0) {
+        error("Couldn't create the %s files for %s\n", format_names[format], argv[optind]);
+        ret = EXIT_FAILURE;
+        goto clean;
+    }
+
+    //Set Ramp test mode, the pattern being verified, or off to trigger on the
+    //real input and for pack12, which drops the low bits the ramp counts in.
+    //This is a channel attribute thats applied to all channels
+    test_mode = verify_names[verify_mode ? verify_mode :
+                             (triggered || format == FORMAT_PACK12 ? VERIFY_NONE : VERIFY_RAMP)];
+    if(iio_channel_attr_write(adc0_i, "test_mode", test_mode) < 0) {
+        error("Could not set the %s test mode\n", test_mode);
 		ret = EXIT_FAILURE;
 		goto clean;
     }
@@ -97,28 +2709,122 @@ int main(int argc, char* argv[])
     iio_channel_enable(adc1_i);
     iio_channel_enable(adc1_q);
 
+    //Each refill over iiod is one request for the whole block, answered once the
+    //block is filled on the target. Queue more blocks there by default, so the
+    //DMA carries on while a block crosses the link, and with a slow link make
+    //sure a request isn't timed out while its block is still on its way
+    if(remote) {
+        if(!kernel_blocks) {
+            kernel_blocks = NET_KERNEL_BLOCKS;
+            rt.warmup = kernel_blocks;
+        }
+        if(link_mbps) {
+            timeout_ms = NET_TIMEOUT_BLOCKS * SAMPLES_PER_BUFF *
+                         (unsigned long long)iio_device_get_sample_size(ad9081) * 8 /
+                         (link_mbps * 1000ULL);
+            if(timeout_ms > NET_DEFAULT_TIMEOUT_MS) {
+                info("iiod request timeout %llu ms for %u Mb/s\n", timeout_ms, link_mbps);
+                if((result = iio_context_set_timeout(ctx, timeout_ms)) < 0) {
+                    error("Could not set the timeout: %d\n", result);
+                    ret = EXIT_FAILURE;
+                    goto clean;
+                }
+            }
+        }
+    }
+
+    //More kernel blocks keep refills queued on the target while the last block
+    //is still on its way over the network
+    if(kernel_blocks) {
+        info("Using %u kernel DMA blocks\n", kernel_blocks);
+        if((result = iio_device_set_kernel_buffers_count(ad9081, kernel_blocks)) < 0) {
+            error("Could not set the kernel buffer count: %d\n", result);
+            ret = EXIT_FAILURE;
+            goto clean;
+        }
+    }
+
     //Create the sample buffer. 1M-Samples
-    if((sample_buff = iio_device_create_buffer(ad9081, 1024*1024, false)) == NULL){
+    if((sample_buff = iio_device_create_buffer(ad9081, SAMPLES_PER_BUFF, false)) == NULL){
         error("Could not create data buffer\n");
 		ret = EXIT_FAILURE;
 		goto clean;
     }
 
-    info("Starting Sampling\n");
-    for(i = 0; i < NUM_SAMPLE_LOOPS; i++) {
-        refill_size = iio_buffer_refill(sample_buff);
-        if(refill_size < 0) {
-            error("Error code %ld when refilling buffer\n", refill_size);
+    if(meta_filename && meta_open(&meta, meta_filename, ad9081) < 0) {
+        error("Couldn't create metadata file %s\n", meta_filename);
+        ret = EXIT_FAILURE;
+        goto clean;
+    }
+
+    if(verify_mode != VERIFY_NONE) {
+        if((verifier = malloc(sizeof(*verifier))) == NULL) {
+            error("Could not allocate the verifier\n");
             ret = EXIT_FAILURE;
             goto clean;
         }
-        fwrite(iio_buffer_start(sample_buff), 1, refill_size, sample_file);
+        verify_init(verifier, verify_mode, 4);
+
+        info("Starting Verification\n");
+        ad9081_rt_add_thread(&rt, pthread_self(), "refill");
+        ad9081_rt_start(&rt);
+        start_time = now_sec();
+        if(capture_verify(sample_buff, verifier, continuous, &stats) < 0) {
+            ret = EXIT_FAILURE;
+        }
+        info("Completed verification\n");
+        elapsed = now_sec() - start_time;
+        print_verify(verifier, rx_chans, stats.blocks_captured, elapsed);
+        if(remote) {
+            print_link("iiod", stats.blocks_captured * SAMPLES_PER_BUFF *
+                       (unsigned long long)iio_device_get_sample_size(ad9081), elapsed, link_mbps);
+        }
+        ad9081_rt_report(&rt, "Refill");
+        goto clean;
+    }
+
+    info("Starting Sampling\n");
+    ad9081_rt_add_thread(&rt, pthread_self(), "refill");
+    ad9081_rt_start(&rt);
+    start_time = now_sec();
+    if(num_blocks) {
+        result = capture_pipelined(sample_buff, &out, &meta, continuous, num_blocks, trig,
+                                   &stats);
+    } else {
+        result = capture_inline(sample_buff, &out, &meta, continuous, &stats);
+    }
+    if(result < 0) {
+        ret = EXIT_FAILURE;
     }
+    //Include the final flush and writeback of the back end in the sustained rate
+    output_close(&out);
     info("Completed sampling\n");
+    elapsed = now_sec() - start_time;
+    print_stats(&stats, &out, &meta, elapsed);
+    if(remote) {
+        //Every refilled block crossed the link, written or not
+        print_link("iiod", stats.blocks_captured * SAMPLES_PER_BUFF *
+                   (unsigned long long)iio_device_get_sample_size(ad9081), elapsed, link_mbps);
+    }
+    if(out_type == OUTPUT_NET) {
+        print_link("net", out.stored ? out.stored : stats.bytes_written, elapsed,
+                   link_mbps ? link_mbps : out.link_mbps);
+    }
+    if(trig) {
+        info("Triggers:        %llu (%llu blocks not written)\n", trig->events,
+             trig->discarded);
+    }
+    ad9081_rt_report(&rt, "Refill");
 
 clean:
-    if(sample_file) {
-        fclose(sample_file);
+    output_close(&out);
+    meta_close(&meta);
+    free(verifier);
+    if(trig) {
+        if(trig->gpio_fd >= 0) {
+            close(trig->gpio_fd);
+        }
+        free(trig);
     }
     if(sample_buff) {
         iio_buffer_destroy(sample_buff);
@@ -126,5 +2832,7 @@ clean:
 	if(ctx) {
         iio_context_destroy(ctx);
     }
+    ad9081_rt_release(&rt);
+    ad9081_trace_close();
 	return ret;
 }
\ No newline at end of file
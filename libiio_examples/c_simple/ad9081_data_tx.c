@@ -19,6 +19,7 @@
 #include <stdbool.h>
 #include <math.h>
 #include <unistd.h>
+#include <time.h>
 
 #define ARGS(fmt, ...)	__VA_ARGS__
 #define FMT(fmt, ...)	fmt
@@ -37,21 +38,136 @@ static bool stop_loop = false;
 
 static struct iio_context *ctx = NULL;
 
+/* One full cycle of the F_STEPS pattern (one period of each tone), stored as
+ * interleaved I/Q pairs ready to be copied into the buffer
+ */
+static int16_t* tone_lut = NULL;
+static size_t tone_lut_frames = 0;
+
 static void handle_sig(int sig)
 {
     stop_loop = true;
 }
 
-int main(int argc, char* argv[])
+/**
+ * Helper to get the monotonic time in seconds
+ */
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Builds the tone lookup table. Each entry of F_STEPS produces one whole
+ * period of its tone, with the phase advanced before each sample. Unlike the
+ * per-sample computation, which carries the phase left over past 2*PI into
+ * the next tone, every tone here starts again from a phase of 0, so the two
+ * are not sample for sample the same. The tables are small (a period is
+ * 2*PI/step samples), so this is the only place cos()/sin() are evaluated.
+ */
+static int build_tone_lut(void)
+{
+    int f;
+    size_t n;
+    size_t period;
+    size_t frame = 0;
+
+    tone_lut_frames = 0;
+    for(f = 0; f < num_fsteps; f++) {
+        tone_lut_frames += (size_t)ceil((2.0 * M_PI) / F_STEPS[f] - 1e-9);
+    }
+
+    if((tone_lut = malloc(tone_lut_frames * 2 * sizeof(*tone_lut))) == NULL) {
+        return -1;
+    }
+
+    for(f = 0; f < num_fsteps; f++) {
+        period = (size_t)ceil((2.0 * M_PI) / F_STEPS[f] - 1e-9);
+        for(n = 1; n <= period; n++, frame++) {
+            tone_lut[frame * 2]     = (int16_t)(cos(n * F_STEPS[f]) * OUTPUT_AMP);
+            tone_lut[frame * 2 + 1] = (int16_t)(sin(n * F_STEPS[f]) * OUTPUT_AMP);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fills the buffer from the tone lookup table. With only the one I/Q pair
+ * enabled the buffer is a contiguous run of I/Q frames, so the table is copied
+ * once and then the filled region is doubled with memcpy until the buffer is
+ * full. Any other layout falls back to a strided copy from the table.
+ */
+static void fill_buffer_lut(struct iio_buffer* buff, struct iio_channel* ch)
+{
+    int16_t* p_dat = iio_buffer_first(buff, ch);
+    int16_t* p_end = iio_buffer_end(buff);
+    ptrdiff_t p_inc = iio_buffer_step(buff) / sizeof(*p_dat);
+    size_t total, filled, n;
+    size_t frame = 0;
+
+    if(p_inc == 2 && (void*)p_dat == iio_buffer_start(buff)) {
+        total = (p_end - p_dat) * sizeof(*p_dat);
+        filled = tone_lut_frames * 2 * sizeof(*p_dat);
+        if(filled > total) {
+            filled = total;
+        }
+        memcpy(p_dat, tone_lut, filled);
+        while(filled < total) {
+            n = (filled < total - filled) ? filled : total - filled;
+            memcpy((uint8_t*)p_dat + filled, p_dat, n);
+            filled += n;
+        }
+        return;
+    }
+
+    for( ; p_dat < p_end; p_dat += p_inc) {
+        p_dat[0] = tone_lut[frame * 2];
+        p_dat[1] = tone_lut[frame * 2 + 1];
+        if(++frame == tone_lut_frames) {
+            frame = 0;
+        }
+    }
+}
+
+/**
+ * Fills the buffer by computing cos()/sin() for every sample. Kept for
+ * comparing the buffer ready time against the lookup table.
+ */
+static void fill_buffer_libm(struct iio_buffer* buff, struct iio_channel* ch)
 {
-    int ret;
-    int result;
     int f_idx = 0;
-    int i;
     double sin_val = 0.0;
     int16_t* p_dat, *p_end;
     ptrdiff_t p_inc;
 
+    p_inc = iio_buffer_step(buff);
+    p_end = iio_buffer_end(buff);
+    for( p_dat = iio_buffer_first(buff, ch);
+         p_dat < p_end;
+         p_dat += p_inc/sizeof(*p_dat))
+    {
+        sin_val += F_STEPS[f_idx];
+
+        p_dat[0] = (int16_t)(cos(sin_val) * OUTPUT_AMP);
+        p_dat[1] = (int16_t)(sin(sin_val) * OUTPUT_AMP);
+
+       if(sin_val >=  (2.0*M_PI))
+        {
+            sin_val -= (2.0*M_PI);
+            f_idx = (f_idx + 1) % num_fsteps;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = EXIT_SUCCESS;
+    int result;
+    bool use_libm = false;
+    double start_time;
+
     struct iio_device *ad9081 = NULL;
     struct iio_device *ad9081_tx = NULL;
     struct iio_channel *dac1_i = NULL;
@@ -61,6 +177,11 @@ int main(int argc, char* argv[])
     struct iio_channel *dac1_dds_ctrl = NULL;
     struct iio_buffer  *sample_buff = NULL;
 
+    //Optionally compute every sample with libm (the original method) to compare
+    if(argc > 1 && strcmp(argv[1], "-m") == 0) {
+        use_libm = true;
+    }
+
     signal(SIGINT, handle_sig);
 
 	ctx = iio_create_default_context();
@@ -116,23 +237,19 @@ int main(int argc, char* argv[])
     }
 
     info("Starting Writing\n");
-    p_inc = iio_buffer_step(sample_buff);
-    p_end = iio_buffer_end(sample_buff);
-    for( p_dat = iio_buffer_first(sample_buff, dac1_i);
-         p_dat < p_end;
-         p_dat += p_inc/sizeof(*p_dat))
-    {
-        sin_val += F_STEPS[f_idx];
-
-        p_dat[0] = (int16_t)(cos(sin_val) * OUTPUT_AMP);
-        p_dat[1] = (int16_t)(sin(sin_val) * OUTPUT_AMP);
-
-       if(sin_val >=  (2.0*M_PI))
-        {
-            sin_val -= (2.0*M_PI);
-            f_idx = (f_idx + 1) % num_fsteps;
+    start_time = now_sec();
+    if(use_libm) {
+        fill_buffer_libm(sample_buff, dac1_i);
+    } else {
+        if(build_tone_lut() < 0) {
+            error("Could not allocate the tone table\n");
+            ret = EXIT_FAILURE;
+            goto clean;
         }
+        fill_buffer_lut(sample_buff, dac1_i);
     }
+    info("Buffer ready in %.3f ms (%s)\n", (now_sec() - start_time) * 1000.0,
+         use_libm ? "libm" : "lookup table");
 
     if((result = iio_buffer_push(sample_buff)) < 0) {
         error("Error code %d when pushing buffer\n", result);
@@ -146,6 +263,7 @@ int main(int argc, char* argv[])
     info("Completed sampling\n");
 
 clean:
+    free(tone_lut);
     if(sample_buff) {
         iio_buffer_destroy(sample_buff);
     }
@@ -0,0 +1,295 @@
+/*
+ * Persistent buffers for the libiio examples.
+ *
+ * Creating an iio_buffer allocates the kernel DMA blocks and sets up the
+ * data path of every enabled channel, and destroying it tears all of that
+ * down again, so recreating the buffer on every mode change costs far more
+ * than the change itself. The scan mask of a buffer is fixed when it is
+ * created, but libiio keeps the lanes of every channel it was created with,
+ * so a buffer opened on the widest set of channels serves any narrower set
+ * as it is. Only a mask with a channel the buffer doesn't have, or a new
+ * size, needs a new buffer.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include "ad9081_buf.h"
+#include "ad9081_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Hugepage size to assume when /proc/meminfo doesn't say */
+#define DEFAULT_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+/* Most lanes a frame can have, one per bit of the mask */
+#define MAX_LANES		64
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Reads the hugepage size and the free reserved hugepages from /proc/meminfo
+ */
+static void hugepage_info(size_t* size, unsigned long* free_pages)
+{
+	FILE* f;
+	char line[128];
+	unsigned long val;
+
+	*size = DEFAULT_HUGEPAGE_SIZE;
+	*free_pages = 0;
+	if((f = fopen("/proc/meminfo", "r")) == NULL) {
+		return;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "Hugepagesize: %lu kB", &val) == 1) {
+			*size = val * 1024;
+		} else if(sscanf(line, "HugePages_Free: %lu", &val) == 1) {
+			*free_pages = val;
+		}
+	}
+	fclose(f);
+}
+
+/**
+ * Whether transparent hugepages can be asked for with madvise()
+ */
+static bool thp_available(void)
+{
+	FILE* f;
+	char line[128] = "";
+
+	if((f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) == NULL) {
+		return false;
+	}
+	if(!fgets(line, sizeof(line), f)) {
+		line[0] = '\0';
+	}
+	fclose(f);
+	return line[0] != '\0' && strstr(line, "[never]") == NULL;
+}
+
+/**
+ * Maps len bytes aligned to align, by mapping align more and unmapping the
+ * ends. A hugepage can only back a range aligned to its size.
+ */
+static void* map_aligned(size_t len, size_t align)
+{
+	uint8_t* map;
+	uint8_t* start;
+	size_t head;
+
+	map = mmap(NULL, len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+	start = (uint8_t*)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+	head = start - map;
+	if(head) {
+		munmap(map, head);
+	}
+	munmap(start + len, align - head);
+	return start;
+}
+
+int ad9081_mem_alloc(ad9081_mem_t* mem, size_t size)
+{
+	size_t huge, page = sysconf(_SC_PAGESIZE);
+	unsigned long free_pages;
+	bool allow_huge = getenv("AD9081_MEM_NO_HUGEPAGES") == NULL;
+	void* map;
+
+	memset(mem, 0, sizeof(*mem));
+	if(size == 0) {
+		return -1;
+	}
+	mem->size = size;
+	hugepage_info(&huge, &free_pages);
+
+	//Reserved hugepages are only used when there are enough for the whole
+	//block, as there is no partial fallback within one mapping
+	mem->mapped = (size + huge - 1) & ~(huge - 1);
+	if(allow_huge && free_pages >= mem->mapped / huge) {
+		map = mmap(NULL, mem->mapped, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if(map != MAP_FAILED) {
+			mem->data = map;
+			mem->path = AD9081_MEM_HUGETLB;
+			return 0;
+		}
+	}
+
+	//Transparent hugepages, for blocks of at least one hugepage. Touching
+	//every page after the madvise() faults them in as hugepages
+	if(allow_huge && size >= huge && thp_available()) {
+		if((map = map_aligned(mem->mapped, huge)) != NULL) {
+			if(madvise(map, mem->mapped, MADV_HUGEPAGE) == 0) {
+				memset(map, 0, mem->mapped);
+				mem->data = map;
+				mem->path = AD9081_MEM_THP;
+				return 0;
+			}
+			munmap(map, mem->mapped);
+		}
+	}
+
+	mem->mapped = (size + page - 1) & ~(page - 1);
+	map = mmap(NULL, mem->mapped, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if(map == MAP_FAILED) {
+		memset(mem, 0, sizeof(*mem));
+		return -1;
+	}
+	mem->data = map;
+	mem->path = AD9081_MEM_PAGES;
+	return 0;
+}
+
+void ad9081_mem_free(ad9081_mem_t* mem)
+{
+	if(mem->data) {
+		munmap(mem->data, mem->mapped);
+	}
+	memset(mem, 0, sizeof(*mem));
+}
+
+const char* ad9081_mem_path_name(ad9081_mem_path_t path)
+{
+	switch(path) {
+	case AD9081_MEM_HUGETLB:
+		return "hugetlb";
+	case AD9081_MEM_THP:
+		return "transparent hugepages";
+	default:
+		return "pages";
+	}
+}
+
+/**
+ * Destroys the open buffer
+ */
+static void destroy_buffer(ad9081_buf_t* b)
+{
+	uint64_t t0 = AD9081_TRACE_BEGIN();
+
+	iio_buffer_destroy(b->buff);
+	b->buff = NULL;
+	if(t0) {
+		ad9081_trace_end(AD9081_TP_BUFFER_DESTROY, t0, b->samples, 0);
+	}
+}
+
+void ad9081_buf_init(ad9081_buf_t* b, struct iio_device* dev)
+{
+	memset(b, 0, sizeof(*b));
+	b->dev = dev;
+}
+
+uint64_t ad9081_buf_enabled_mask(const struct iio_device* dev)
+{
+	unsigned int i;
+	long index;
+	uint64_t mask = 0;
+	const struct iio_channel* ch;
+
+	for( i = 0; i < iio_device_get_channels_count(dev); i++ ) {
+		ch = iio_device_get_channel(dev, i);
+		index = iio_channel_get_index(ch);
+		if(iio_channel_is_scan_element(ch) && iio_channel_is_enabled(ch) &&
+		   index >= 0 && index < MAX_LANES) {
+			mask |= 1ull << index;
+		}
+	}
+	return mask;
+}
+
+struct iio_buffer* ad9081_buf_get(ad9081_buf_t* b, size_t samples, bool cyclic)
+{
+	uint64_t mask = ad9081_buf_enabled_mask(b->dev);
+	uint64_t t0;
+	double t = now_sec();
+
+	if(b->buff && samples == b->samples && cyclic == b->cyclic &&
+	   mask && (mask & ~b->mask) == 0) {
+		b->reattached++;
+		b->last_get = now_sec() - t;
+		return b->buff;
+	}
+
+	if(b->buff) {
+		destroy_buffer(b);
+	}
+	t0 = AD9081_TRACE_BEGIN();
+	b->buff = iio_device_create_buffer(b->dev, samples, cyclic);
+	if(t0) {
+		ad9081_trace_end(AD9081_TP_BUFFER_CREATE, t0, samples, b->buff ? 0 : -errno);
+	}
+	if(!b->buff) {
+		return NULL;
+	}
+	b->samples = samples;
+	b->cyclic = cyclic;
+	b->mask = mask;
+	b->created++;
+	b->last_get = now_sec() - t;
+	return b->buff;
+}
+
+void ad9081_buf_clear_unused(ad9081_buf_t* b)
+{
+	uint64_t unused;
+	unsigned int n, lane, num_lanes, num_unused = 0;
+	unsigned int lanes[MAX_LANES];
+	size_t lane_bytes, step;
+	uint8_t* p;
+	uint8_t* end;
+
+	if(!b->buff) {
+		return;
+	}
+	unused = b->mask & ~ad9081_buf_enabled_mask(b->dev);
+	if(unused == 0) {
+		return;
+	}
+
+	//Lanes are in scan index order, and every AD9081 lane is the same size
+	num_lanes = __builtin_popcountll(b->mask);
+	step = iio_buffer_step(b->buff);
+	lane_bytes = step / num_lanes;
+	for( n = 0, lane = 0; n < MAX_LANES; n++ ) {
+		if(!(b->mask & (1ull << n))) {
+			continue;
+		}
+		if(unused & (1ull << n)) {
+			lanes[num_unused++] = lane;
+		}
+		lane++;
+	}
+
+	end = iio_buffer_end(b->buff);
+	for( p = iio_buffer_start(b->buff); p + step <= end; p += step ) {
+		for( n = 0; n < num_unused; n++ ) {
+			memset(p + lanes[n] * lane_bytes, 0, lane_bytes);
+		}
+	}
+}
+
+void ad9081_buf_release(ad9081_buf_t* b)
+{
+	if(b->buff) {
+		destroy_buffer(b);
+	}
+}
@@ -0,0 +1,107 @@
+/*
+ * Persistent buffers for the libiio examples. Keeps the iio_buffer of a
+ * device open across reconfigurations, muting the lanes of channels disabled
+ * since rather than destroying and recreating it, and allocates large sample
+ * blocks from hugepages where the system has them.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#ifndef AD9081_BUF_H
+#define AD9081_BUF_H
+
+#include <iio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Where the memory of a block came from */
+typedef enum {
+	AD9081_MEM_HUGETLB = 0,	/* Reserved hugepages, vm.nr_hugepages */
+	AD9081_MEM_THP,		/* Transparent hugepages, madvise(MADV_HUGEPAGE) */
+	AD9081_MEM_PAGES,	/* Normal pages */
+} ad9081_mem_path_t;
+
+/* A block of sample memory, page aligned and already faulted in */
+typedef struct {
+	void* data;
+	size_t size;		/* Bytes asked for */
+	size_t mapped;		/* Bytes mapped, a whole number of pages */
+	ad9081_mem_path_t path;
+} ad9081_mem_t;
+
+/* The iio_buffer of one device, kept open between ad9081_buf_get() calls.
+ * mask has bit n set for each scan element of index n enabled when the buffer
+ * was created, and the frames of the buffer always have those lanes
+ */
+typedef struct {
+	struct iio_device* dev;
+	struct iio_buffer* buff;
+	size_t samples;
+	bool cyclic;
+	uint64_t mask;
+	unsigned long long created;	/* Gets which created the buffer */
+	unsigned long long reattached;	/* Gets which kept the buffer */
+	double last_get;		/* Time taken by the last get, in seconds */
+} ad9081_buf_t;
+
+/**
+ * Allocates size bytes from reserved hugepages if there are enough free,
+ * otherwise from transparent hugepages, otherwise from normal pages. Every
+ * page is touched, so filling the block never faults. Set
+ * AD9081_MEM_NO_HUGEPAGES in the environment to always use normal pages.
+ * Returns 0 on success, negative on error.
+ */
+int ad9081_mem_alloc(ad9081_mem_t* mem, size_t size);
+
+void ad9081_mem_free(ad9081_mem_t* mem);
+
+/**
+ * Name of the memory path, for reports
+ */
+const char* ad9081_mem_path_name(ad9081_mem_path_t path);
+
+/**
+ * Sets up b for the buffers of dev. Nothing is allocated until the first get.
+ */
+void ad9081_buf_init(ad9081_buf_t* b, struct iio_device* dev);
+
+/**
+ * Scan mask of the channels of dev enabled right now, as in ad9081_buf_t
+ */
+uint64_t ad9081_buf_enabled_mask(const struct iio_device* dev);
+
+/**
+ * Returns a buffer of samples for the channels of the device enabled right
+ * now. The open buffer is kept when its size and cyclic flag match and it
+ * has a lane for every enabled channel, otherwise it is destroyed and a new
+ * one created. Open it the first time with the widest set of channels the
+ * application uses, and every narrower mask then reattaches to it.
+ *
+ * A reattached buffer keeps the frame layout it was created with, so find
+ * the samples of a channel with iio_buffer_first() and iio_buffer_step(),
+ * never by counting the enabled channels. Only the libiio mask changes, the
+ * kernel scan mask stays as it was when the buffer was created, so for Tx the
+ * channels no longer enabled stay in DMA mode and their lanes go out as
+ * written. Clear them with ad9081_buf_clear_unused() before each push to mute
+ * them. To actually take a channel out of DMA mode, release the buffer first.
+ * Returns NULL on error, with errno set.
+ */
+struct iio_buffer* ad9081_buf_get(ad9081_buf_t* b, size_t samples, bool cyclic);
+
+/**
+ * Zeros the lanes of the current block of the buffer whose channels are no
+ * longer enabled. Does nothing when every lane is enabled.
+ */
+void ad9081_buf_clear_unused(ad9081_buf_t* b);
+
+/**
+ * Destroys the buffer, i.e. on exit
+ */
+void ad9081_buf_release(ad9081_buf_t* b);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Shared AD9081 discovery layer for the libiio examples.
+ *
+ * Rather than building every channel name with snprintf and searching for it
+ * with iio_device_find_channel (a linear search of the device each time), the
+ * channels of each device are walked once and their IDs/names parsed to work
+ * out which table slot they belong in.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include "ad9081_ctx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+/**
+ * Returns the I or Q slot of a pair for the component letter, or NULL
+ */
+static struct iio_channel** pair_slot(ad9081_pair_t* pair, char iq)
+{
+	if(iq == 'i' || iq == 'I') {
+		return &pair->ch_i;
+	}
+	if(iq == 'q' || iq == 'Q') {
+		return &pair->ch_q;
+	}
+	return NULL;
+}
+
+/**
+ * Parses a 'voltageN_i' or 'voltageN_q' channel ID into the channel number and
+ * the component letter. Returns 0 on a match, -1 otherwise.
+ */
+static int parse_voltage(const char* id, unsigned int* ch, char* iq)
+{
+	int end = 0;
+
+	if(!id || sscanf(id, "voltage%u_%c%n", ch, iq, &end) != 2 || id[end] != '\0' ||
+	   *ch >= AD9081_MAX_CH) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Parses a DDS channel name, 'TXn_I_Fm' or 'TXn_Q_Fm'. Channel n and tone m
+ * both start at 1. Returns the slot for it, or NULL if the name doesn't match.
+ */
+static struct iio_channel** parse_dds(const char* name, ad9081_tx_ch_t* tx)
+{
+	unsigned int ch, tone;
+	char iq;
+	int end = 0;
+
+	if(!name || sscanf(name, "TX%u_%c_F%u%n", &ch, &iq, &tone, &end) != 3 ||
+	   name[end] != '\0' || ch < 1 || ch > AD9081_MAX_CH) {
+		return NULL;
+	}
+	if(tone == 1) {
+		return pair_slot(&tx[ch - 1].dds.tone1, iq);
+	}
+	if(tone == 2) {
+		return pair_slot(&tx[ch - 1].dds.tone2, iq);
+	}
+	return NULL;
+}
+
+/**
+ * Checks every handle of a pair was found, reporting the ones which weren't
+ */
+static int check_pair(const ad9081_pair_t* pair, const char* what, unsigned int ch)
+{
+	int result = 0;
+
+	if(!pair->ch_i) {
+		error("Missing %s I channel %u\n", what, ch);
+		result = -1;
+	}
+	if(!pair->ch_q) {
+		error("Missing %s Q channel %u\n", what, ch);
+		result = -1;
+	}
+	return result;
+}
+
+/**
+ * Checks a pair which may be missing altogether, i.e. the DDS tones on a build
+ * of the core without a DDS. Only a pair with one of I and Q is an error.
+ */
+static int check_optional_pair(const ad9081_pair_t* pair, const char* what, unsigned int ch)
+{
+	if(!pair->ch_i && !pair->ch_q) {
+		return 0;
+	}
+	return check_pair(pair, what, ch);
+}
+
+int ad9081_ctx_open(ad9081_ctx_t* ad, struct iio_context* ctx)
+{
+	unsigned int i, count, ch;
+	char iq;
+	int result = 0;
+	struct iio_channel* chn;
+	struct iio_channel** slot;
+	ad9081_rx_ch_t rx[AD9081_MAX_CH];
+	ad9081_tx_ch_t tx[AD9081_MAX_CH];
+
+	memset(ad, 0, sizeof(*ad));
+	memset(rx, 0, sizeof(rx));
+	memset(tx, 0, sizeof(tx));
+	ad->ctx = ctx;
+
+	/* Devices are found by their IIO name */
+	ad->rx_dev = iio_context_find_device(ctx, AD9081_RX_DEV_NAME);
+	ad->tx_dev = iio_context_find_device(ctx, AD9081_TX_DEV_NAME);
+	if(!ad->rx_dev || !ad->tx_dev) {
+		error("Could not find AD9081 Devices\n");
+		return -1;
+	}
+
+	/* Rx device: inputs are the Rx channels, outputs configure the Tx channels */
+	count = iio_device_get_channels_count(ad->rx_dev);
+	for(i = 0; i < count; i++) {
+		chn = iio_device_get_channel(ad->rx_dev, i);
+		if(parse_voltage(iio_channel_get_id(chn), &ch, &iq) < 0) {
+			continue;
+		}
+		if(iio_channel_is_output(chn)) {
+			slot = pair_slot(&tx[ch].cfg, iq);
+		} else if((slot = pair_slot(&rx[ch].in, iq)) != NULL && ch + 1 > ad->num_rx_ch) {
+			ad->num_rx_ch = ch + 1;
+		}
+		if(slot) {
+			*slot = chn;
+		}
+	}
+
+	/* Tx device: voltage outputs are the DAC/DMA channels, the DDS channels
+	 * are identified by their names
+	 */
+	count = iio_device_get_channels_count(ad->tx_dev);
+	for(i = 0; i < count; i++) {
+		chn = iio_device_get_channel(ad->tx_dev, i);
+		if(!iio_channel_is_output(chn)) {
+			continue;
+		}
+		if(parse_voltage(iio_channel_get_id(chn), &ch, &iq) == 0) {
+			if((slot = pair_slot(&tx[ch].dac, iq)) != NULL && ch + 1 > ad->num_tx_ch) {
+				ad->num_tx_ch = ch + 1;
+			}
+		} else {
+			slot = parse_dds(iio_channel_get_name(chn), tx);
+		}
+		if(slot) {
+			*slot = chn;
+		}
+		if(!ad->dds_ctrl && strcmp(iio_channel_get_id(chn), "altvoltage0") == 0) {
+			ad->dds_ctrl = chn;
+		}
+	}
+
+	/* Every channel up to the highest one found has to be complete, apart
+	 * from the DDS tones, which are either both there or not at all
+	 */
+	for(ch = 0; ch < ad->num_rx_ch; ch++) {
+		result |= check_pair(&rx[ch].in, "Rx input", ch);
+	}
+	for(ch = 0; ch < ad->num_tx_ch; ch++) {
+		result |= check_pair(&tx[ch].cfg, "Tx config", ch);
+		result |= check_pair(&tx[ch].dac, "Tx DAC", ch);
+		result |= check_optional_pair(&tx[ch].dds.tone1, "DDS tone 1", ch);
+		result |= check_optional_pair(&tx[ch].dds.tone2, "DDS tone 2", ch);
+	}
+	if(ad->num_rx_ch == 0 || ad->num_tx_ch == 0) {
+		error("No AD9081 channels found (Rx %u, Tx %u)\n", ad->num_rx_ch, ad->num_tx_ch);
+		result = -1;
+	}
+	if(result != 0) {
+		memset(ad, 0, sizeof(*ad));
+		return -1;
+	}
+
+	ad->rx = malloc(ad->num_rx_ch * sizeof(ad9081_rx_ch_t));
+	ad->tx = malloc(ad->num_tx_ch * sizeof(ad9081_tx_ch_t));
+	if(!ad->rx || !ad->tx) {
+		error("Could not allocate the channel tables\n");
+		ad9081_ctx_close(ad);
+		return -1;
+	}
+	memcpy(ad->rx, rx, ad->num_rx_ch * sizeof(ad9081_rx_ch_t));
+	memcpy(ad->tx, tx, ad->num_tx_ch * sizeof(ad9081_tx_ch_t));
+	return 0;
+}
+
+void ad9081_ctx_close(ad9081_ctx_t* ad)
+{
+	free(ad->rx);
+	free(ad->tx);
+	memset(ad, 0, sizeof(*ad));
+}
@@ -0,0 +1,90 @@
+/*
+ * Shared AD9081 discovery layer for the libiio examples. Finds the AD9081
+ * devices and every channel the examples use in a single pass over each
+ * device, and keeps the handles in tables indexed by channel number.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#ifndef AD9081_CTX_H
+#define AD9081_CTX_H
+
+#include <iio.h>
+#include <stdbool.h>
+
+/* IIO names of the AD9081 devices. The Rx device serves as both the Rx
+ * device, and the device for configuring all the channels (rx & tx).
+ * The Tx device manages the DDS/DMA for transmit
+ */
+#define AD9081_RX_DEV_NAME	"axi-ad9081-rx-hpc"
+#define AD9081_TX_DEV_NAME	"axi-ad9081-tx-hpc"
+
+/* Upper limit on the I&Q pairs in either direction. The actual number depends
+ * on the JESD mode and is found at run time, i.e. 4 pairs for m8_l4
+ */
+#define AD9081_MAX_CH		16
+
+/* An I & Q channel pair */
+typedef struct {
+	struct iio_channel* ch_i;
+	struct iio_channel* ch_q;
+} ad9081_pair_t;
+
+/* The two DDS tones of a Tx channel, each with independent I & Q. A tone's
+ * handles are both NULL if the core has no DDS
+ */
+typedef struct {
+	ad9081_pair_t tone1;
+	ad9081_pair_t tone2;
+} ad9081_dds_t;
+
+/* Every handle for Rx channel n. The input channels are used both for buffers
+ * and for configuring the Rx path (NCOs, test mode, etc)
+ */
+typedef struct {
+	ad9081_pair_t in;		/* voltageN_i/q inputs of the Rx device */
+} ad9081_rx_ch_t;
+
+/* Every handle for Tx channel n, kept together in one row of the table */
+typedef struct {
+	ad9081_pair_t cfg;		/* voltageN_i/q outputs of the Rx device, for NCOs etc */
+	ad9081_pair_t dac;		/* voltageN_i/q outputs of the Tx device, for buffers */
+	ad9081_dds_t dds;		/* TX<N+1>_I/Q_F1/F2 DDS channels of the Tx device */
+} ad9081_tx_ch_t;
+
+typedef struct {
+	struct iio_context* ctx;
+	struct iio_device* rx_dev;
+	struct iio_device* tx_dev;
+
+	/* DDS control channel, where 'raw' has a global effect on all DAC
+	 * channels. NULL if there is no DDS
+	 */
+	struct iio_channel* dds_ctrl;
+
+	unsigned int num_rx_ch;
+	unsigned int num_tx_ch;
+	ad9081_rx_ch_t* rx;		/* [num_rx_ch] */
+	ad9081_tx_ch_t* tx;		/* [num_tx_ch] */
+} ad9081_ctx_t;
+
+/**
+ * Discovers the AD9081 devices and channels of ctx into ad. The number of
+ * channels in each direction is taken from the channels the devices actually
+ * have, and every handle for those channels must be found, except the DDS
+ * tones, which are left NULL when the Tx device has none.
+ * The context is not owned, and must outlive ad.
+ * Returns 0 on success, negative on error, with ad left closed.
+ */
+int ad9081_ctx_open(ad9081_ctx_t* ad, struct iio_context* ctx);
+
+/**
+ * Releases the channel tables. The IIO context itself is left alone.
+ */
+void ad9081_ctx_close(ad9081_ctx_t* ad);
+
+#endif
@@ -0,0 +1,175 @@
+/*
+ * Register snapshots of the AD9081 Tx (AXI DAC) core for the libiio examples.
+ *
+ * Over the IIO debug register interface every register is its own request,
+ * which over a network context is a round trip (or two) to iiod each. When
+ * running on the target itself, the core's registers are instead mapped from
+ * /dev/mem and read directly, so a full snapshot takes a few microseconds.
+ * The base address of the core comes from the name of its platform device in
+ * sysfs, i.e. /sys/devices/platform/axi/84a04000.axi-ad9081-tx-hpc/iio:device3
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include "ad9081_regs.h"
+#include "ad9081_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Amount of the core mapped, covering every channel register */
+#define DAC_CORE_MAP_LEN	0x1000
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Finds the physical base address of an IIO device's core from the name of its
+ * parent platform device. Returns 0 on success, -1 if it can't be worked out.
+ */
+static int find_core_base(struct iio_device* dev, unsigned long long* base)
+{
+	char path[PATH_MAX];
+	char real[PATH_MAX];
+	char* parent;
+	char* end;
+
+	snprintf(path, sizeof(path), "/sys/bus/iio/devices/%s/..", iio_device_get_id(dev));
+	if(!realpath(path, real) || (parent = strrchr(real, '/')) == NULL) {
+		return -1;
+	}
+	*base = strtoull(parent + 1, &end, 16);
+	if(end == parent + 1 || *end != '.') {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Maps the core through /dev/mem. Returns 0 on success, -1 if it's not
+ * possible, in which case the IIO path is used.
+ */
+static int map_core(ad9081_regs_t* regs)
+{
+	unsigned long long base;
+	long page = sysconf(_SC_PAGESIZE);
+	off_t offset;
+	void* map;
+	int fd;
+
+	if(find_core_base(regs->dev, &base) < 0) {
+		return -1;
+	}
+	if((fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
+		return -1;
+	}
+	offset = (off_t)(base & ~(unsigned long long)(page - 1));
+	regs->map_len = (base - offset) + DAC_CORE_MAP_LEN;
+	map = mmap(NULL, regs->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+	close(fd);
+	if(map == MAP_FAILED) {
+		return -1;
+	}
+	regs->map_base = map;
+	regs->map = (volatile uint32_t*)((uint8_t*)map + (base - offset));
+	regs->path = AD9081_REGS_MMAP;
+	return 0;
+}
+
+int ad9081_regs_open(ad9081_regs_t* regs, const ad9081_ctx_t* ad)
+{
+	const char* name;
+
+	memset(regs, 0, sizeof(*regs));
+	regs->dev = ad->tx_dev;
+	regs->num_dac_ch = ad->num_tx_ch * 2;
+	regs->path = AD9081_REGS_IIO;
+	if(!regs->dev || regs->num_dac_ch > AD9081_MAX_DAC_CH) {
+		return -1;
+	}
+
+	/* The registers can only be mapped when running on the target */
+	name = iio_context_get_name(ad->ctx);
+	if(name && strcmp(name, "local") == 0 && !getenv("AD9081_REGS_NO_MMAP")) {
+		map_core(regs);
+	}
+	return 0;
+}
+
+int ad9081_regs_read(ad9081_regs_t* regs, uint32_t addr, uint32_t* val)
+{
+	if(regs->map) {
+		*val = regs->map[addr / 4];
+		return 0;
+	}
+	return AD9081_TRACED(AD9081_TP_REG_READ, addr, iio_device_reg_read(regs->dev, addr, val));
+}
+
+int ad9081_regs_write(ad9081_regs_t* regs, uint32_t addr, uint32_t val)
+{
+	if(regs->map) {
+		regs->map[addr / 4] = val;
+		return 0;
+	}
+	return AD9081_TRACED(AD9081_TP_REG_WRITE, addr, iio_device_reg_write(regs->dev, addr, val));
+}
+
+int ad9081_regs_snapshot(ad9081_regs_t* regs, ad9081_dac_snapshot_t* snap)
+{
+	unsigned int i;
+	int result;
+	uint64_t t0 = AD9081_TRACE_BEGIN();
+
+	snap->num_dac_ch = regs->num_dac_ch;
+	snap->result = 0;
+	snap->t_start = now_sec();
+	if(regs->map) {
+		for(i = 0; i < regs->num_dac_ch; i++) {
+			snap->ctrl[i] = regs->map[DAC_CH_REG(i, DAC_CH_CTRL_OFFSET) / 4];
+		}
+		snap->vdma_status = regs->map[ADI_REG_VDMA_STATUS / 4];
+	} else {
+		for(i = 0; i < regs->num_dac_ch; i++) {
+			result = iio_device_reg_read(regs->dev, DAC_CH_REG(i, DAC_CH_CTRL_OFFSET),
+						     &snap->ctrl[i]);
+			if(result < 0 && snap->result == 0) {
+				snap->result = result;
+			}
+		}
+		result = iio_device_reg_read(regs->dev, ADI_REG_VDMA_STATUS, &snap->vdma_status);
+		if(result < 0 && snap->result == 0) {
+			snap->result = result;
+		}
+	}
+	snap->t_end = now_sec();
+	if(t0) {
+		ad9081_trace_end(AD9081_TP_REG_SNAPSHOT, t0, snap->num_dac_ch, snap->result);
+	}
+	return snap->result;
+}
+
+const char* ad9081_regs_path_name(const ad9081_regs_t* regs)
+{
+	return regs->path == AD9081_REGS_MMAP ? "mmap" : "iio";
+}
+
+void ad9081_regs_close(ad9081_regs_t* regs)
+{
+	if(regs->map_base) {
+		munmap(regs->map_base, regs->map_len);
+	}
+	memset(regs, 0, sizeof(*regs));
+}
@@ -0,0 +1,97 @@
+/*
+ * Register snapshots of the AD9081 Tx (AXI DAC) core for the libiio
+ * examples. Reads the CTRL7 register of every DAC channel plus the VDMA
+ * status in one call, timestamped, either straight from the mapped core or
+ * through the IIO debug register interface.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#ifndef AD9081_REGS_H
+#define AD9081_REGS_H
+
+#include <iio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "ad9081_ctx.h"
+
+/* Constants for direct register access for channel information */
+#define DAC_CH_REG_BASE		0x400
+#define DAC_CH_REG_STEP		0x40
+#define DAC_CH_CTRL_OFFSET	0x18
+
+/* DMA status register of the DAC core. Bits are write 1 to clear */
+#define ADI_REG_VDMA_STATUS	0x0088
+#define ADI_VDMA_OVF		(1 << 1)
+#define ADI_VDMA_UNF		(1 << 0)
+
+/* Register address of a per channel register of DAC channel ch. There are two
+ * DAC channels (I & Q) per channel pair
+ */
+#define DAC_CH_REG(ch, reg)	(DAC_CH_REG_BASE + ((ch) * DAC_CH_REG_STEP) + (reg))
+
+/* Most DAC channels a snapshot holds */
+#define AD9081_MAX_DAC_CH	(AD9081_MAX_CH * 2)
+
+/* How the registers are being accessed */
+typedef enum {
+	AD9081_REGS_IIO = 0,	/* iio_device_reg_read/write, one request each */
+	AD9081_REGS_MMAP,	/* The core mapped through /dev/mem, local only */
+} ad9081_regs_path_t;
+
+typedef struct {
+	struct iio_device* dev;
+	unsigned int num_dac_ch;	/* CTRL registers in each snapshot */
+	ad9081_regs_path_t path;
+	volatile uint32_t* map;		/* Start of the core when mapped */
+	void* map_base;
+	size_t map_len;
+} ad9081_regs_t;
+
+/* One snapshot of the core. t_start and t_end are CLOCK_MONOTONIC seconds
+ * bracketing the reads, so a transition seen between two snapshots can be
+ * placed in time
+ */
+typedef struct {
+	double t_start;
+	double t_end;
+	uint32_t vdma_status;
+	uint32_t ctrl[AD9081_MAX_DAC_CH];	/* CTRL7 of each DAC channel */
+	unsigned int num_dac_ch;
+	int result;				/* 0, or the first read error */
+} ad9081_dac_snapshot_t;
+
+/**
+ * Sets up register access to the Tx core of ad, covering the CTRL registers of
+ * all its Tx channels. On a local context the core is mapped directly if
+ * /dev/mem allows it, otherwise (and on network contexts) the IIO debug
+ * register interface is used. Set AD9081_REGS_NO_MMAP in the environment to
+ * always use the IIO path.
+ * Returns 0 on success, negative on error.
+ */
+int ad9081_regs_open(ad9081_regs_t* regs, const ad9081_ctx_t* ad);
+
+/**
+ * Takes a snapshot of every CTRL register and the VDMA status
+ * Returns 0 on success, or the first error hit (which is also in snap->result)
+ */
+int ad9081_regs_snapshot(ad9081_regs_t* regs, ad9081_dac_snapshot_t* snap);
+
+/**
+ * Reads/writes a single register of the core
+ */
+int ad9081_regs_read(ad9081_regs_t* regs, uint32_t addr, uint32_t* val);
+int ad9081_regs_write(ad9081_regs_t* regs, uint32_t addr, uint32_t val);
+
+/**
+ * Name of the access path in use, for reports
+ */
+const char* ad9081_regs_path_name(const ad9081_regs_t* regs);
+
+void ad9081_regs_close(ad9081_regs_t* regs);
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * Real time placement for the streaming examples.
+ *
+ * Threads are pinned with pthread_setaffinity_np() and given SCHED_FIFO with
+ * pthread_setschedparam(), which both work on other threads, so the main
+ * thread places every thread at once when the baseline is over. The AXI DMA
+ * interrupts are found from the devices bound to the dma-axi-dmac driver,
+ * whose names are the actions in /proc/interrupts, and are moved through
+ * /proc/irq/N/smp_affinity_list.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#define _GNU_SOURCE
+#include "ad9081_rt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+#define info(...) \
+	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+#define AXI_DMAC_DRIVER_DIR	"/sys/bus/platform/drivers/dma-axi-dmac"
+
+void ad9081_rt_init(ad9081_rt_t* rt)
+{
+	memset(rt, 0, sizeof(*rt));
+	rt->irq_cpu = -1;
+	rt->warmup = AD9081_RT_DEFAULT_WARMUP;
+	rt->baseline = AD9081_RT_DEFAULT_BASELINE;
+}
+
+int ad9081_rt_parse_baseline(ad9081_rt_t* rt, const char* arg)
+{
+	char* end;
+	long blocks = strtol(arg, &end, 10);
+
+	if(end == arg || *end != '\0' || blocks < 0 || blocks > AD9081_RT_MAX_BASELINE) {
+		error("Bad baseline %s, expected 0 to %d blocks\n", arg, AD9081_RT_MAX_BASELINE);
+		return -EINVAL;
+	}
+	rt->baseline = blocks;
+	return 0;
+}
+
+int ad9081_rt_parse_cpus(ad9081_rt_t* rt, const char* list)
+{
+	long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	const char* p = list;
+	char* end;
+	long cpu;
+
+	rt->num_cpus = 0;
+	while(*p) {
+		cpu = strtol(p, &end, 10);
+		if(end == p || (*end != ',' && *end != '\0') || cpu < 0 || cpu >= num_cpus) {
+			error("Bad CPU list %s, expected CPUs 0 to %ld separated by commas\n", list, num_cpus - 1);
+			return -EINVAL;
+		}
+		if(rt->num_cpus == AD9081_RT_MAX_CPUS) {
+			error("More than %d CPUs in %s\n", AD9081_RT_MAX_CPUS, list);
+			return -EINVAL;
+		}
+		rt->cpus[rt->num_cpus++] = cpu;
+		p = *end ? end + 1 : end;
+	}
+	if(rt->num_cpus == 0) {
+		error("Empty CPU list\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+bool ad9081_rt_requested(const ad9081_rt_t* rt)
+{
+	return rt->num_cpus > 0 || rt->priority > 0 || rt->lock_memory || rt->irq_cpu >= 0;
+}
+
+/*
+ * Pins and prioritises thread i. The main thread gets the first CPU, and the
+ * helpers share the others, or all float when only the first is given.
+ * Helpers run one priority below the main thread, so the refill or push is
+ * never held up behind a writer or a generator.
+ */
+static int place_thread(ad9081_rt_t* rt, unsigned int i)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int cpu = -1;
+	int prio = 0;
+	int result;
+	int ret = 0;
+
+	if(i == 0 && rt->num_cpus > 0) {
+		cpu = rt->cpus[0];
+	} else if(rt->num_cpus > 1) {
+		cpu = rt->cpus[1 + (i - 1) % (rt->num_cpus - 1)];
+	}
+	if(rt->priority > 0) {
+		prio = i == 0 || rt->priority == 1 ? rt->priority : rt->priority - 1;
+	}
+
+	if(cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		result = pthread_setaffinity_np(rt->threads[i], sizeof(set), &set);
+		if(result) {
+			error("Can't pin %s to CPU %d (%d)\n", rt->thread_names[i], cpu, result);
+			ret = -result;
+			cpu = -1;
+		}
+	}
+	if(prio > 0) {
+		param.sched_priority = prio;
+		result = pthread_setschedparam(rt->threads[i], SCHED_FIFO, &param);
+		if(result) {
+			error("Can't run %s SCHED_FIFO %d (%d), needs root or CAP_SYS_NICE\n", rt->thread_names[i], prio, result);
+			ret = -result;
+			prio = 0;
+		}
+	}
+
+	if(cpu >= 0 && prio > 0) {
+		info("%s on CPU %d, SCHED_FIFO %d\n", rt->thread_names[i], cpu, prio);
+	} else if(cpu >= 0) {
+		info("%s on CPU %d\n", rt->thread_names[i], cpu);
+	} else if(prio > 0) {
+		info("%s SCHED_FIFO %d\n", rt->thread_names[i], prio);
+	}
+	return ret;
+}
+
+int ad9081_rt_add_thread(ad9081_rt_t* rt, pthread_t thread, const char* name)
+{
+	unsigned int i = rt->num_threads;
+
+	if(i == AD9081_RT_MAX_THREADS) {
+		error("More than %d threads to place\n", AD9081_RT_MAX_THREADS);
+		return -ENOSPC;
+	}
+	rt->threads[i] = thread;
+	snprintf(rt->thread_names[i], sizeof(rt->thread_names[i]), "%s", name);
+	rt->num_threads++;
+
+	if(rt->applied) {
+		return place_thread(rt, i);
+	}
+	return 0;
+}
+
+/*
+ * Finds the interrupts of the devices bound to the AXI DMA driver, i.e.
+ * "9c420000.dma", by their action name in /proc/interrupts
+ */
+static void find_dma_irqs(ad9081_rt_t* rt)
+{
+	char names[AD9081_RT_MAX_IRQS][64];
+	unsigned int num_names = 0;
+	struct dirent* entry;
+	char line[1024];
+	char* last;
+	char* tok;
+	char* save;
+	unsigned int irq;
+	unsigned int n;
+	DIR* dir;
+	FILE* f;
+
+	dir = opendir(AXI_DMAC_DRIVER_DIR);
+	if(!dir) {
+		return;
+	}
+	while((entry = readdir(dir)) && num_names < AD9081_RT_MAX_IRQS) {
+		//The bound devices are the entries named after their address
+		if(entry->d_name[0] != '.' && strchr(entry->d_name, '.') &&
+		   strlen(entry->d_name) < sizeof(names[0])) {
+			strcpy(names[num_names++], entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	f = fopen("/proc/interrupts", "r");
+	if(!f) {
+		return;
+	}
+	while(fgets(line, sizeof(line), f) && rt->num_irqs < AD9081_RT_MAX_IRQS) {
+		if(sscanf(line, " %u:", &irq) != 1) {
+			continue;
+		}
+		last = NULL;
+		for(tok = strtok_r(line, " \t\n,", &save); tok; tok = strtok_r(NULL, " \t\n,", &save)) {
+			last = tok;
+		}
+		for(n = 0; last && n < num_names; n++) {
+			if(!strcmp(last, names[n])) {
+				rt->irqs[rt->num_irqs].irq = irq;
+				memcpy(rt->irqs[rt->num_irqs].name, names[n], sizeof(names[n]));
+				rt->num_irqs++;
+				break;
+			}
+		}
+	}
+	fclose(f);
+}
+
+static int write_irq_affinity(unsigned int irq, const char* cpus)
+{
+	char path[64];
+	FILE* f;
+	int ret = 0;
+
+	snprintf(path, sizeof(path), "/proc/irq/%u/smp_affinity_list", irq);
+	f = fopen(path, "w");
+	if(!f) {
+		return -errno;
+	}
+	if(fprintf(f, "%s\n", cpus) < 0) {
+		ret = -errno;
+	}
+	if(fclose(f) && !ret) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+static int move_dma_irqs(ad9081_rt_t* rt)
+{
+	char cpus[16];
+	char path[64];
+	unsigned int i;
+	int result;
+	int ret = 0;
+	FILE* f;
+
+	find_dma_irqs(rt);
+	if(rt->num_irqs == 0) {
+		info("No AXI DMA interrupts found, nothing to move (only on the unit itself)\n");
+		return 0;
+	}
+
+	snprintf(cpus, sizeof(cpus), "%d", rt->irq_cpu);
+	for(i = 0; i < rt->num_irqs; i++) {
+		ad9081_rt_irq_t* irq = &rt->irqs[i];
+
+		snprintf(path, sizeof(path), "/proc/irq/%u/smp_affinity_list", irq->irq);
+		f = fopen(path, "r");
+		if(f) {
+			if(!fgets(irq->old_cpus, sizeof(irq->old_cpus), f)) {
+				irq->old_cpus[0] = '\0';
+			}
+			irq->old_cpus[strcspn(irq->old_cpus, "\n")] = '\0';
+			fclose(f);
+		}
+
+		result = write_irq_affinity(irq->irq, cpus);
+		if(result < 0) {
+			error("Can't move IRQ %u (%s) to CPU %s (%d), as root: echo %s > %s\n",
+				irq->irq, irq->name, cpus, result, cpus, path);
+			ret = result;
+			continue;
+		}
+		irq->moved = irq->old_cpus[0] != '\0';
+		info("IRQ %u (%s) on CPU %s, was %s\n", irq->irq, irq->name, cpus,
+			irq->old_cpus[0] ? irq->old_cpus : "unknown");
+	}
+	return ret;
+}
+
+int ad9081_rt_apply(ad9081_rt_t* rt)
+{
+	unsigned int i;
+	int result;
+	int ret = 0;
+
+	if(rt->applied) {
+		return 0;
+	}
+	rt->applied = true;
+
+	for(i = 0; i < rt->num_threads; i++) {
+		result = place_thread(rt, i);
+		if(result < 0) {
+			ret = result;
+		}
+	}
+
+	if(rt->lock_memory) {
+		if(mlockall(MCL_CURRENT | MCL_FUTURE)) {
+			result = -errno;
+			error("Can't lock the memory (%d), needs CAP_IPC_LOCK or a larger ulimit -l\n", result);
+			ret = result;
+		} else {
+			info("Memory locked\n");
+		}
+	}
+
+	if(rt->irq_cpu >= 0) {
+		result = move_dma_irqs(rt);
+		if(result < 0) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+void ad9081_rt_start(ad9081_rt_t* rt)
+{
+	if(!ad9081_rt_requested(rt)) {
+		return;
+	}
+	if(rt->baseline == 0) {
+		ad9081_rt_apply(rt);
+	} else if(rt->baseline < AD9081_RT_MIN_BASELINE) {
+		info("A %u block baseline is too short for its 99th percentile, use at least %d\n",
+			rt->baseline, AD9081_RT_MIN_BASELINE);
+	}
+}
+
+static void phase_add(ad9081_rt_phase_t* phase, uint64_t dt)
+{
+	if(!phase->kept) {
+		//Without the ring there are still the moments and the extremes
+		phase->kept = malloc(AD9081_RT_KEEP_INTERVALS * sizeof(*phase->kept));
+	}
+	if(phase->kept) {
+		phase->kept[phase->count % AD9081_RT_KEEP_INTERVALS] = dt > UINT32_MAX ? UINT32_MAX : dt;
+	}
+	if(phase->count == 0 || dt < phase->min_ns) {
+		phase->min_ns = dt;
+	}
+	if(dt > phase->max_ns) {
+		phase->max_ns = dt;
+	}
+	phase->sum += dt;
+	phase->sum_sq += (double)dt * dt;
+	phase->count++;
+}
+
+void ad9081_rt_mark(ad9081_rt_t* rt, uint64_t t_ns)
+{
+	rt->blocks++;
+	//The warm-up blocks only complete as fast as the queue fills, so aren't timed
+	if(rt->blocks <= rt->warmup) {
+		return;
+	}
+	if(rt->last_ns) {
+		phase_add(rt->applied ? &rt->after : &rt->before, t_ns - rt->last_ns);
+	}
+	rt->last_ns = t_ns;
+
+	if(!rt->applied && ad9081_rt_requested(rt) && rt->blocks >= rt->warmup + rt->baseline) {
+		ad9081_rt_apply(rt);
+		//The next interval has the placement itself in it, so isn't counted
+		rt->last_ns = 0;
+	}
+}
+
+/* Summary of one phase, in ns */
+typedef struct {
+	double mean;
+	double std;
+	double p50;
+	double p99;
+	double peak;	/* Furthest interval from the mean */
+} phase_stats_t;
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void phase_stats(const ad9081_rt_phase_t* phase, phase_stats_t* s)
+{
+	uint64_t n = phase->count < AD9081_RT_KEEP_INTERVALS ? phase->count : AD9081_RT_KEEP_INTERVALS;
+	double var;
+	uint32_t* sorted;
+
+	s->mean = phase->sum / phase->count;
+	var = phase->sum_sq / phase->count - s->mean * s->mean;
+	s->std = var > 0 ? sqrt(var) : 0;
+	s->peak = fmax(phase->max_ns - s->mean, s->mean - phase->min_ns);
+
+	s->p50 = s->p99 = NAN;
+	sorted = phase->kept ? malloc(n * sizeof(*sorted)) : NULL;
+	if(sorted) {
+		memcpy(sorted, phase->kept, n * sizeof(*sorted));
+		qsort(sorted, n, sizeof(*sorted), cmp_u32);
+		s->p50 = sorted[n / 2];
+		s->p99 = sorted[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+		free(sorted);
+	}
+}
+
+static void print_phase(const char* what, const char* when, const ad9081_rt_phase_t* phase, const phase_stats_t* s)
+{
+	info("%s interval %s: %llu intervals, mean %.3f ms, std %.1f us, p99 %.3f ms, max %.3f ms\n",
+		what, when, (unsigned long long)phase->count, s->mean / 1e6, s->std / 1e3, s->p99 / 1e6,
+		phase->max_ns / 1e6);
+}
+
+static void print_ratio(const char* what, double before, double after)
+{
+	if(after > 0 && !isnan(before) && !isnan(after)) {
+		info("  %-10s %9.1f us -> %9.1f us, %.1fx %s\n", what, before / 1e3, after / 1e3,
+			before >= after ? before / after : after / before, before >= after ? "lower" : "higher");
+	}
+}
+
+void ad9081_rt_report(const ad9081_rt_t* rt, const char* what)
+{
+	phase_stats_t before;
+	phase_stats_t after;
+
+	if(!ad9081_rt_requested(rt)) {
+		return;
+	}
+	if(rt->after.count == 0) {
+		info("%s interval: placement not applied, the run stopped within the %u block warm-up and baseline\n",
+			what, rt->warmup + rt->baseline);
+		return;
+	}
+
+	phase_stats(&rt->after, &after);
+	if(rt->before.count < 2) {
+		print_phase(what, "with the placement", &rt->after, &after);
+		return;
+	}
+	phase_stats(&rt->before, &before);
+	print_phase(what, "before the placement", &rt->before, &before);
+	print_phase(what, "with the placement", &rt->after, &after);
+	info("%s jitter with the placement:\n", what);
+	print_ratio("std", before.std, after.std);
+	print_ratio("p99 - p50", before.p99 - before.p50, after.p99 - after.p50);
+	print_ratio("peak", before.peak, after.peak);
+}
+
+void ad9081_rt_release(ad9081_rt_t* rt)
+{
+	unsigned int i;
+	int result;
+
+	for(i = 0; i < rt->num_irqs; i++) {
+		if(!rt->irqs[i].moved) {
+			continue;
+		}
+		result = write_irq_affinity(rt->irqs[i].irq, rt->irqs[i].old_cpus);
+		if(result < 0) {
+			error("Can't move IRQ %u back to CPU %s (%d)\n", rt->irqs[i].irq, rt->irqs[i].old_cpus, result);
+		}
+		rt->irqs[i].moved = false;
+	}
+	free(rt->before.kept);
+	free(rt->after.kept);
+	rt->before.kept = NULL;
+	rt->after.kept = NULL;
+}
@@ -0,0 +1,150 @@
+/*
+ * Real time placement for the streaming examples. Pins the refill/push thread
+ * and its helper threads to chosen CPUs with SCHED_FIFO, locks the process
+ * memory, and moves the AXI DMA interrupts onto a chosen CPU. The interval
+ * between blocks is measured before and after the placement is applied, so a
+ * run reports the jitter it removed.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#ifndef AD9081_RT_H
+#define AD9081_RT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/* Most CPUs in a placement list, and threads placed */
+#define AD9081_RT_MAX_CPUS	16
+#define AD9081_RT_MAX_THREADS	24
+
+/* Most AXI DMA interrupts moved */
+#define AD9081_RT_MAX_IRQS	8
+
+/* Block intervals kept per phase for the percentiles, the latest are kept */
+#define AD9081_RT_KEEP_INTERVALS	65536
+
+/* Blocks run before the placement when none is given, the fewest for a
+ * meaningful 99th percentile, and the most which can be asked for
+ */
+#define AD9081_RT_DEFAULT_BASELINE	200
+#define AD9081_RT_MIN_BASELINE		100
+#define AD9081_RT_MAX_BASELINE		10000000
+
+/* Blocks left out at the start when none is given, the kernel DMA blocks
+ * libiio queues by default
+ */
+#define AD9081_RT_DEFAULT_WARMUP	4
+
+/* Intervals between the blocks of one phase, in ns */
+typedef struct {
+	uint64_t count;
+	double sum;
+	double sum_sq;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint32_t* kept;			/* Ring of the latest intervals, saturated */
+} ad9081_rt_phase_t;
+
+/* An interrupt moved by the placement, and where it was before */
+typedef struct {
+	unsigned int irq;
+	char name[64];
+	char old_cpus[64];
+	bool moved;
+} ad9081_rt_irq_t;
+
+typedef struct {
+	/* Settings, from the command line */
+	int cpus[AD9081_RT_MAX_CPUS];	/* cpus[0] for the main thread, the rest for helpers */
+	unsigned int num_cpus;
+	int priority;			/* SCHED_FIFO priority of the main thread, 0 for none */
+	bool lock_memory;
+	int irq_cpu;			/* CPU for the AXI DMA interrupts, -1 to leave them */
+	unsigned int warmup;		/* Blocks not timed at the start, i.e. the Tx pushes filling the kernel queue */
+	unsigned int baseline;		/* Blocks run after the warm-up before the placement is applied */
+
+	/* State */
+	pthread_t threads[AD9081_RT_MAX_THREADS];	/* threads[0] is the main thread */
+	char thread_names[AD9081_RT_MAX_THREADS][16];
+	unsigned int num_threads;
+	bool applied;
+	uint64_t blocks;
+	uint64_t last_ns;
+	ad9081_rt_phase_t before;
+	ad9081_rt_phase_t after;
+	ad9081_rt_irq_t irqs[AD9081_RT_MAX_IRQS];
+	unsigned int num_irqs;
+} ad9081_rt_t;
+
+/**
+ * Sets up rt with nothing placed, and the default warm-up and baseline
+ */
+void ad9081_rt_init(ad9081_rt_t* rt);
+
+/**
+ * Parses the number of baseline blocks, 0 to AD9081_RT_MAX_BASELINE.
+ * Returns 0 on success, negative on error.
+ */
+int ad9081_rt_parse_baseline(ad9081_rt_t* rt, const char* arg);
+
+/**
+ * Parses a comma separated CPU list, i.e. "3,1,2". The first CPU is for the
+ * main (refill or push) thread and the others are handed to the helper
+ * threads in turn. Returns 0 on success, negative on error.
+ */
+int ad9081_rt_parse_cpus(ad9081_rt_t* rt, const char* list);
+
+/**
+ * Whether any placement was asked for
+ */
+bool ad9081_rt_requested(const ad9081_rt_t* rt);
+
+/**
+ * Adds a thread to place. The first thread added is the main thread, every
+ * other one a helper. A thread added once the placement is applied is placed
+ * straight away. Threads have to stay running until the baseline is over.
+ * Returns 0 on success, negative on error.
+ */
+int ad9081_rt_add_thread(ad9081_rt_t* rt, pthread_t thread, const char* name);
+
+/**
+ * Applies the placement: pins and prioritises every thread added, locks all
+ * the memory of the process, and moves the AXI DMA interrupts. What can't be
+ * done, i.e. without root, is reported and the rest still applied.
+ * Returns 0 if everything was applied, negative otherwise.
+ */
+int ad9081_rt_apply(ad9081_rt_t* rt);
+
+/**
+ * Called by the main thread once every thread is added, right before the
+ * first block. Applies the placement straight away when there is no baseline,
+ * and warns when the baseline is too short to compare the percentiles with.
+ */
+void ad9081_rt_start(ad9081_rt_t* rt);
+
+/**
+ * Marks a block done at t_ns (CLOCK_MONOTONIC), from the main thread. Past
+ * the warm-up blocks, the interval from the last block is put in the phase it
+ * belongs to, and the placement is applied after the baseline blocks.
+ */
+void ad9081_rt_mark(ad9081_rt_t* rt, uint64_t t_ns);
+
+/**
+ * Prints the block intervals before and after the placement, and how much
+ * lower the jitter was with it. what names the block, i.e. "Refill".
+ */
+void ad9081_rt_report(const ad9081_rt_t* rt, const char* what);
+
+/**
+ * Moves the interrupts back where they were, and frees the intervals
+ */
+void ad9081_rt_release(ad9081_rt_t* rt);
+
+#endif
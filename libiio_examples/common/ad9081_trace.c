@@ -0,0 +1,381 @@
+/*
+ * Call tracing for the libiio examples.
+ *
+ * Each trace point has a count, an error count, the total and longest time,
+ * and a histogram of power of two buckets in ns, all updated with relaxed
+ * atomic adds so any thread can record without taking a lock. Each thread
+ * also has its own ring of the latest calls it made, which only it writes,
+ * so recording a call is a few stores. The rings are linked into a list when
+ * a thread first records, and are only read on close, once every thread is
+ * done.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include "ad9081_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+#define info(...) \
+	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+/* Histogram buckets are le 2^n ns for n from FIRST_BUCKET_LOG2 (1.024 us) up
+ * to LAST_BUCKET_LOG2 (17.2 s). Anything longer only counts towards +Inf
+ */
+#define FIRST_BUCKET_LOG2	10
+#define LAST_BUCKET_LOG2	34
+#define NUM_BUCKETS		(LAST_BUCKET_LOG2 - FIRST_BUCKET_LOG2 + 1)
+
+#define DEFAULT_RING_EVENTS	65536
+#define MAX_THREAD_NAME		32
+
+/* Counters of one trace point */
+typedef struct {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t buckets[NUM_BUCKETS + 1];	/* The last is above LAST_BUCKET_LOG2 */
+} tp_stats_t;
+
+/* One call in a ring */
+typedef struct {
+	uint64_t start_ns;
+	uint64_t dur_ns;
+	long long arg;
+	int32_t result;
+	uint16_t tp;
+} trace_event_t;
+
+/* The calls of one thread. head counts every call ever recorded, the slot of
+ * a call is head modulo the size
+ */
+typedef struct trace_ring {
+	struct trace_ring* next;
+	pid_t tid;
+	char name[MAX_THREAD_NAME];
+	uint64_t head;
+	trace_event_t events[];
+} trace_ring_t;
+
+static const char* tp_names[AD9081_TP_COUNT] = {
+	[AD9081_TP_ATTR_WRITE] = "attr_write",
+	[AD9081_TP_ATTR_WRITE_ALL] = "attr_write_all",
+	[AD9081_TP_ATTR_READ_ALL] = "attr_read_all",
+	[AD9081_TP_REG_READ] = "reg_read",
+	[AD9081_TP_REG_WRITE] = "reg_write",
+	[AD9081_TP_REG_SNAPSHOT] = "reg_snapshot",
+	[AD9081_TP_REFILL] = "refill",
+	[AD9081_TP_PUSH] = "push",
+	[AD9081_TP_BUFFER_CREATE] = "buffer_create",
+	[AD9081_TP_BUFFER_DESTROY] = "buffer_destroy",
+};
+
+bool ad9081_trace_enabled = false;
+
+static tp_stats_t tp_stats[AD9081_TP_COUNT];
+static const char* metrics_path = NULL;
+static const char* trace_path = NULL;
+static size_t ring_events = DEFAULT_RING_EVENTS;
+static uint64_t t_open;
+
+/* Attribute names by id, each set once with a copy of the name */
+static char* attr_names[AD9081_TRACE_MAX_ATTRS];
+
+static trace_ring_t* rings = NULL;
+static __thread trace_ring_t* my_ring = NULL;
+
+uint64_t ad9081_trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char* ad9081_trace_name(ad9081_tp_t tp)
+{
+	return tp < AD9081_TP_COUNT ? tp_names[tp] : "unknown";
+}
+
+int ad9081_trace_open(void)
+{
+	const char* events;
+
+	metrics_path = getenv("AD9081_METRICS");
+	trace_path = getenv("AD9081_TRACE");
+	if((events = getenv("AD9081_TRACE_EVENTS")) != NULL) {
+		ring_events = strtoul(events, NULL, 0);
+		if(ring_events == 0) {
+			error("AD9081_TRACE_EVENTS must be at least 1\n");
+			return -1;
+		}
+	}
+	memset(tp_stats, 0, sizeof(tp_stats));
+	t_open = ad9081_trace_now();
+	ad9081_trace_enabled = (metrics_path && *metrics_path) || (trace_path && *trace_path);
+	return 0;
+}
+
+/**
+ * The ring of the calling thread, made and linked into the list the first
+ * time. NULL if there is no trace to record, or no memory for the ring.
+ */
+static trace_ring_t* thread_ring(void)
+{
+	trace_ring_t* ring;
+
+	if(my_ring || !trace_path || !*trace_path) {
+		return my_ring;
+	}
+	if((ring = calloc(1, sizeof(*ring) + ring_events * sizeof(trace_event_t))) == NULL) {
+		return NULL;
+	}
+	ring->tid = syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+					   __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	my_ring = ring;
+	return ring;
+}
+
+void ad9081_trace_end(ad9081_tp_t tp, uint64_t t0, long long arg, int result)
+{
+	uint64_t dur = ad9081_trace_now() - t0;
+	uint64_t max;
+	unsigned int b;
+	tp_stats_t* s;
+	trace_ring_t* ring;
+	trace_event_t* ev;
+
+	if(tp >= AD9081_TP_COUNT) {
+		return;
+	}
+	s = &tp_stats[tp];
+
+	//Smallest n with 2^n >= dur, so a call lands in the first bucket it is le
+	b = dur <= 1 ? 0 : 64 - __builtin_clzll(dur - 1);
+	b = b < FIRST_BUCKET_LOG2 ? 0 : b - FIRST_BUCKET_LOG2;
+	if(b > NUM_BUCKETS) {
+		b = NUM_BUCKETS;
+	}
+	__atomic_fetch_add(&s->buckets[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->sum_ns, dur, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	if(result < 0) {
+		__atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+	}
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while(dur > max && !__atomic_compare_exchange_n(&s->max_ns, &max, dur, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if((ring = thread_ring()) == NULL) {
+		return;
+	}
+	ev = &ring->events[ring->head % ring_events];
+	ev->start_ns = t0;
+	ev->dur_ns = dur;
+	ev->arg = arg;
+	ev->result = result;
+	ev->tp = tp;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+long long ad9081_trace_attr_id(const char* name)
+{
+	unsigned int i;
+	char* cur;
+	char* copy = NULL;
+
+	for( i = 0; i < AD9081_TRACE_MAX_ATTRS; i++ ) {
+		cur = __atomic_load_n(&attr_names[i], __ATOMIC_ACQUIRE);
+		if(!cur) {
+			if(!copy && (copy = strdup(name)) == NULL) {
+				return -1;
+			}
+			if(__atomic_compare_exchange_n(&attr_names[i], &cur, copy, false,
+						       __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+				return i;
+			}
+			//Another thread took the slot, cur is its name
+		}
+		if(strcmp(cur, name) == 0) {
+			free(copy);
+			return i;
+		}
+	}
+	free(copy);
+	return -1;
+}
+
+void ad9081_trace_thread_name(const char* name)
+{
+	trace_ring_t* ring;
+
+	if(ad9081_trace_enabled && (ring = thread_ring()) != NULL) {
+		snprintf(ring->name, sizeof(ring->name), "%s", name);
+	}
+}
+
+void ad9081_trace_write_metrics(void)
+{
+	char tmp[4096];
+	FILE* f;
+	unsigned int tp, b;
+	uint64_t cum;
+	tp_stats_t s;
+
+	if(!metrics_path || !*metrics_path) {
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	if((f = fopen(tmp, "w")) == NULL) {
+		error("Could not write the metrics to %s\n", tmp);
+		return;
+	}
+
+	fprintf(f, "# HELP ad9081_call_duration_seconds Time taken by each traced call\n");
+	fprintf(f, "# TYPE ad9081_call_duration_seconds histogram\n");
+	for( tp = 0; tp < AD9081_TP_COUNT; tp++ ) {
+		//Each counter is read once, so the buckets add up to the count
+		s.count = 0;
+		for( b = 0; b <= NUM_BUCKETS; b++ ) {
+			s.buckets[b] = __atomic_load_n(&tp_stats[tp].buckets[b], __ATOMIC_RELAXED);
+			s.count += s.buckets[b];
+		}
+		if(s.count == 0) {
+			continue;
+		}
+		s.sum_ns = __atomic_load_n(&tp_stats[tp].sum_ns, __ATOMIC_RELAXED);
+		for( b = 0, cum = 0; b < NUM_BUCKETS; b++ ) {
+			cum += s.buckets[b];
+			fprintf(f, "ad9081_call_duration_seconds_bucket{call=\"%s\",le=\"%.12g\"} %llu\n",
+				tp_names[tp], (double)(1ull << (b + FIRST_BUCKET_LOG2)) / 1e9,
+				(unsigned long long)cum);
+		}
+		fprintf(f, "ad9081_call_duration_seconds_bucket{call=\"%s\",le=\"+Inf\"} %llu\n",
+			tp_names[tp], (unsigned long long)s.count);
+		fprintf(f, "ad9081_call_duration_seconds_sum{call=\"%s\"} %.9f\n",
+			tp_names[tp], s.sum_ns / 1e9);
+		fprintf(f, "ad9081_call_duration_seconds_count{call=\"%s\"} %llu\n",
+			tp_names[tp], (unsigned long long)s.count);
+	}
+
+	fprintf(f, "# HELP ad9081_call_errors_total Traced calls which returned an error\n");
+	fprintf(f, "# TYPE ad9081_call_errors_total counter\n");
+	for( tp = 0; tp < AD9081_TP_COUNT; tp++ ) {
+		if(__atomic_load_n(&tp_stats[tp].count, __ATOMIC_RELAXED)) {
+			fprintf(f, "ad9081_call_errors_total{call=\"%s\"} %llu\n", tp_names[tp],
+				(unsigned long long)__atomic_load_n(&tp_stats[tp].errors,
+								    __ATOMIC_RELAXED));
+		}
+	}
+
+	fprintf(f, "# HELP ad9081_call_max_seconds Longest single traced call\n");
+	fprintf(f, "# TYPE ad9081_call_max_seconds gauge\n");
+	for( tp = 0; tp < AD9081_TP_COUNT; tp++ ) {
+		if(__atomic_load_n(&tp_stats[tp].count, __ATOMIC_RELAXED)) {
+			fprintf(f, "ad9081_call_max_seconds{call=\"%s\"} %.9f\n", tp_names[tp],
+				__atomic_load_n(&tp_stats[tp].max_ns, __ATOMIC_RELAXED) / 1e9);
+		}
+	}
+
+	if(fclose(f) != 0 || rename(tmp, metrics_path) != 0) {
+		error("Could not write the metrics to %s\n", metrics_path);
+		unlink(tmp);
+	}
+}
+
+/**
+ * Writes every call still in the rings as complete ("X") events, with
+ * microsecond timestamps from the open, and a thread_name event per named
+ * thread. Returns the number of calls which had been overwritten.
+ */
+static unsigned long long write_trace(FILE* f)
+{
+	trace_ring_t* ring;
+	trace_event_t* ev;
+	uint64_t head, i;
+	unsigned long long dropped = 0;
+	bool first = true;
+	pid_t pid = getpid();
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for( ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next ) {
+		if(ring->name[0]) {
+			fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid, ring->tid,
+				ring->name);
+			first = false;
+		}
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		i = head > ring_events ? head - ring_events : 0;
+		dropped += i;
+		for( ; i < head; i++ ) {
+			ev = &ring->events[i % ring_events];
+			fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"iio\",\"ph\":\"X\",\"pid\":%d,"
+				"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{", first ? "" : ",",
+				tp_names[ev->tp], pid, ring->tid, (ev->start_ns - t_open) / 1e3,
+				ev->dur_ns / 1e3);
+			if(ev->tp == AD9081_TP_ATTR_WRITE && ev->arg >= 0 &&
+			   ev->arg < AD9081_TRACE_MAX_ATTRS && attr_names[ev->arg]) {
+				fprintf(f, "\"attr\":\"%s\"", attr_names[ev->arg]);
+			} else {
+				fprintf(f, "\"arg\":%lld", ev->arg);
+			}
+			fprintf(f, ",\"result\":%d}}", ev->result);
+			first = false;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	return dropped;
+}
+
+void ad9081_trace_close(void)
+{
+	FILE* f;
+	trace_ring_t* ring;
+	unsigned long long dropped;
+	unsigned int i;
+
+	if(!ad9081_trace_enabled) {
+		return;
+	}
+	ad9081_trace_enabled = false;
+	ad9081_trace_write_metrics();
+
+	if(trace_path && *trace_path) {
+		if((f = fopen(trace_path, "w")) == NULL) {
+			error("Could not write the trace to %s\n", trace_path);
+		} else {
+			dropped = write_trace(f);
+			if(fclose(f) != 0) {
+				error("Could not write the trace to %s\n", trace_path);
+			} else if(dropped) {
+				info("Trace of %s is missing the %llu oldest calls, raise AD9081_TRACE_EVENTS\n",
+				     trace_path, dropped);
+			}
+		}
+	}
+
+	while((ring = rings) != NULL) {
+		rings = ring->next;
+		free(ring);
+	}
+	my_ring = NULL;
+	for( i = 0; i < AD9081_TRACE_MAX_ATTRS; i++ ) {
+		free(attr_names[i]);
+		attr_names[i] = NULL;
+	}
+}
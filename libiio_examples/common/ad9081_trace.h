@@ -0,0 +1,117 @@
+/*
+ * Call tracing for the libiio examples. Counts and times the libiio calls
+ * the examples make (attribute writes, refills, pushes, register access and
+ * buffer setup) into per call latency histograms, and records each call into
+ * a ring per thread. Everything is switched on from the environment, so a
+ * unit in the field is traced without rebuilding, and the histograms are
+ * written as Prometheus text and the calls as a Chrome trace.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#ifndef AD9081_TRACE_H
+#define AD9081_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* The calls which are traced */
+typedef enum {
+	AD9081_TP_ATTR_WRITE = 0,	/* iio_*_attr_write*, arg is AD9081_TRACE_ATTR(name) */
+	AD9081_TP_ATTR_WRITE_ALL,	/* iio_channel_attr_write_all, arg is the attributes */
+	AD9081_TP_ATTR_READ_ALL,	/* iio_channel_attr_read_all, arg is the attributes */
+	AD9081_TP_REG_READ,		/* iio_device_reg_read, arg is the address */
+	AD9081_TP_REG_WRITE,		/* iio_device_reg_write, arg is the address */
+	AD9081_TP_REG_SNAPSHOT,		/* ad9081_regs_snapshot, arg is the registers */
+	AD9081_TP_REFILL,		/* iio_buffer_refill, arg is the bytes */
+	AD9081_TP_PUSH,			/* iio_buffer_push, arg is the bytes */
+	AD9081_TP_BUFFER_CREATE,	/* iio_device_create_buffer, arg is the samples */
+	AD9081_TP_BUFFER_DESTROY,	/* iio_buffer_destroy */
+	AD9081_TP_COUNT
+} ad9081_tp_t;
+
+/* Most attribute names an attribute write can be traced with */
+#define AD9081_TRACE_MAX_ATTRS	128
+
+/* Set by ad9081_trace_open() when AD9081_METRICS or AD9081_TRACE is set. Only
+ * read by the trace macros, so a disabled trace point is one branch
+ */
+extern bool ad9081_trace_enabled;
+
+/**
+ * Current CLOCK_MONOTONIC time in ns
+ */
+uint64_t ad9081_trace_now(void);
+
+/* Start time of a traced call, or 0 when tracing is off */
+#define AD9081_TRACE_BEGIN()	(ad9081_trace_enabled ? ad9081_trace_now() : 0)
+
+/* Times one call returning a negative error, i.e.
+ * result = AD9081_TRACED(AD9081_TP_REFILL, bytes, iio_buffer_refill(buff));
+ */
+#define AD9081_TRACED(tp, arg, call) ({ \
+	uint64_t _tr_t0 = AD9081_TRACE_BEGIN(); \
+	__typeof__(call) _tr_r = (call); \
+	if(_tr_t0) { \
+		ad9081_trace_end((tp), _tr_t0, (long long)(arg), _tr_r < 0 ? (int)_tr_r : 0); \
+	} \
+	_tr_r; })
+
+/* Arg of an AD9081_TP_ATTR_WRITE, so the trace names the attribute written */
+#define AD9081_TRACE_ATTR(name)	ad9081_trace_attr_id(name)
+
+/**
+ * Reads the environment and switches tracing on if asked:
+ *   AD9081_METRICS=file      Write the call histograms to file as Prometheus
+ *                            text, on every ad9081_trace_write_metrics() and
+ *                            on close
+ *   AD9081_TRACE=file        Write every call recorded to file as a Chrome
+ *                            trace (chrome://tracing, Perfetto) on close
+ *   AD9081_TRACE_EVENTS=n    Calls kept per thread for the trace, the latest
+ *                            n are written (default 65536)
+ * Call before starting any thread. Returns 0 on success, negative on error.
+ */
+int ad9081_trace_open(void);
+
+/**
+ * Records a call which started at t0 (from AD9081_TRACE_BEGIN(), and not 0)
+ * and ended now. result is 0 or the negative error the call returned. Safe
+ * from any thread, and lock free.
+ */
+void ad9081_trace_end(ad9081_tp_t tp, uint64_t t0, long long arg, int result);
+
+/**
+ * Id of an attribute name, the same for every call with that name, and -1
+ * once AD9081_TRACE_MAX_ATTRS names are known. The trace writes the name back
+ * out. Only called from the trace macros, so only when tracing is on. Safe
+ * from any thread, and lock free.
+ */
+long long ad9081_trace_attr_id(const char* name);
+
+/**
+ * Names the calling thread in the trace, i.e. "tx worker 1"
+ */
+void ad9081_trace_thread_name(const char* name);
+
+/**
+ * Writes the histograms so far to the AD9081_METRICS file, replacing it in one
+ * rename so a collector never reads half a file. Does nothing when not set.
+ */
+void ad9081_trace_write_metrics(void);
+
+/**
+ * Writes the metrics and the trace, and frees the rings. Call once every
+ * thread which made a traced call has been joined.
+ */
+void ad9081_trace_close(void);
+
+/**
+ * Name of a trace point, as in the metrics and the trace
+ */
+const char* ad9081_trace_name(ad9081_tp_t tp);
+
+#endif
@@ -20,6 +20,13 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <stddef.h>
+#include <ctype.h>
+
+#include "ad9081_ctx.h"
+#include "ad9081_trace.h"
 
 /* Some reporting helpers */
 #define ARGS(fmt, ...)	__VA_ARGS__
@@ -33,29 +40,42 @@
 
 
 /* The AD9081 has a configurable number of channels based on the JESD and
- * device setup.
- * Unless otherwise provided at build time, assume the application is working
- * with 8 pairs of I&Q for both input and output
+ * device setup, which is found at run time. This is the number of channels
+ * with a default configuration below; only those the device actually has are
+ * configured (i.e. the first 4 for m8_l4)
  */
 #ifndef NUM_CH
 #define NUM_CH	8
 #endif
 
+/* Limits for the configuration engine. Every Rx, Tx and DDS channel used here
+ * is tracked, each with its full set of attributes as read back from the
+ * device.
+ */
+#define MAX_CFG_CHANNELS	(NUM_CH * 6)
+#define MAX_CFG_ATTRS		48
+#define CFG_NAME_LEN		48
+#define CFG_VAL_LEN		64
 
-/* Length of temporary buffers for holding channel names */
-#define TEMP_BUFF_LEN	64
+/* Relative tolerance for treating a double attribute as unchanged. The driver
+ * quantizes things like the gain scale, so the value read back is rarely the
+ * exact value written.
+ */
+#define CFG_DOUBLE_TOL		1e-6
 
-/* Structure for holding channel pairs when dealing with I & Q components */
-typedef struct {
-	struct iio_channel* ch_i;
-	struct iio_channel* ch_q;
-} iio_channel_pair_t;
+/* Longest line accepted in a profile file */
+#define PROFILE_LINE_LEN	256
 
-/* Structure for holding channels for the DDS tone generation */
-typedef struct {
-	iio_channel_pair_t tone1;
-	iio_channel_pair_t tone2;
-} dds_channels_t;
+/* Limits for a hop plan. Each hop can set the 4 NCO attributes of every Rx and
+ * Tx channel
+ */
+#define MAX_HOPS		1024
+#define HOP_NUM_ATTRS		4
+#define MAX_HOP_WRITES		(NUM_CH * 2 * HOP_NUM_ATTRS)
+
+/* The NCO frequency tuning and phase offset words are 48 bits */
+#define NCO_WORD_BITS		48
+#define NCO_WORD_MASK		((1ULL << NCO_WORD_BITS) - 1)
 
 /* Structure for holding default Rx configuration values */
 typedef struct {
@@ -86,9 +106,178 @@ typedef struct {
 	double scale_dbfs;	/* Tone gain/scale in dB. -Inf-0 are valid */
 } dds_default_config_t;
 
-static iio_channel_pair_t ad9081_inputs[NUM_CH];
-static iio_channel_pair_t ad9081_outputs[NUM_CH];
-static dds_channels_t     ad9081_dds[NUM_CH];
+/* DDS tone state last queued for a Tx channel. Loading a tone compares against
+ * this first, so only the writes for what changed are queued at all, and the
+ * conversions are only done for the values which changed.
+ */
+typedef struct {
+	bool valid;
+	dds_default_config_t config;
+} dds_shadow_t;
+
+/* Type of value queued for an attribute, and how to compare it to the cache */
+typedef enum {
+	CFG_STR = 0,
+	CFG_LONGLONG,
+	CFG_DOUBLE,
+	CFG_BOOL,
+} cfg_type_t;
+
+/* Cached and pending state of a single channel attribute */
+typedef struct {
+	char name[CFG_NAME_LEN];
+	char cached[CFG_VAL_LEN];	/* Last value read back or written */
+	bool cache_valid;
+	char pending[CFG_VAL_LEN];	/* Value to send on the next flush */
+	bool dirty;
+} cfg_attr_t;
+
+/* A channel tracked by the configuration engine */
+typedef struct {
+	struct iio_channel* ch;
+	cfg_attr_t attrs[MAX_CFG_ATTRS];
+	int num_attrs;
+	int num_dirty;
+} cfg_channel_t;
+
+/* Counters for a configuration phase */
+typedef struct {
+	int queued;		/* Writes requested */
+	int skipped;		/* Writes dropped since the cache already matched */
+	int sent;		/* Attribute values actually sent */
+	int transactions;	/* Read/write requests made to the context */
+	double start;
+} cfg_phase_t;
+
+/* Structure for holding the global (all channel) Rx configuration values */
+typedef struct {
+	char test_mode[CFG_VAL_LEN];	/* Rx test mode, i.e. off, ramp */
+	char nyquist_zone[CFG_VAL_LEN];	/* odd or even */
+	long long loopback_mode;
+} global_config_t;
+
+/* Describes one key of a profile section, and where it's stored */
+typedef struct {
+	const char* key;
+	cfg_type_t type;
+	size_t offset;
+} profile_field_t;
+
+static const profile_field_t global_fields[] = {
+	{ "test_mode",		CFG_STR,	offsetof(global_config_t, test_mode) },
+	{ "nyquist_zone",	CFG_STR,	offsetof(global_config_t, nyquist_zone) },
+	{ "loopback_mode",	CFG_LONGLONG,	offsetof(global_config_t, loopback_mode) },
+	{ NULL }};
+
+static const profile_field_t rx_fields[] = {
+	{ "nco_freq_hz",	  CFG_LONGLONG,	offsetof(rx_default_config_t, nco_freq_hz) },
+	{ "nco_phase_mdeg",	  CFG_LONGLONG,	offsetof(rx_default_config_t, nco_phase_mdeg) },
+	{ "main_nco_freq_hz",	  CFG_LONGLONG,	offsetof(rx_default_config_t, main_nco_freq_hz) },
+	{ "main_nco_phase_mdeg", CFG_LONGLONG,	offsetof(rx_default_config_t, main_nco_phase_mdeg) },
+	{ NULL }};
+
+static const profile_field_t tx_fields[] = {
+	{ "enabled",		  CFG_BOOL,	offsetof(tx_default_config_t, enabled) },
+	{ "gain_scale",		  CFG_DOUBLE,	offsetof(tx_default_config_t, gain_scale) },
+	{ "nco_freq_hz",	  CFG_LONGLONG,	offsetof(tx_default_config_t, nco_freq_hz) },
+	{ "nco_phase_mdeg",	  CFG_LONGLONG,	offsetof(tx_default_config_t, nco_phase_mdeg) },
+	{ "main_nco_freq_hz",	  CFG_LONGLONG,	offsetof(tx_default_config_t, main_nco_freq_hz) },
+	{ "main_nco_phase_mdeg", CFG_LONGLONG,	offsetof(tx_default_config_t, main_nco_phase_mdeg) },
+	{ NULL }};
+
+static const profile_field_t dds_fields[] = {
+	{ "enabled",		CFG_BOOL,	offsetof(dds_default_config_t, enabled) },
+	{ "freq_hz",		CFG_LONGLONG,	offsetof(dds_default_config_t, freq_hz) },
+	{ "phase_deg",		CFG_DOUBLE,	offsetof(dds_default_config_t, phase_deg) },
+	{ "scale_dbfs",		CFG_DOUBLE,	offsetof(dds_default_config_t, scale_dbfs) },
+	{ NULL }};
+
+/* NCO settings of a channel for one hop of a hop plan, in either direction */
+typedef struct {
+	long long main_nco_freq_hz;	/* Coarse (CDDC/CDUC) NCO Freq in Hz */
+	long long main_nco_phase_mdeg;	/* Coarse (CDDC/CDUC) NCO Phase in mDeg */
+	long long nco_freq_hz;		/* Fine (FDDC/FDUC) NCO Freq in Hz */
+	long long nco_phase_mdeg;	/* Fine (FDDC/FDUC) NCO Phase in mDeg */
+} hop_nco_t;
+
+/* Clocks the NCOs run at, used to compute the tuning words of a hop plan.
+ * The main NCOs run at the converter clock, and the channel NCOs at the
+ * converter clock divided by the coarse decimation/interpolation. A clock of
+ * 0 means it isn't known, and no words are computed for those NCOs.
+ */
+typedef struct {
+	long long adc_clk_hz;
+	long long dac_clk_hz;
+	long long cddc_dec;		/* Coarse DDC decimation */
+	long long cduc_interp;		/* Coarse DUC interpolation */
+} hop_clocks_t;
+
+/* One NCO attribute set by a hop, and the profile key it is given by */
+typedef struct {
+	profile_field_t field;
+	const char* attr;
+	bool is_phase;
+	bool is_main;
+} hop_attr_t;
+
+static const hop_attr_t hop_attrs[HOP_NUM_ATTRS] = {
+	{ { "main_nco_freq_hz",	   CFG_LONGLONG, offsetof(hop_nco_t, main_nco_freq_hz) },
+	  "main_nco_frequency",	   false, true },
+	{ { "main_nco_phase_mdeg", CFG_LONGLONG, offsetof(hop_nco_t, main_nco_phase_mdeg) },
+	  "main_nco_phase",	   true,  true },
+	{ { "nco_freq_hz",	   CFG_LONGLONG, offsetof(hop_nco_t, nco_freq_hz) },
+	  "channel_nco_frequency", false, false },
+	{ { "nco_phase_mdeg",	   CFG_LONGLONG, offsetof(hop_nco_t, nco_phase_mdeg) },
+	  "channel_nco_phase",	   true,  false }};
+
+static const profile_field_t hop_clock_fields[] = {
+	{ "adc_clk_hz",		CFG_LONGLONG,	offsetof(hop_clocks_t, adc_clk_hz) },
+	{ "dac_clk_hz",		CFG_LONGLONG,	offsetof(hop_clocks_t, dac_clk_hz) },
+	{ "cddc_dec",		CFG_LONGLONG,	offsetof(hop_clocks_t, cddc_dec) },
+	{ "cduc_interp",	CFG_LONGLONG,	offsetof(hop_clocks_t, cduc_interp) },
+	{ NULL }};
+
+/* NCO settings of every channel for one hop, as parsed from the plan */
+typedef struct {
+	hop_nco_t rx[NUM_CH];
+	hop_nco_t tx[NUM_CH];
+} hop_state_t;
+
+/* A single attribute write of a hop. The channel and attribute are looked up
+ * in the configuration engine and the value formatted when the plan is
+ * loaded, so triggering the hop only has to queue and flush them.
+ */
+typedef struct {
+	cfg_channel_t* cfg_ch;
+	cfg_attr_t* cfg_attr;
+	char val[CFG_VAL_LEN];
+} hop_write_t;
+
+/* The writes of one hop, only those attributes changed from the hop before */
+typedef struct {
+	hop_write_t writes[MAX_HOP_WRITES];
+	int num_writes;
+} hop_t;
+
+/* Latency and scheduling statistics of a run through a hop plan, in seconds */
+typedef struct {
+	int count;
+	int failed;
+	double min;
+	double max;
+	double sum;
+	double sum_sq;
+	double late_max;	/* Furthest a hop started behind its schedule */
+} hop_stats_t;
+
+static cfg_channel_t cfg_channels[MAX_CFG_CHANNELS];
+static int num_cfg_channels = 0;
+static cfg_phase_t cfg_phase;
+
+/* When false, every write goes straight to the device one attribute at a
+ * time, without reading back or checking the cache (the original behavior)
+ */
+static bool cfg_batched = true;
 
 static struct iio_context *ctx = NULL;
 
@@ -96,8 +285,11 @@ static struct iio_context *ctx = NULL;
  * for configuring all the channels (rx & tx)
  * The Tx device manages the DDS/DMA for transmit
  */
-static struct iio_device* ad9081_cfg_rx = NULL;
-static struct iio_device* ad9081_tx = NULL;
+static ad9081_ctx_t ad;
+
+/* Number of channels being configured in each direction */
+static unsigned int num_rx_ch;
+static unsigned int num_tx_ch;
 
 /* Default configuration parameters for the Rx Channels */
 static const rx_default_config_t rx_default_configs[] = {
@@ -172,6 +364,28 @@ static const dds_default_config_t dds_default_configs[] = {
 	{ .enabled = true, .freq_hz = 12990513LL, .phase_deg = 90.0, .scale_dbfs = -13.0},
 };
 
+/* Working configuration. Starts from the defaults above, and is updated by
+ * each profile loaded
+ */
+static global_config_t global_config = {
+	.test_mode = "off", .nyquist_zone = "odd", .loopback_mode = 0 };
+static rx_default_config_t rx_configs[NUM_CH];
+static tx_default_config_t tx_configs[NUM_CH];
+static dds_default_config_t dds_configs[NUM_CH];
+static dds_shadow_t dds_shadows[NUM_CH];
+
+/* Cached loopback_mode device attribute, which isn't a channel attribute */
+static long long loopback_cached;
+static bool loopback_cache_valid = false;
+
+/* Hop plan loaded with -H. hop_start takes the device from the working
+ * configuration to the first hop, and each hop then only has the writes which
+ * differ from the hop before it, wrapping around from the last to the first
+ */
+static hop_t* hops = NULL;
+static int num_hops = 0;
+static hop_t hop_start;
+
 /**
  * Helper to convert dB to linear value for DDS tone scale
  * Note: This does not check the range of the db input. The tone generator
@@ -183,75 +397,427 @@ static inline double dbfs_to_linear(double db)
 }
 
 /**
- *  Helper to normalize an angle (in degrees) to 0-360
+ * Helper to convert an angle in degrees to mDeg, normalized to 0-360000
+ */
+static inline long long degrees_to_mdeg(double degs)
+{
+	long long mdeg = llround(degs * 1000.0) % 360000;
+	return mdeg < 0 ? mdeg + 360000 : mdeg;
+}
+
+/**
+ * Helper to get the monotonic time in seconds
+ */
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Starts timing a new configuration phase
+ */
+static void cfg_phase_begin(void)
+{
+	memset(&cfg_phase, 0, sizeof(cfg_phase));
+	cfg_phase.start = now_sec();
+}
+
+/**
+ * Reports the time and counters for the current configuration phase
  */
-static inline double normalize_degrees(double degs)
+static void cfg_phase_end(const char* name)
 {
-	while( degs >= 360.0 ) { degs -= 360.0; }
-	while( degs < 0.0 ) { degs += 360.0; }
-	return degs;
+	info("%-12s %8.3f ms | %3d queued, %3d skipped, %3d sent, %3d transactions\n",
+	     name, (now_sec() - cfg_phase.start) * 1000.0, cfg_phase.queued,
+	     cfg_phase.skipped, cfg_phase.sent, cfg_phase.transactions);
 }
 
 /**
- * Helper function to load all the channels. Since the both Tx and Rx
- * configuration channels have the same name, do things in parallel.
+ * Finds the tracked state for a channel, adding it if it isn't tracked yet
  */
-static int load_channels(void)
+static cfg_channel_t* cfg_find_channel(struct iio_channel* ch)
 {
 	int i;
-	int result = 0; //Assume successful
-	char ch_buff[TEMP_BUFF_LEN];
 
-	for(i = 0; i < NUM_CH; i++) {
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_i", i);
-		if((ad9081_inputs[i].ch_i = iio_device_find_channel(ad9081_cfg_rx, ch_buff, false)) == NULL) {
-			result = -1;
-			error("Error finding Input Channel %s\n",ch_buff);
+	for(i = 0; i < num_cfg_channels; i++) {
+		if(cfg_channels[i].ch == ch) {
+			return &cfg_channels[i];
 		}
-		if((ad9081_outputs[i].ch_i = iio_device_find_channel(ad9081_cfg_rx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output Channel %s\n",ch_buff);
+	}
+	if(num_cfg_channels == MAX_CFG_CHANNELS) {
+		return NULL;
+	}
+	memset(&cfg_channels[num_cfg_channels], 0, sizeof(cfg_channel_t));
+	cfg_channels[num_cfg_channels].ch = ch;
+	return &cfg_channels[num_cfg_channels++];
+}
+
+/**
+ * Finds the tracked state for an attribute of a channel, adding it if needed
+ */
+static cfg_attr_t* cfg_find_attr(cfg_channel_t* cfg_ch, const char* attr)
+{
+	int i;
+
+	for(i = 0; i < cfg_ch->num_attrs; i++) {
+		if(strcmp(cfg_ch->attrs[i].name, attr) == 0) {
+			return &cfg_ch->attrs[i];
 		}
+	}
+	if(cfg_ch->num_attrs == MAX_CFG_ATTRS) {
+		return NULL;
+	}
+	snprintf(cfg_ch->attrs[cfg_ch->num_attrs].name, CFG_NAME_LEN, "%s", attr);
+	return &cfg_ch->attrs[cfg_ch->num_attrs++];
+}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_q", i);
-		if((ad9081_inputs[i].ch_q = iio_device_find_channel(ad9081_cfg_rx, ch_buff, false)) == NULL) {
-			result = -1;
-			error("Error finding Input Channel %s\n",ch_buff);
+/**
+ * iio_channel_attr_read_all() callback, storing every value read in the cache
+ */
+static int cfg_read_cb(struct iio_channel* ch, const char* attr, const char* val,
+		       size_t len, void* d)
+{
+	cfg_attr_t* cfg_attr = cfg_find_attr((cfg_channel_t*)d, attr);
+
+	if(cfg_attr) {
+		snprintf(cfg_attr->cached, CFG_VAL_LEN, "%s", val);
+		cfg_attr->cache_valid = true;
+	}
+	return 0;
+}
+
+/**
+ * Reads back every attribute of a channel into the cache with a single
+ * request to the context.
+ */
+static int cfg_read_back(struct iio_channel* ch)
+{
+	cfg_channel_t* cfg_ch = cfg_find_channel(ch);
+
+	if(!cfg_ch) {
+		return -1;
+	}
+	cfg_phase.transactions++;
+	return AD9081_TRACED(AD9081_TP_ATTR_READ_ALL, cfg_ch->num_attrs,
+			     iio_channel_attr_read_all(ch, cfg_read_cb, cfg_ch));
+}
+
+/**
+ * Checks whether a cached attribute value already matches the value requested
+ */
+static bool cfg_matches(const cfg_attr_t* cfg_attr, cfg_type_t type, const char* val)
+{
+	double cached_d, val_d;
+
+	if(!cfg_attr->cache_valid) {
+		return false;
+	}
+
+	switch(type) {
+	case CFG_LONGLONG:
+	case CFG_BOOL:
+		return strtoll(cfg_attr->cached, NULL, 0) == strtoll(val, NULL, 0);
+	case CFG_DOUBLE:
+		cached_d = strtod(cfg_attr->cached, NULL);
+		val_d = strtod(val, NULL);
+		return fabs(cached_d - val_d) <= CFG_DOUBLE_TOL * fmax(1.0, fabs(val_d));
+	default:
+		return strcmp(cfg_attr->cached, val) == 0;
+	}
+}
+
+/**
+ * Queues a write of an attribute which is already tracked. A write which
+ * matches the value cached for the attribute is dropped.
+ */
+static void cfg_queue(cfg_channel_t* cfg_ch, cfg_attr_t* cfg_attr, cfg_type_t type,
+		      const char* val)
+{
+	if(cfg_matches(cfg_attr, type, val)) {
+		//A later write in the same batch may still be undoing an earlier one
+		if(cfg_attr->dirty) {
+			cfg_attr->dirty = false;
+			cfg_ch->num_dirty--;
 		}
-		if((ad9081_outputs[i].ch_q = iio_device_find_channel(ad9081_cfg_rx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output Channel %s\n",ch_buff);
+		cfg_phase.skipped++;
+		return;
+	}
+
+	snprintf(cfg_attr->pending, CFG_VAL_LEN, "%s", val);
+	if(!cfg_attr->dirty) {
+		cfg_attr->dirty = true;
+		cfg_ch->num_dirty++;
+	}
+}
+
+/**
+ * Queues a write of an attribute. Writes which match the value already cached
+ * for the attribute are dropped. Queued writes are sent by cfg_flush().
+ */
+static int cfg_write(struct iio_channel* ch, const char* attr, cfg_type_t type,
+		     const char* val)
+{
+	cfg_channel_t* cfg_ch;
+	cfg_attr_t* cfg_attr;
+
+	cfg_phase.queued++;
+	if(!cfg_batched) {
+		cfg_phase.sent++;
+		cfg_phase.transactions++;
+		return AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR(attr),
+				     iio_channel_attr_write(ch, attr, val)) < 0 ? -1 : 0;
+	}
+
+	if(!(cfg_ch = cfg_find_channel(ch)) || !(cfg_attr = cfg_find_attr(cfg_ch, attr))) {
+		error("Too many channels/attributes to track for %s\n", attr);
+		return -1;
+	}
+
+	cfg_queue(cfg_ch, cfg_attr, type, val);
+	return 0;
+}
+
+static int cfg_write_longlong(struct iio_channel* ch, const char* attr, long long val)
+{
+	char buff[CFG_VAL_LEN];
+	snprintf(buff, CFG_VAL_LEN, "%lld", val);
+	return cfg_write(ch, attr, CFG_LONGLONG, buff);
+}
+
+static int cfg_write_double(struct iio_channel* ch, const char* attr, double val)
+{
+	char buff[CFG_VAL_LEN];
+	snprintf(buff, CFG_VAL_LEN, "%f", val);
+	return cfg_write(ch, attr, CFG_DOUBLE, buff);
+}
+
+static int cfg_write_bool(struct iio_channel* ch, const char* attr, bool val)
+{
+	return cfg_write(ch, attr, CFG_BOOL, val ? "1" : "0");
+}
+
+/**
+ * iio_channel_attr_write_all() callback. Only dirty attributes are given a
+ * value, everything else has a length of 0 and is left untouched.
+ */
+static ssize_t cfg_write_cb(struct iio_channel* ch, const char* attr, void* buf,
+			    size_t len, void* d)
+{
+	cfg_channel_t* cfg_ch = (cfg_channel_t*)d;
+	int i;
+
+	for(i = 0; i < cfg_ch->num_attrs; i++) {
+		if(cfg_ch->attrs[i].dirty && strcmp(cfg_ch->attrs[i].name, attr) == 0) {
+			return snprintf(buf, len, "%s", cfg_ch->attrs[i].pending) + 1;
 		}
+	}
+	return 0;
+}
 
-		/* Tone indexes start at 1, not 0.  The DDS engines support independent
-		 * I & Q signal generation on each output channel, for 2 tones, for a
-		 * total of 4 IIO channels each.
-		 */
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_I_F1", i+1);
-		if((ad9081_dds[i].tone1.ch_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 1 I Channel %s\n",ch_buff);
+/**
+ * Sends every queued write. All the changed attributes of a channel go out in
+ * a single write_all request, so a channel costs one round trip over a network
+ * context, no matter how many of its attributes changed. If the request fails
+ * the channel falls back to one write per attribute, so errors can be
+ * reported per attribute.
+ */
+static int cfg_flush(void)
+{
+	int i, a;
+	int result = 0;
+	cfg_channel_t* cfg_ch;
+	cfg_attr_t* cfg_attr;
+
+	for(i = 0; i < num_cfg_channels; i++) {
+		cfg_ch = &cfg_channels[i];
+		if(cfg_ch->num_dirty == 0) {
+			continue;
 		}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_Q_F1", i+1);
-		if((ad9081_dds[i].tone1.ch_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 1 Q Channel %s\n",ch_buff);
+		cfg_phase.transactions++;
+		if(AD9081_TRACED(AD9081_TP_ATTR_WRITE_ALL, cfg_ch->num_dirty,
+				 iio_channel_attr_write_all(cfg_ch->ch, cfg_write_cb, cfg_ch)) < 0) {
+			for(a = 0; a < cfg_ch->num_attrs; a++) {
+				cfg_attr = &cfg_ch->attrs[a];
+				if(!cfg_attr->dirty) {
+					continue;
+				}
+				cfg_phase.transactions++;
+				if(AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR(cfg_attr->name),
+						 iio_channel_attr_write(cfg_ch->ch, cfg_attr->name,
+									cfg_attr->pending)) < 0) {
+					error("Error writing %s = %s on %s\n", cfg_attr->name,
+					      cfg_attr->pending, iio_channel_get_id(cfg_ch->ch));
+					cfg_attr->cache_valid = false;
+					cfg_attr->dirty = false;
+					result = -1;
+				}
+			}
+		}
+
+		for(a = 0; a < cfg_ch->num_attrs; a++) {
+			cfg_attr = &cfg_ch->attrs[a];
+			if(cfg_attr->dirty) {
+				memcpy(cfg_attr->cached, cfg_attr->pending, CFG_VAL_LEN);
+				cfg_attr->cache_valid = true;
+				cfg_attr->dirty = false;
+				cfg_phase.sent++;
+			}
+		}
+		cfg_ch->num_dirty = 0;
+	}
+	return result;
+}
+
+/**
+ * Helper to strip leading and trailing white space, in place
+ */
+static char* strip(char* str)
+{
+	char* end;
+
+	while(isspace((unsigned char)*str)) {
+		str++;
+	}
+	end = str + strlen(str);
+	while(end > str && isspace((unsigned char)end[-1])) {
+		*--end = '\0';
+	}
+	return str;
+}
+
+/**
+ * Parses a value from a profile into the field it describes
+ */
+static int profile_parse_value(const profile_field_t* field, void* base, const char* val)
+{
+	char* endp;
+	void* dst = (uint8_t*)base + field->offset;
+
+	switch(field->type) {
+	case CFG_STR:
+		snprintf(dst, CFG_VAL_LEN, "%s", val);
+		return 0;
+	case CFG_LONGLONG:
+		*(long long*)dst = strtoll(val, &endp, 0);
+		break;
+	case CFG_DOUBLE:
+		*(double*)dst = strtod(val, &endp);
+		break;
+	case CFG_BOOL:
+		if(!strcmp(val, "true") || !strcmp(val, "1") || !strcmp(val, "yes")) {
+			*(bool*)dst = true;
+		} else if(!strcmp(val, "false") || !strcmp(val, "0") || !strcmp(val, "no")) {
+			*(bool*)dst = false;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+	return (endp == val || *endp != '\0') ? -1 : 0;
+}
+
+/**
+ * Loads a profile into the working configuration.
+ *
+ * A profile is an INI style text file. Sections are [global], and [rxN], [txN]
+ * and [ddsN] for channel N, with keys named after the fields of
+ * global_config_t, rx_default_config_t, tx_default_config_t and
+ * dds_default_config_t. Fields that aren't given keep their current value, and
+ * '#' or ';' start a comment. The whole file is parsed before anything is
+ * changed, so a profile with an error doesn't get partially applied.
+ */
+static int load_profile(const char* filename)
+{
+	FILE* file;
+	char line_buff[PROFILE_LINE_LEN];
+	char* line;
+	char* val;
+	int line_num = 0;
+	int ch;
+	int result = 0;
+	const profile_field_t* fields = NULL;
+	const profile_field_t* field;
+	void* base = NULL;
+	global_config_t new_global = global_config;
+	rx_default_config_t new_rx[NUM_CH];
+	tx_default_config_t new_tx[NUM_CH];
+	dds_default_config_t new_dds[NUM_CH];
+
+	if((file = fopen(filename, "r")) == NULL) {
+		error("Couldn't open profile %s\n", filename);
+		return -1;
+	}
+	memcpy(new_rx, rx_configs, sizeof(new_rx));
+	memcpy(new_tx, tx_configs, sizeof(new_tx));
+	memcpy(new_dds, dds_configs, sizeof(new_dds));
+
+	while(fgets(line_buff, sizeof(line_buff), file)) {
+		line_num++;
+		line_buff[strcspn(line_buff, "#;\r\n")] = '\0';
+		line = strip(line_buff);
+		if(*line == '\0') {
+			continue;
+		}
+
+		if(*line == '[') {
+			fields = NULL;
+			if(!strcmp(line, "[global]")) {
+				fields = global_fields;
+				base = &new_global;
+			} else if(sscanf(line, "[rx%d]", &ch) == 1 && ch >= 0 && ch < NUM_CH) {
+				fields = rx_fields;
+				base = &new_rx[ch];
+			} else if(sscanf(line, "[tx%d]", &ch) == 1 && ch >= 0 && ch < NUM_CH) {
+				fields = tx_fields;
+				base = &new_tx[ch];
+			} else if(sscanf(line, "[dds%d]", &ch) == 1 && ch >= 0 && ch < NUM_CH) {
+				fields = dds_fields;
+				base = &new_dds[ch];
+			} else {
+				error("%s:%d: Unknown section %s\n", filename, line_num, line);
+				result = -1;
+			}
+			continue;
 		}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_I_F2", i+1);
-		if((ad9081_dds[i].tone2.ch_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
+		if((val = strchr(line, '=')) == NULL) {
+			error("%s:%d: Expected key = value\n", filename, line_num);
 			result = -1;
-			error("Error finding Tone 2 I Channel %s\n",ch_buff);
+			continue;
 		}
+		*val++ = '\0';
+		line = strip(line);
+		val = strip(val);
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_Q_F2", i+1);
-		if((ad9081_dds[i].tone2.ch_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
+		if(!fields) {
+			error("%s:%d: %s is outside of a known section\n", filename, line_num, line);
+			result = -1;
+			continue;
+		}
+		for(field = fields; field->key; field++) {
+			if(!strcmp(field->key, line)) {
+				break;
+			}
+		}
+		if(!field->key) {
+			error("%s:%d: Unknown key %s\n", filename, line_num, line);
+			result = -1;
+		} else if(profile_parse_value(field, base, val) < 0) {
+			error("%s:%d: Invalid value %s for %s\n", filename, line_num, val, line);
 			result = -1;
-			error("Error finding Tone 2 Q Channel %s\n",ch_buff);
 		}
 	}
+	fclose(file);
 
+	if(result == 0) {
+		global_config = new_global;
+		memcpy(rx_configs, new_rx, sizeof(new_rx));
+		memcpy(tx_configs, new_tx, sizeof(new_tx));
+		memcpy(dds_configs, new_dds, sizeof(new_dds));
+	}
 	return result;
 }
 
@@ -259,173 +825,717 @@ static int load_channels(void)
  * Loads the provided DDS channel set based on the tone_configuration. The DDS
  * engine support 2x independent tones for both I and Q. This example just
  * assumes a single tone, and I->Q phase automatic to 90
+ *
+ * The shadow holds the tone state last queued for the channel. Only the
+ * writes for values that differ from it are queued, and each value is only
+ * converted once for both I and Q. With no valid shadow (the first load, or
+ * in unbatched mode), everything is written.
  */
-static void load_dds_tone(dds_channels_t* dds_ch, const dds_default_config_t* tone_config)
+static void load_dds_tone(ad9081_dds_t* dds_ch, const dds_default_config_t* tone_config,
+			  dds_shadow_t* shadow)
 {
-	/* Only 1 tone being used. Always set tone 2 scale to 0 to "disable" it */
-	if(iio_channel_attr_write_double(dds_ch->tone2.ch_i, "scale", 0.0) < 0) {
-		error("Error setting Tone 2 I scale to 0\n");
-	}
-	if(iio_channel_attr_write_double(dds_ch->tone2.ch_q, "scale", 0.0) < 0) {
-		error("Error setting Tone 2 Q scale to 0\n");
+	const dds_default_config_t* old = (cfg_batched && shadow->valid) ? &shadow->config : NULL;
+	bool was_enabled = old && old->enabled;
+	double scale;
+	long long phase_mdeg;
+
+	/* Only 1 tone being used. Set tone 2 scale to 0 to "disable" it. Nothing
+	 * else touches tone 2, so it only needs doing once
+	 */
+	if(!old) {
+		cfg_write_double(dds_ch->tone2.ch_i, "scale", 0.0);
+		cfg_write_double(dds_ch->tone2.ch_q, "scale", 0.0);
 	}
 
-	/* If the tone is enabled, configure everything */
+	/* If the tone is enabled, configure everything which changed. Coming from
+	 * disabled, tone 1 scale was left at 0, so everything is written
+	 */
 	if(tone_config->enabled) {
-		if(iio_channel_attr_write_longlong(dds_ch->tone1.ch_i, "frequency",
-				tone_config->freq_hz) < 0) {
-			error("Error setting Tone 1 I frequency\n");
-		}
-		if(iio_channel_attr_write_longlong(dds_ch->tone1.ch_q, "frequency",
-				tone_config->freq_hz) < 0) {
-			error("Error setting Tone 1 Q frequency\n");
-		}
-		if(iio_channel_attr_write_double(dds_ch->tone1.ch_i, "scale",
-				dbfs_to_linear(tone_config->scale_dbfs)) < 0) {
-			error("Error setting Tone 1 I scale\n");
-		}
-		if(iio_channel_attr_write_double(dds_ch->tone1.ch_q, "scale",
-				dbfs_to_linear(tone_config->scale_dbfs)) < 0) {
-			error("Error setting Tone 1 Q scale\n");
+		if(!was_enabled || old->freq_hz != tone_config->freq_hz) {
+			cfg_write_longlong(dds_ch->tone1.ch_i, "frequency", tone_config->freq_hz);
+			cfg_write_longlong(dds_ch->tone1.ch_q, "frequency", tone_config->freq_hz);
 		}
 
-		/* I component is -90 degrees from the requested phase, scaled up to mDeg*/
-		if(iio_channel_attr_write_longlong(dds_ch->tone1.ch_i, "phase",
-				(long long)(normalize_degrees(tone_config->phase_deg - 90.0) * 1000.0)) < 0) {
-			error("Error setting Tone 1 I phase\n");
+		if(!was_enabled || old->scale_dbfs != tone_config->scale_dbfs) {
+			scale = dbfs_to_linear(tone_config->scale_dbfs);
+			cfg_write_double(dds_ch->tone1.ch_i, "scale", scale);
+			cfg_write_double(dds_ch->tone1.ch_q, "scale", scale);
 		}
 
-		/* Q component is the requested phase, scaled up to mDeg*/
-		if(iio_channel_attr_write_longlong(dds_ch->tone1.ch_i, "phase",
-				(long long)(normalize_degrees(tone_config->phase_deg) * 1000.0)) < 0) {
-			error("Error setting Tone 1 Q phase\n");
+		if(!was_enabled || old->phase_deg != tone_config->phase_deg) {
+			/* Q component is the requested phase, and I is -90 degrees from it */
+			phase_mdeg = degrees_to_mdeg(tone_config->phase_deg);
+			cfg_write_longlong(dds_ch->tone1.ch_i, "phase",
+					   phase_mdeg >= 90000 ? phase_mdeg - 90000 : phase_mdeg + 270000);
+			cfg_write_longlong(dds_ch->tone1.ch_q, "phase", phase_mdeg);
 		}
 
 		/* Set raw to true to enable the engine */
-		if(iio_channel_attr_write_bool(dds_ch->tone1.ch_i, "raw", true) < 0) {
-			error("Error setting Tone 1 I raw\n");
-		}
-		if(iio_channel_attr_write_bool(dds_ch->tone1.ch_q, "raw", true) < 0) {
-			error("Error setting Tone 1 Q raw\n");
+		if(!was_enabled) {
+			cfg_write_bool(dds_ch->tone1.ch_i, "raw", true);
+			cfg_write_bool(dds_ch->tone1.ch_q, "raw", true);
 		}
 	}
-	else { /* Otherwise, Tone 1 scale is also 0 */
-		if(iio_channel_attr_write_double(dds_ch->tone1.ch_i, "scale", 0.0) < 0) {
-			error("Error setting Tone 1 I scale to 0\n");
-		}
-		if(iio_channel_attr_write_double(dds_ch->tone1.ch_q, "scale", 0.0) < 0) {
-			error("Error setting Tone 1 Q scale to 0\n");
-		}
+	else if(!old || old->enabled) { /* Otherwise, Tone 1 scale is also 0 */
+		cfg_write_double(dds_ch->tone1.ch_i, "scale", 0.0);
+		cfg_write_double(dds_ch->tone1.ch_q, "scale", 0.0);
 	}
-}
 
+	shadow->config = *tone_config;
+	shadow->valid = true;
+}
 
-int main(int argc, char* argv[])
+/**
+ * Applies the working configuration to the device, one phase at a time. With
+ * the cache read back, only the attributes which differ are written.
+ */
+static int apply_config(void)
 {
-	int i;
+	unsigned int i;
+	int ret = 0;
 	struct iio_channel* temp_ch;
 	const rx_default_config_t* temp_rx_cfg;
 	const tx_default_config_t* temp_tx_cfg;
 
-	ctx = iio_create_default_context();
-	if (!ctx) {
-		error("Could not create IIO context\n");
-		return EXIT_FAILURE;
+	/* Perform the channel configuration per the setup */
+	/* Global Rx. These will apply to all channels even though just 1 is poked */
+	cfg_phase_begin();
+	cfg_write(ad.rx[0].in.ch_i, "test_mode", CFG_STR, global_config.test_mode);
+	cfg_write(ad.rx[0].in.ch_i, "nyquist_zone", CFG_STR, global_config.nyquist_zone);
+
+	cfg_phase.queued++;
+	if(cfg_batched && loopback_cache_valid && loopback_cached == global_config.loopback_mode) {
+		cfg_phase.skipped++;
+	} else {
+		cfg_phase.sent++;
+		cfg_phase.transactions++;
+		loopback_cache_valid = false;
+		if(AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR("loopback_mode"),
+				 iio_device_attr_write_longlong(ad.rx_dev, "loopback_mode",
+								global_config.loopback_mode)) < 0) {
+			error("Error writing Loopback mode\n");
+		} else {
+			loopback_cached = global_config.loopback_mode;
+			loopback_cache_valid = true;
+		}
 	}
 
-    /* Devices are found by their IIO name */
-	ad9081_cfg_rx = iio_context_find_device(ctx, "axi-ad9081-rx-hpc");
-	ad9081_tx = iio_context_find_device(ctx, "axi-ad9081-tx-hpc");
-	if(!ad9081_cfg_rx || !ad9081_tx) {
-        error("Could not find AD9081 Devices\n");
-		iio_context_destroy(ctx);
-		return EXIT_FAILURE;
+	/* Configure all the input channels based on the Rx configuration */
+	for( i = 0; i < num_rx_ch; i++) {
+		/* Attributes will get applied to both I & Q via I*/
+		temp_ch = ad.rx[i].in.ch_i;
+		temp_rx_cfg = &rx_configs[i];
+
+		cfg_write_longlong(temp_ch, "main_nco_frequency", temp_rx_cfg->main_nco_freq_hz);
+		cfg_write_longlong(temp_ch, "main_nco_phase", temp_rx_cfg->main_nco_phase_mdeg);
+		cfg_write_longlong(temp_ch, "channel_nco_frequency", temp_rx_cfg->nco_freq_hz);
+		cfg_write_longlong(temp_ch, "channel_nco_phase", temp_rx_cfg->nco_phase_mdeg);
 	}
+	if(cfg_flush() < 0) {
+		error("Error writing Rx configuration\n");
+		ret = -1;
+	}
+	cfg_phase_end("Rx config");
 
-	if(load_channels() < 0) {
-		error("Could not find all the channels\n");
-		iio_context_destroy(ctx);
-		return EXIT_FAILURE;
+	/* Configure all the output channels based on the Tx configuration */
+	cfg_phase_begin();
+	for( i = 0; i < num_tx_ch; i++) {
+		/* Attributes will get applied to both I & Q via I*/
+		temp_ch = ad.tx[i].cfg.ch_i;
+		temp_tx_cfg = &tx_configs[i];
+
+		cfg_write_longlong(temp_ch, "main_nco_frequency", temp_tx_cfg->main_nco_freq_hz);
+		cfg_write_longlong(temp_ch, "main_nco_phase", temp_tx_cfg->main_nco_phase_mdeg);
+		cfg_write_longlong(temp_ch, "channel_nco_frequency", temp_tx_cfg->nco_freq_hz);
+		cfg_write_longlong(temp_ch, "channel_nco_phase", temp_tx_cfg->nco_phase_mdeg);
+		cfg_write_double(temp_ch, "channel_nco_gain_scale", temp_tx_cfg->gain_scale);
+		cfg_write_bool(temp_ch, "en", temp_tx_cfg->enabled);
 	}
+	if(cfg_flush() < 0) {
+		error("Error writing Tx configuration\n");
+		ret = -1;
+	}
+	cfg_phase_end("Tx config");
 
+	/* Configure all the DDS engines */
+	cfg_phase_begin();
+	for( i = 0; i < num_tx_ch; i++) {
+		load_dds_tone(&ad.tx[i].dds, &dds_configs[i], &dds_shadows[i]);
+	}
+	if(cfg_flush() < 0) {
+		/* Not known what made it, so the next load starts from scratch */
+		error("Error writing DDS configuration\n");
+		memset(dds_shadows, 0, sizeof(dds_shadows));
+		ret = -1;
+	}
+	cfg_phase_end("DDS config");
 
-	/* Perform the channel configuration per the setup */
-	/* Global Rx. These will apply to all channels even though just 1 is poked */
-	if(iio_channel_attr_write(ad9081_inputs[0].ch_i, "test_mode", "off") < 0) {
-		error("Error writing RX Test mode\n");
+	return ret;
+}
+
+/**
+ * Loads a profile on top of the working configuration and applies it
+ */
+static int apply_profile(const char* filename)
+{
+	double start_time = now_sec();
+
+	if(load_profile(filename) < 0) {
+		error("Profile %s not applied\n", filename);
+		return -1;
+	}
+	if(apply_config() < 0) {
+		return -1;
 	}
+	info("Applied profile %s in %.3f ms\n", filename, (now_sec() - start_time) * 1000.0);
+	return 0;
+}
+
+/**
+ * Helper to compute a 48 bit NCO frequency tuning word for an NCO clocked at
+ * clk_hz. Negative frequencies give the two's complement word.
+ */
+static uint64_t nco_ftw(long long freq_hz, long long clk_hz)
+{
+	return (uint64_t)llroundl(ldexpl((long double)freq_hz / clk_hz, NCO_WORD_BITS)) & NCO_WORD_MASK;
+}
+
+/**
+ * Helper to compute a 48 bit NCO phase offset word from a phase in mDeg
+ */
+static uint64_t nco_pow(long long phase_mdeg)
+{
+	return (uint64_t)llroundl(ldexpl(phase_mdeg / 360000.0L, NCO_WORD_BITS)) & NCO_WORD_MASK;
+}
+
+/**
+ * Adds the writes of one channel to a hop, for each NCO attribute which
+ * changed from the previous hop (every attribute when prev is NULL). The
+ * value is formatted and the tuning word computed here, and a frequency
+ * outside of the range of the NCO is rejected. A clock of 0 isn't known, and
+ * the frequency is passed on unchecked. With report set, each write is
+ * printed along with its tuning or phase offset word.
+ */
+static int hop_add_channel(hop_t* hop, const char* name, struct iio_channel* ch,
+			   const hop_nco_t* nco, const hop_nco_t* prev,
+			   long long main_clk_hz, long long chan_clk_hz, bool report)
+{
+	int a;
+	long long val;
+	long long clk_hz;
+	const hop_attr_t* hop_attr;
+	hop_write_t* w;
+
+	for(a = 0; a < HOP_NUM_ATTRS; a++) {
+		hop_attr = &hop_attrs[a];
+		val = *(const long long*)((const uint8_t*)nco + hop_attr->field.offset);
+		if(prev && val == *(const long long*)((const uint8_t*)prev + hop_attr->field.offset)) {
+			continue;
+		}
 
-	if(iio_channel_attr_write(ad9081_inputs[0].ch_i, "nyquist_zone", "odd") < 0) {
-		error("Error writing RX Nyquist Zone\n");
+		clk_hz = hop_attr->is_main ? main_clk_hz : chan_clk_hz;
+		if(!hop_attr->is_phase && clk_hz > 0 && (val > clk_hz / 2 || val < -clk_hz / 2)) {
+			error("%s %s of %lld Hz is outside the NCO range of +/-%lld Hz\n",
+			      name, hop_attr->attr, val, clk_hz / 2);
+			return -1;
+		}
+
+		w = &hop->writes[hop->num_writes];
+		if(!(w->cfg_ch = cfg_find_channel(ch)) ||
+		   !(w->cfg_attr = cfg_find_attr(w->cfg_ch, hop_attr->attr))) {
+			error("Too many channels/attributes to track for %s\n", hop_attr->attr);
+			return -1;
+		}
+		snprintf(w->val, CFG_VAL_LEN, "%lld", val);
+		hop->num_writes++;
+
+		if(!report) {
+			continue;
+		} else if(hop_attr->is_phase) {
+			printf("  %-4s %-22s %12lld mDeg  POW 0x%012llX\n", name, hop_attr->attr,
+			       val, (unsigned long long)nco_pow(val));
+		} else if(clk_hz > 0) {
+			printf("  %-4s %-22s %12lld Hz    FTW 0x%012llX\n", name, hop_attr->attr,
+			       val, (unsigned long long)nco_ftw(val, clk_hz));
+		} else {
+			printf("  %-4s %-22s %12lld Hz\n", name, hop_attr->attr, val);
+		}
 	}
+	return 0;
+}
+
+/**
+ * Loads a hop plan, replacing any plan already loaded.
+ *
+ * A hop plan uses the same INI style as a profile. An optional [clocks]
+ * section gives the fields of hop_clocks_t, and each [hop] section starts the
+ * next hop, with keys rxN.<field> and txN.<field> for the fields of
+ * hop_nco_t. The first hop starts from the working configuration, and every
+ * other hop from the one before it, so only the values which change need to
+ * be given. Every write of every hop is formatted and looked up in the
+ * configuration engine here, so none of that is left for the hops themselves.
+ */
+static int load_hop_plan(const char* filename)
+{
+	FILE* file;
+	char line_buff[PROFILE_LINE_LEN];
+	char name[16];
+	char* line;
+	char* val;
+	int line_num = 0;
+	int ch, n, a, h;
+	unsigned int i;
+	int result = 0;
+	const profile_field_t* fields = NULL;
+	const profile_field_t* field;
+	void* base = NULL;
+	hop_clocks_t clocks = { 0 };
+	hop_state_t* states = NULL;
+	hop_state_t* state = NULL;
+	hop_state_t* new_states;
+	const hop_state_t* cur;
+	const hop_state_t* prev;
+	hop_t* hop;
+	int num_states = 0;
+	long long rx_chan_clk_hz, tx_chan_clk_hz;
 
-	if(iio_device_attr_write_longlong(ad9081_cfg_rx, "loopback_mode", 0) < 0) {
-		error("Error writing Loopback mode\n");
+	if((file = fopen(filename, "r")) == NULL) {
+		error("Couldn't open hop plan %s\n", filename);
+		return -1;
 	}
 
-	/* Configure all the input channels based on the default Rx configuration */
-	for( i = 0; i < NUM_CH; i++) {
-		/* Attributes will get applied to both I & Q via I*/
-		temp_ch = ad9081_inputs[i].ch_i;
-		temp_rx_cfg = &rx_default_configs[i];
+	while(fgets(line_buff, sizeof(line_buff), file)) {
+		line_num++;
+		line_buff[strcspn(line_buff, "#;\r\n")] = '\0';
+		line = strip(line_buff);
+		if(*line == '\0') {
+			continue;
+		}
+
+		if(*line == '[') {
+			fields = NULL;
+			state = NULL;
+			if(!strcmp(line, "[clocks]")) {
+				fields = hop_clock_fields;
+			} else if(!strcmp(line, "[hop]")) {
+				if(num_states == MAX_HOPS) {
+					error("%s:%d: More than %d hops\n", filename, line_num, MAX_HOPS);
+					result = -1;
+					break;
+				}
+				new_states = realloc(states, (num_states + 1) * sizeof(hop_state_t));
+				if(!new_states) {
+					error("Couldn't allocate the hop plan\n");
+					result = -1;
+					break;
+				}
+				states = new_states;
+				state = &states[num_states];
+				if(num_states == 0) {
+					for(i = 0; i < NUM_CH; i++) {
+						state->rx[i].main_nco_freq_hz = rx_configs[i].main_nco_freq_hz;
+						state->rx[i].main_nco_phase_mdeg = rx_configs[i].main_nco_phase_mdeg;
+						state->rx[i].nco_freq_hz = rx_configs[i].nco_freq_hz;
+						state->rx[i].nco_phase_mdeg = rx_configs[i].nco_phase_mdeg;
+						state->tx[i].main_nco_freq_hz = tx_configs[i].main_nco_freq_hz;
+						state->tx[i].main_nco_phase_mdeg = tx_configs[i].main_nco_phase_mdeg;
+						state->tx[i].nco_freq_hz = tx_configs[i].nco_freq_hz;
+						state->tx[i].nco_phase_mdeg = tx_configs[i].nco_phase_mdeg;
+					}
+				} else {
+					*state = states[num_states - 1];
+				}
+				num_states++;
+			} else {
+				error("%s:%d: Unknown section %s\n", filename, line_num, line);
+				result = -1;
+			}
+			continue;
+		}
+
+		if((val = strchr(line, '=')) == NULL) {
+			error("%s:%d: Expected key = value\n", filename, line_num);
+			result = -1;
+			continue;
+		}
+		*val++ = '\0';
+		line = strip(line);
+		val = strip(val);
+
+		if(fields) {
+			for(field = fields; field->key; field++) {
+				if(!strcmp(field->key, line)) {
+					break;
+				}
+			}
+			base = &clocks;
+		} else if(state) {
+			/* rxN.<field> or txN.<field> */
+			field = NULL;
+			n = 0;
+			if(sscanf(line, "rx%d.%n", &ch, &n) == 1 && n > 0 && ch >= 0 && ch < NUM_CH) {
+				base = &state->rx[ch];
+			} else if(sscanf(line, "tx%d.%n", &ch, &n) == 1 && n > 0 && ch >= 0 && ch < NUM_CH) {
+				base = &state->tx[ch];
+			} else {
+				n = 0;
+			}
+			for(a = 0; n > 0 && a < HOP_NUM_ATTRS; a++) {
+				if(!strcmp(hop_attrs[a].field.key, line + n)) {
+					field = &hop_attrs[a].field;
+					break;
+				}
+			}
+		} else {
+			error("%s:%d: %s is outside of a known section\n", filename, line_num, line);
+			result = -1;
+			continue;
+		}
 
-		if(iio_channel_attr_write_longlong(temp_ch, "main_nco_frequency",
-				temp_rx_cfg->main_nco_freq_hz) < 0) {
-			error("Error writing Rx Main NCO Frequency on %d\n", i);
+		if(!field || !field->key) {
+			error("%s:%d: Unknown key %s\n", filename, line_num, line);
+			result = -1;
+		} else if(profile_parse_value(field, base, val) < 0) {
+			error("%s:%d: Invalid value %s for %s\n", filename, line_num, val, line);
+			result = -1;
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "main_nco_phase",
-				temp_rx_cfg->main_nco_phase_mdeg) < 0) {
-			error("Error writing Rx Main NCO Phase on %d\n", i);
+	}
+	fclose(file);
+
+	if(result == 0 && num_states < 2) {
+		error("%s: A hop plan needs at least 2 [hop] sections\n", filename);
+		result = -1;
+	}
+
+	free(hops);
+	hops = NULL;
+	num_hops = 0;
+	if(result == 0 && (hops = calloc(num_states, sizeof(hop_t))) == NULL) {
+		error("Couldn't allocate the hop plan\n");
+		result = -1;
+	}
+
+	/* The channel NCOs run after the coarse decimation/interpolation */
+	rx_chan_clk_hz = clocks.cddc_dec > 0 ? clocks.adc_clk_hz / clocks.cddc_dec : 0;
+	tx_chan_clk_hz = clocks.cduc_interp > 0 ? clocks.dac_clk_hz / clocks.cduc_interp : 0;
+
+	/* hop_start (h == -1) has every attribute of the first hop. The first
+	 * hop itself then only has what changes coming from the last hop
+	 */
+	memset(&hop_start, 0, sizeof(hop_start));
+	for(h = -1; result == 0 && h < num_states; h++) {
+		hop = h < 0 ? &hop_start : &hops[h];
+		cur = h < 0 ? &states[0] : &states[h];
+		prev = h < 0 ? NULL : &states[h > 0 ? h - 1 : num_states - 1];
+		if(h >= 0) {
+			info("Hop %d:\n", h);
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "channel_nco_frequency",
-				temp_rx_cfg->nco_freq_hz) < 0) {
-			error("Error writing Rx Channel NCO Frequency on %d\n", i);
+		for(i = 0; result == 0 && i < num_rx_ch; i++) {
+			snprintf(name, sizeof(name), "rx%u", i);
+			result = hop_add_channel(hop, name, ad.rx[i].in.ch_i, &cur->rx[i],
+						 prev ? &prev->rx[i] : NULL,
+						 clocks.adc_clk_hz, rx_chan_clk_hz, h >= 0);
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "channel_nco_phase",
-				temp_rx_cfg->nco_phase_mdeg) < 0) {
-			error("Error writing Rx Channel NCO Phase on %d\n", i);
+		for(i = 0; result == 0 && i < num_tx_ch; i++) {
+			snprintf(name, sizeof(name), "tx%u", i);
+			result = hop_add_channel(hop, name, ad.tx[i].cfg.ch_i, &cur->tx[i],
+						 prev ? &prev->tx[i] : NULL,
+						 clocks.dac_clk_hz, tx_chan_clk_hz, h >= 0);
 		}
 	}
+	free(states);
 
-	/* Configure all the output channels based on the default Tx configuration */
-	for( i = 0; i < NUM_CH; i++) {
-		/* Attributes will get applied to both I & Q via I*/
-		temp_ch = ad9081_outputs[i].ch_i;
-		temp_tx_cfg = &tx_default_configs[i];
+	if(result < 0) {
+		free(hops);
+		hops = NULL;
+		return -1;
+	}
+	num_hops = num_states;
+	info("Loaded %d hops from %s\n", num_hops, filename);
+	return 0;
+}
+
+/**
+ * Helper to sleep until a monotonic time in seconds, as returned by now_sec()
+ */
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/**
+ * Triggers one hop. In batched mode the writes are queued against the cache
+ * and the changed attributes of each channel go out in a single write_all
+ * request, otherwise each attribute is written on its own.
+ */
+static int hop_apply(const hop_t* hop)
+{
+	int i;
+	int result = 0;
+	const hop_write_t* w;
 
-		if(iio_channel_attr_write_longlong(temp_ch, "main_nco_frequency",
-				temp_tx_cfg->main_nco_freq_hz) < 0) {
-			error("Error writing Tx Main NCO Frequency on %d\n", i);
+	for(i = 0; i < hop->num_writes; i++) {
+		w = &hop->writes[i];
+		cfg_phase.queued++;
+		if(cfg_batched) {
+			cfg_queue(w->cfg_ch, w->cfg_attr, CFG_LONGLONG, w->val);
+			continue;
+		}
+
+		cfg_phase.sent++;
+		cfg_phase.transactions++;
+		if(AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR(w->cfg_attr->name),
+				 iio_channel_attr_write(w->cfg_ch->ch, w->cfg_attr->name, w->val)) < 0) {
+			error("Error writing %s = %s on %s\n", w->cfg_attr->name, w->val,
+			      iio_channel_get_id(w->cfg_ch->ch));
+			result = -1;
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "main_nco_phase",
-				temp_tx_cfg->main_nco_phase_mdeg) < 0) {
-			error("Error writing Tx Main NCO Phase on %d\n", i);
+	}
+	if(cfg_batched && cfg_flush() < 0) {
+		result = -1;
+	}
+	return result;
+}
+
+/**
+ * Runs through the loaded hop plan loops times, and reports the latency of
+ * the hops (from the hop being triggered to every write being done) and the
+ * jitter in it. With a dwell time, each hop is scheduled dwell_us after the
+ * one before it, and how far behind the schedule the hops started is
+ * reported too. Otherwise the hops run back to back.
+ */
+static int run_hop_plan(int loops, long long dwell_us)
+{
+	int k, h;
+	double next;
+	double start;
+	double latency;
+	double avg;
+	hop_stats_t stats = { 0 };
+
+	cfg_phase_begin();
+	if(hop_apply(&hop_start) < 0) {
+		error("Error moving to the first hop\n");
+		return -1;
+	}
+	cfg_phase_end("Hop start");
+
+	cfg_phase_begin();
+	next = cfg_phase.start;
+	/* Already on the first hop, so each loop runs from the second hop round
+	 * to the first again
+	 */
+	for(k = 1; k <= loops * num_hops; k++) {
+		h = k % num_hops;
+		if(dwell_us > 0) {
+			sleep_until(next);
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "channel_nco_frequency",
-				temp_tx_cfg->nco_freq_hz) < 0) {
-			error("Error writing Tx Channel NCO Frequency on %d\n", i);
+
+		start = now_sec();
+		if(dwell_us > 0 && start - next > stats.late_max) {
+			stats.late_max = start - next;
 		}
-		if(iio_channel_attr_write_longlong(temp_ch, "channel_nco_phase",
-				temp_tx_cfg->nco_phase_mdeg) < 0) {
-			error("Error writing Tx Channel NCO Phase on %d\n", i);
+		if(hop_apply(&hops[h]) < 0) {
+			stats.failed++;
 		}
-		if(iio_channel_attr_write_double(temp_ch, "channel_nco_gain_scale",
-				temp_tx_cfg->gain_scale) < 0) {
-			error("Error writing Tx Gain Scale on %d\n", i);
+		latency = now_sec() - start;
+
+		if(stats.count == 0 || latency < stats.min) {
+			stats.min = latency;
 		}
-		if(iio_channel_attr_write_bool(temp_ch, "en", temp_tx_cfg->enabled) < 0) {
-			error("Error writing Tx Enable on %d\n", i);
+		if(latency > stats.max) {
+			stats.max = latency;
 		}
+		stats.sum += latency;
+		stats.sum_sq += latency * latency;
+		stats.count++;
+		next += dwell_us / 1e6;
 	}
+	cfg_phase_end("Hop plan");
 
-	/* Configure all the DDS engines */
-	for( i = 0; i < NUM_CH; i++) {
-		load_dds_tone(&ad9081_dds[i], &dds_default_configs[i]);
+	avg = stats.sum / stats.count;
+	info("%d hops, latency min %.3f ms, avg %.3f ms, max %.3f ms, jitter %.3f ms\n",
+	     stats.count, stats.min * 1000.0, avg * 1000.0, stats.max * 1000.0,
+	     sqrt(fmax(0.0, stats.sum_sq / stats.count - avg * avg)) * 1000.0);
+	if(dwell_us > 0) {
+		info("Dwell %lld us, hops started up to %.3f ms behind schedule\n",
+		     dwell_us, stats.late_max * 1000.0);
+	}
+	if(stats.failed) {
+		error("%d of %d hops failed\n", stats.failed, stats.count);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-u] [-H hopplan.ini [-n loops] [-d dwell_us]] [profile.ini | -]...\n"
+	       "  -u          Write every attribute one at a time, without reading back\n"
+	       "              the current state (the original behavior)\n"
+	       "  -H plan     Once configured, run through the NCO hops of a hop plan\n"
+	       "              and report the hop latency and jitter\n"
+	       "  -n loops    Number of times to run through the hop plan (default 1)\n"
+	       "  -d dwell    Time between the start of each hop in us. By default\n"
+	       "              the hops run back to back\n"
+	       "  profile.ini Profiles to apply in order, on top of the compiled in\n"
+	       "              defaults. Only attributes that differ from the device\n"
+	       "              are written. With no profiles, the defaults are applied\n"
+	       "  -           Read profile filenames from stdin, one per line\n",
+	       name);
+}
+
+int main(int argc, char* argv[])
+{
+	int i;
+	int opt;
+	int ret = EXIT_SUCCESS;
+	double start_time;
+	char** profiles;
+	int num_profiles;
+	char profile_buff[PROFILE_LINE_LEN];
+	char* profile;
+	const char* hop_plan = NULL;
+	int hop_loops = 1;
+	long long hop_dwell_us = 0;
+
+	while((opt = getopt(argc, argv, "uH:n:d:h")) != -1) {
+		switch(opt) {
+		case 'u':
+			cfg_batched = false;
+			break;
+		case 'H':
+			hop_plan = optarg;
+			break;
+		case 'n':
+			hop_loops = atoi(optarg);
+			if(hop_loops < 1) {
+				error("Invalid number of hop loops %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			hop_dwell_us = atoll(optarg);
+			if(hop_dwell_us < 0) {
+				error("Invalid dwell time %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	profiles = &argv[optind];
+	num_profiles = argc - optind;
+
+	/* Start the working configuration from the compiled in defaults */
+	memcpy(rx_configs, rx_default_configs, sizeof(rx_configs));
+	memcpy(tx_configs, tx_default_configs, sizeof(tx_configs));
+	memcpy(dds_configs, dds_default_configs, sizeof(dds_configs));
+
+	//Tracing is switched on from the environment, see ../common
+	if(ad9081_trace_open() < 0) {
+		return EXIT_FAILURE;
+	}
+
+	start_time = now_sec();
+	cfg_phase_begin();
+	ctx = iio_create_default_context();
+	if (!ctx) {
+		error("Could not create IIO context\n");
+		return EXIT_FAILURE;
+	}
+
+	if(ad9081_ctx_open(&ad, ctx) < 0) {
+		error("Could not find all the channels\n");
+		iio_context_destroy(ctx);
+		return EXIT_FAILURE;
+	}
+	num_rx_ch = ad.num_rx_ch < NUM_CH ? ad.num_rx_ch : NUM_CH;
+	num_tx_ch = ad.num_tx_ch < NUM_CH ? ad.num_tx_ch : NUM_CH;
+
+	//Every Tx channel gets a DDS tone, so the core has to have one
+	for(i = 0; i < (int)num_tx_ch; i++) {
+		if(!ad.tx[i].dds.tone1.ch_i || !ad.tx[i].dds.tone2.ch_i) {
+			error("No DDS on Tx channel %d\n", i);
+			ad9081_ctx_close(&ad);
+			iio_context_destroy(ctx);
+			return EXIT_FAILURE;
+		}
+	}
+	cfg_phase_end("Discovery");
+	info("Configuring %u Rx and %u Tx channels\n", num_rx_ch, num_tx_ch);
+
+	/* Read back the current state of every channel about to be configured,
+	 * one request per channel, so unchanged values aren't written again
+	 */
+	if(cfg_batched) {
+		cfg_phase_begin();
+		for(i = 0; i < (int)num_rx_ch; i++) {
+			if(cfg_read_back(ad.rx[i].in.ch_i) < 0) {
+				error("Error reading back Rx channel state on %d\n", i);
+			}
+		}
+		for(i = 0; i < (int)num_tx_ch; i++) {
+			if(cfg_read_back(ad.tx[i].cfg.ch_i) < 0 ||
+			   cfg_read_back(ad.tx[i].dds.tone1.ch_i) < 0 ||
+			   cfg_read_back(ad.tx[i].dds.tone1.ch_q) < 0 ||
+			   cfg_read_back(ad.tx[i].dds.tone2.ch_i) < 0 ||
+			   cfg_read_back(ad.tx[i].dds.tone2.ch_q) < 0) {
+				error("Error reading back Tx channel state on %d\n", i);
+			}
+		}
+		cfg_phase.transactions++;
+		if(iio_device_attr_read_longlong(ad.rx_dev, "loopback_mode", &loopback_cached) == 0) {
+			loopback_cache_valid = true;
+		}
+		cfg_phase_end("Read back");
+	}
+
+	ret = EXIT_SUCCESS;
+	if(num_profiles == 0) {
+		/* No profiles given, just apply the compiled in defaults */
+		if(apply_config() < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	for(i = 0; i < num_profiles; i++) {
+		if(strcmp(profiles[i], "-") == 0) {
+			/* Apply each profile named on stdin, keeping the cache warm */
+			while(fgets(profile_buff, sizeof(profile_buff), stdin)) {
+				profile = strip(profile_buff);
+				if(*profile && apply_profile(profile) < 0) {
+					ret = EXIT_FAILURE;
+				}
+			}
+		} else if(apply_profile(profiles[i]) < 0) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	info("Configuration completed in %.3f ms\n", (now_sec() - start_time) * 1000.0);
+
+	/* Hop through the plan from the configuration just applied */
+	if(hop_plan) {
+		if(load_hop_plan(hop_plan) < 0 || run_hop_plan(hop_loops, hop_dwell_us) < 0) {
+			ret = EXIT_FAILURE;
+		}
+		free(hops);
 	}
 
 	/*** Do your useful work here! ****/
 
 	/* Clean up and exit */
+	ad9081_ctx_close(&ad);
 	iio_context_destroy(ctx);
-	return EXIT_SUCCESS;
+	ad9081_trace_close();
+	return ret;
 }
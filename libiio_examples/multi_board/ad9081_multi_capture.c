@@ -0,0 +1,667 @@
+/*
+ * Example application capturing from several AD9081 boards at once, each in
+ * its own IIO context, and merging the blocks of every board into a single
+ * time aligned stream.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#define _GNU_SOURCE	/* pthread_setaffinity_np */
+#include <iio.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "ad9081_ctx.h"
+#include "ad9081_trace.h"
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+#define info(...) \
+	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+/* Most boards, each with its own context */
+#define MAX_BOARDS		8
+
+/* Capture parameters. A block is one iio_buffer refill of a board */
+#define DEFAULT_SAMPLES		(256 * 1024)
+#define DEFAULT_BLOCKS		20
+#define DEFAULT_RING_BLOCKS	8
+#define MAX_RING_BLOCKS		64
+
+/* Frames merged at a time into the staging buffer of the writer */
+#define MERGE_CHUNK_FRAMES	4096
+
+/* Rx core DMA status register. The overflow bit is write 1 to clear. Without
+ * the PCORE bit, cf_axi_adc hands the access to register 0x88 of the AD9081
+ */
+#define DEBUGFS_DRA_PCORE_REG_MAGIC	0x80000000
+#define RX_DMA_STATUS_REG	(DEBUGFS_DRA_PCORE_REG_MAGIC | 0x88)
+#define RX_DMA_STATUS_OVF	(1 << 2)
+
+/* Flags of a board block */
+#define BLOCK_OVF		(1 << 0)	/* Rx DMA overflow since the previous block */
+
+/* A block of one board, in the ring between its refill thread and the writer.
+ * Block seq always lives in slot seq % ring_blocks.
+ */
+typedef struct {
+	uint8_t* data;
+	unsigned long long seq;		/* Sample index of the block / samples per block */
+	uint64_t done_ns;		/* Completion of the refill */
+	uint32_t flags;
+} board_block_t;
+
+/* One board, its context and the ring of blocks its refill thread fills */
+typedef struct {
+	const char* uri;
+	struct iio_context* ctx;
+	ad9081_ctx_t ad;
+	bool ad_open;
+	struct iio_buffer* buff;
+	unsigned int num_ch;		/* Rx I&Q pairs captured */
+	size_t frame_size;		/* Bytes per frame of this board */
+	size_t block_size;
+	long long sample_rate;		/* Sample rate in Hz, 0 if unknown */
+	bool ovf_readable;		/* Rx DMA status could be read */
+	int cpu;			/* CPU the refill thread is pinned to, -1 for none */
+	pthread_t thread;
+	bool thread_started;
+	uint64_t start_ns;		/* Buffer (and so the DMA) started */
+
+	board_block_t blocks[MAX_RING_BLOCKS];
+	atomic_ullong head;		/* Blocks refilled so far, whether kept or dropped */
+	atomic_bool done;
+
+	/* Owned by the refill thread */
+	unsigned long long dropped;	/* Refilled while the ring was full */
+	unsigned long long ovf_blocks;
+	unsigned long long bytes;
+	uint64_t last_ns;
+	int result;
+} board_t;
+
+/* Statistics of the merged stream, owned by the writer */
+typedef struct {
+	unsigned long long merged;	/* Indexes with a block from every board */
+	unsigned long long incomplete;	/* Indexes missing at least one board */
+	unsigned long long ovf_merged;	/* Merged blocks with an overflow on any board */
+	unsigned long long bytes;
+	unsigned long long write_errors;
+	uint64_t skew_min_ns;		/* Spread of the refill completions of an index */
+	uint64_t skew_max_ns;
+	uint64_t skew_sum_ns;
+} merge_stats_t;
+
+/* Everything shared between the refill threads and the writer */
+typedef struct {
+	board_t boards[MAX_BOARDS];
+	unsigned int num_boards;
+	unsigned int ring_blocks;
+	size_t samples;			/* Frames per block, the same on every board */
+	unsigned long long num_blocks;	/* Blocks to capture, 0 until stopped */
+	bool sync_start;		/* Every board started on the same sync */
+	atomic_ullong tail;		/* Next index the writer merges */
+	sem_t ready;			/* Posted for every block refilled */
+	FILE* out;			/* Merged output, NULL to only measure */
+	size_t merged_frame_size;
+	uint8_t* stage;
+	merge_stats_t stats;
+} coordinator_t;
+
+static coordinator_t coord;
+
+static volatile bool stop_loop = false;
+
+/**
+ * Handle keyboard interrupts to gracefully exit.
+ */
+static void handle_sig(int sig)
+{
+	stop_loop = true;
+}
+
+/**
+ * Helper to get the monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Reads and clears the Rx DMA overflow flag of a board. Returns BLOCK_OVF if
+ * it was set, so it covers the time since it was last read.
+ */
+static uint32_t board_check_ovf(board_t* b)
+{
+	uint32_t status;
+
+	if(!b->ovf_readable ||
+	   AD9081_TRACED(AD9081_TP_REG_READ, RX_DMA_STATUS_REG,
+			 iio_device_reg_read(b->ad.rx_dev, RX_DMA_STATUS_REG, &status)) != 0 ||
+	   !(status & RX_DMA_STATUS_OVF)) {
+		return 0;
+	}
+	AD9081_TRACED(AD9081_TP_REG_WRITE, RX_DMA_STATUS_REG,
+		      iio_device_reg_write(b->ad.rx_dev, RX_DMA_STATUS_REG, RX_DMA_STATUS_OVF));
+	return BLOCK_OVF;
+}
+
+/**
+ * Refill thread of a board. Refills the board's buffer as fast as it can,
+ * and copies each block into the slot of its index in the ring. The writer
+ * only ever merges indexes in order, so there is room for block seq as long
+ * as the writer has finished with index seq - ring_blocks. Otherwise the
+ * block is dropped rather than holding up the refills, and the writer finds
+ * the slot still holding an older index.
+ */
+static void* board_thread(void* arg)
+{
+	board_t* b = (board_t*)arg;
+	board_block_t* blk;
+	unsigned long long seq;
+	ssize_t refill_size;
+	size_t block_bytes = coord.samples * iio_buffer_step(b->buff);
+	uint64_t t_done;
+	uint32_t flags;
+	cpu_set_t cpus;
+	char name[32];
+
+	snprintf(name, sizeof(name), "board %u refill", (unsigned int)(b - coord.boards));
+	ad9081_trace_thread_name(name);
+	if(b->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(b->cpu, &cpus);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			error("Could not pin the refill thread of %s to CPU %d\n", b->uri, b->cpu);
+			b->cpu = -1;
+		}
+	}
+
+	for(seq = 0; (coord.num_blocks == 0 || seq < coord.num_blocks) && !stop_loop; seq++) {
+		refill_size = AD9081_TRACED(AD9081_TP_REFILL, block_bytes, iio_buffer_refill(b->buff));
+		if(refill_size < 0) {
+			error("Error code %ld when refilling the buffer of %s\n", refill_size, b->uri);
+			b->result = -1;
+			break;
+		}
+		t_done = now_ns();
+		flags = board_check_ovf(b);
+		if(flags & BLOCK_OVF) {
+			b->ovf_blocks++;
+		}
+
+		if(seq - atomic_load_explicit(&coord.tail, memory_order_acquire) < coord.ring_blocks) {
+			blk = &b->blocks[seq % coord.ring_blocks];
+			memcpy(blk->data, iio_buffer_start(b->buff), refill_size);
+			blk->seq = seq;
+			blk->done_ns = t_done;
+			blk->flags = flags;
+		} else {
+			b->dropped++;
+		}
+
+		b->last_ns = t_done;
+		b->bytes += refill_size;
+		atomic_store_explicit(&b->head, seq + 1, memory_order_release);
+		sem_post(&coord.ready);
+	}
+
+	atomic_store(&b->done, true);
+	sem_post(&coord.ready);
+	return NULL;
+}
+
+/**
+ * Writes the frames of one index of every board as a single stream of merged
+ * frames, each holding the frame of board 0, then board 1 and so on. A board
+ * whose block is missing is filled with zeros, so the merged stream keeps one
+ * merged frame per sample index.
+ */
+static int merge_write(unsigned long long idx, const bool* present)
+{
+	unsigned int i;
+	size_t f, n, done;
+	uint8_t* dst;
+	const board_t* b;
+
+	for(done = 0; done < coord.samples; done += n) {
+		n = coord.samples - done < MERGE_CHUNK_FRAMES ? coord.samples - done : MERGE_CHUNK_FRAMES;
+		dst = coord.stage;
+		for(f = 0; f < n; f++) {
+			for(i = 0; i < coord.num_boards; i++) {
+				b = &coord.boards[i];
+				if(present[i]) {
+					memcpy(dst, b->blocks[idx % coord.ring_blocks].data +
+					       (done + f) * b->frame_size, b->frame_size);
+				} else {
+					memset(dst, 0, b->frame_size);
+				}
+				dst += b->frame_size;
+			}
+		}
+		if(fwrite(coord.stage, coord.merged_frame_size, n, coord.out) != n) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Merges the blocks of every board in index order until any board stops.
+ * Block idx of every board starts at the same sample index, so with a
+ * synchronized start the blocks of an index cover the same time window on
+ * every board. The spread of the refill completions of an index is tracked as
+ * the skew between the boards.
+ */
+static void merge_blocks(void)
+{
+	unsigned long long idx;
+	unsigned int i;
+	bool present[MAX_BOARDS];
+	bool complete;
+	bool ovf;
+	uint64_t t_min, t_max, skew;
+	board_t* b;
+	board_block_t* blk;
+
+	for(idx = 0; ; idx++) {
+		//Wait until every board has refilled index idx
+		for(i = 0; i < coord.num_boards; i++) {
+			b = &coord.boards[i];
+			while(atomic_load_explicit(&b->head, memory_order_acquire) <= idx) {
+				if(atomic_load(&b->done) &&
+				   atomic_load_explicit(&b->head, memory_order_acquire) <= idx) {
+					return;
+				}
+				sem_wait(&coord.ready);
+			}
+		}
+
+		complete = true;
+		ovf = false;
+		t_min = UINT64_MAX;
+		t_max = 0;
+		for(i = 0; i < coord.num_boards; i++) {
+			blk = &coord.boards[i].blocks[idx % coord.ring_blocks];
+			present[i] = blk->seq == idx;
+			if(!present[i]) {
+				complete = false;
+				continue;
+			}
+			ovf |= (blk->flags & BLOCK_OVF) != 0;
+			t_min = blk->done_ns < t_min ? blk->done_ns : t_min;
+			t_max = blk->done_ns > t_max ? blk->done_ns : t_max;
+		}
+
+		if(complete) {
+			skew = t_max - t_min;
+			if(coord.stats.merged == 0 || skew < coord.stats.skew_min_ns) {
+				coord.stats.skew_min_ns = skew;
+			}
+			if(skew > coord.stats.skew_max_ns) {
+				coord.stats.skew_max_ns = skew;
+			}
+			coord.stats.skew_sum_ns += skew;
+			coord.stats.merged++;
+		} else {
+			coord.stats.incomplete++;
+		}
+		if(ovf) {
+			coord.stats.ovf_merged++;
+		}
+
+		if(coord.out) {
+			if(merge_write(idx, present) < 0) {
+				coord.stats.write_errors++;
+			} else {
+				coord.stats.bytes += coord.samples * coord.merged_frame_size;
+			}
+		}
+
+		//Hand the slots of idx back to the refill threads
+		atomic_store_explicit(&coord.tail, idx + 1, memory_order_release);
+	}
+}
+
+/**
+ * Opens the context of a board, and enables the first num_ch (0 for all) Rx
+ * channel pairs. Every board is set up the same way, apart from the channel
+ * count which is limited to what the board has.
+ */
+static int board_open(board_t* b, unsigned int num_ch)
+{
+	unsigned int i;
+	uint32_t status;
+	long long rate;
+
+	if((b->ctx = iio_create_context_from_uri(b->uri)) == NULL) {
+		error("Could not create an IIO context for %s\n", b->uri);
+		return -1;
+	}
+	if(ad9081_ctx_open(&b->ad, b->ctx) < 0) {
+		error("Could not find all the channels of %s\n", b->uri);
+		return -1;
+	}
+	b->ad_open = true;
+
+	b->num_ch = (num_ch == 0 || num_ch > b->ad.num_rx_ch) ? b->ad.num_rx_ch : num_ch;
+	for(i = 0; i < b->num_ch; i++) {
+		iio_channel_enable(b->ad.rx[i].in.ch_i);
+		iio_channel_enable(b->ad.rx[i].in.ch_q);
+	}
+	b->frame_size = iio_device_get_sample_size(b->ad.rx_dev);
+
+	if(iio_channel_attr_read_longlong(b->ad.rx[0].in.ch_i, "sampling_frequency", &rate) == 0) {
+		b->sample_rate = rate;
+	}
+
+	//Clears any overflow left from before the capture too
+	if(iio_device_reg_read(b->ad.rx_dev, RX_DMA_STATUS_REG, &status) == 0) {
+		b->ovf_readable = true;
+		iio_device_reg_write(b->ad.rx_dev, RX_DMA_STATUS_REG, RX_DMA_STATUS_OVF);
+	} else {
+		info("Rx DMA status of %s is not readable, overflows will not be flagged\n", b->uri);
+	}
+	return 0;
+}
+
+static void board_close(board_t* b)
+{
+	unsigned int i;
+
+	for(i = 0; i < MAX_RING_BLOCKS; i++) {
+		free(b->blocks[i].data);
+		b->blocks[i].data = NULL;
+	}
+	if(b->buff) {
+		iio_buffer_destroy(b->buff);
+		b->buff = NULL;
+	}
+	if(b->ad_open) {
+		ad9081_ctx_close(&b->ad);
+		b->ad_open = false;
+	}
+	if(b->ctx) {
+		iio_context_destroy(b->ctx);
+		b->ctx = NULL;
+	}
+}
+
+/**
+ * Arms or triggers the synchronized start of a board through the
+ * sync_start_enable attribute of its Rx core
+ */
+static int board_sync(board_t* b, const char* ctrl)
+{
+	if(AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR("sync_start_enable"),
+			 iio_device_attr_write(b->ad.rx_dev, "sync_start_enable", ctrl)) < 0) {
+		error("Could not write sync_start_enable = %s on %s\n", ctrl, b->uri);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Prints the per board and merged results of the capture
+ */
+static void print_results(double elapsed)
+{
+	unsigned int i;
+	const board_t* b;
+	const board_t* b0 = &coord.boards[0];
+	const merge_stats_t* s = &coord.stats;
+	double secs;
+	double offset_us;
+
+	for(i = 0; i < coord.num_boards; i++) {
+		b = &coord.boards[i];
+		secs = (b->last_ns - b->start_ns) / 1e9;
+		info("Board %u %s: %llu blocks, %llu dropped, %llu with OVF, %.1f MB/s, CPU %d\n",
+		     i, b->uri, atomic_load(&b->head), b->dropped, b->ovf_blocks,
+		     secs > 0.0 ? b->bytes / secs / 1e6 : 0.0, b->cpu);
+
+		//Only a host side estimate, the start isn't seen any closer than this
+		if(i > 0 && !coord.sync_start) {
+			offset_us = ((int64_t)b->start_ns - (int64_t)b0->start_ns) / 1e3;
+			if(b0->sample_rate > 0) {
+				info("Board %u started %.1f us (about %.0f samples) after board 0\n",
+				     i, offset_us, offset_us * b0->sample_rate / 1e6);
+			} else {
+				info("Board %u started %.1f us after board 0\n", i, offset_us);
+			}
+		}
+	}
+
+	if(coord.sync_start) {
+		info("Every board started on the sync from board 0\n");
+	}
+	info("Merged %llu blocks, %llu incomplete, %llu with an overflow\n",
+	     s->merged, s->incomplete, s->ovf_merged);
+	if(s->merged) {
+		info("Refill skew: min %.3f ms, avg %.3f ms, max %.3f ms\n",
+		     s->skew_min_ns / 1e6, s->skew_sum_ns / 1e6 / s->merged, s->skew_max_ns / 1e6);
+	}
+	if(coord.out) {
+		info("Written %llu bytes in %.3f s (%.1f MB/s), %llu write errors\n",
+		     s->bytes, elapsed, elapsed > 0.0 ? s->bytes / elapsed / 1e6 : 0.0,
+		     s->write_errors);
+	}
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-c channels] [-n blocks] [-s samples] [-b blocks] [-a cpu] [-S]\n"
+	       "          [-o file] uri...\n"
+	       "  uri         Context of each board, i.e. local: or ip:192.168.1.155. The\n"
+	       "              first board is the sync master\n"
+	       "  -c channels Rx channel pairs to capture on every board (default all)\n"
+	       "  -n blocks   Blocks to capture from each board, 0 until Ctrl-C (default %d)\n"
+	       "  -s samples  Samples per block (default %d)\n"
+	       "  -b blocks   Ring blocks per board between the refill threads and the\n"
+	       "              writer, 2-%d (default %d)\n"
+	       "  -a cpu      Pin the refill thread of board N to CPU cpu + N, -1 to not\n"
+	       "              pin them (default 0)\n"
+	       "  -S          Synchronized start. Arm every board, then trigger the first\n"
+	       "              one, which needs the boards to share the external sync\n"
+	       "  -o file     Write the merged frames of every board to file\n",
+	       name, DEFAULT_BLOCKS, DEFAULT_SAMPLES, MAX_RING_BLOCKS, DEFAULT_RING_BLOCKS);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	int ret = EXIT_FAILURE;
+	unsigned int i, k;
+	unsigned int num_ch = 0;
+	int first_cpu = 0;
+	long num_cpus;
+	const char* out_name = NULL;
+	uint64_t t_start;
+	board_t* b;
+
+	coord.samples = DEFAULT_SAMPLES;
+	coord.num_blocks = DEFAULT_BLOCKS;
+	coord.ring_blocks = DEFAULT_RING_BLOCKS;
+	while((opt = getopt(argc, argv, "c:n:s:b:a:So:h")) != -1) {
+		switch(opt) {
+		case 'c':
+			num_ch = atoi(optarg);
+			break;
+		case 'n':
+			coord.num_blocks = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			coord.samples = strtoul(optarg, NULL, 0);
+			if(coord.samples == 0) {
+				error("Invalid number of samples %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			coord.ring_blocks = atoi(optarg);
+			if(coord.ring_blocks < 2 || coord.ring_blocks > MAX_RING_BLOCKS) {
+				error("Ring blocks must be 2-%d\n", MAX_RING_BLOCKS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			first_cpu = atoi(optarg);
+			break;
+		case 'S':
+			coord.sync_start = true;
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(optind == argc || argc - optind > MAX_BOARDS) {
+		error("Give the context URIs of 1-%d boards\n", MAX_BOARDS);
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, handle_sig);
+	if(ad9081_trace_open() < 0) {
+		return EXIT_FAILURE;
+	}
+	ad9081_trace_thread_name("main");
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_init(&coord.tail, 0);
+	sem_init(&coord.ready, 0, 0);
+
+	coord.num_boards = argc - optind;
+	for(i = 0; i < coord.num_boards; i++) {
+		b = &coord.boards[i];
+		b->uri = argv[optind + i];
+		b->cpu = (first_cpu < 0 || num_cpus < 1) ? -1 : (int)((first_cpu + i) % num_cpus);
+		atomic_init(&b->head, 0);
+		atomic_init(&b->done, false);
+		if(board_open(b, num_ch) < 0) {
+			goto clean;
+		}
+		b->block_size = coord.samples * b->frame_size;
+		for(k = 0; k < coord.ring_blocks; k++) {
+			if((b->blocks[k].data = malloc(b->block_size)) == NULL) {
+				error("Could not allocate the ring of %s\n", b->uri);
+				goto clean;
+			}
+			//Nothing has been refilled into the slot yet
+			b->blocks[k].seq = ~0ULL;
+		}
+		coord.merged_frame_size += b->frame_size;
+		info("Board %u %s: %u Rx channels, %zu byte frames, %lld Hz\n",
+		     i, b->uri, b->num_ch, b->frame_size, b->sample_rate);
+	}
+	info("Merged frame of %zu bytes, %.1f MB of ring\n", coord.merged_frame_size,
+	     coord.merged_frame_size * coord.samples * coord.ring_blocks / 1e6);
+
+	if(out_name) {
+		if((coord.out = fopen(out_name, "wb")) == NULL) {
+			error("Could not open %s\n", out_name);
+			goto clean;
+		}
+		if((coord.stage = malloc(MERGE_CHUNK_FRAMES * coord.merged_frame_size)) == NULL) {
+			error("Could not allocate the merge staging buffer\n");
+			goto clean;
+		}
+	}
+
+	//With a synchronized start, every DMA waits for the sync once the
+	//buffers are created, and the master's trigger starts them all at once
+	if(coord.sync_start) {
+		for(i = 0; i < coord.num_boards; i++) {
+			if(board_sync(&coord.boards[i], "arm") < 0) {
+				goto clean;
+			}
+		}
+	}
+	for(i = 0; i < coord.num_boards; i++) {
+		b = &coord.boards[i];
+		if((b->buff = iio_device_create_buffer(b->ad.rx_dev, coord.samples, false)) == NULL) {
+			error("Could not create the buffer of %s\n", b->uri);
+			goto clean;
+		}
+		b->start_ns = now_ns();
+	}
+	if(coord.sync_start) {
+		if(board_sync(&coord.boards[0], "trigger_manual") < 0) {
+			goto clean;
+		}
+		t_start = now_ns();
+		for(i = 0; i < coord.num_boards; i++) {
+			coord.boards[i].start_ns = t_start;
+		}
+	}
+
+	info("Starting capture on %u boards\n", coord.num_boards);
+	t_start = now_ns();
+	for(i = 0; i < coord.num_boards; i++) {
+		b = &coord.boards[i];
+		if(pthread_create(&b->thread, NULL, board_thread, b) != 0) {
+			error("Could not start the refill thread of %s\n", b->uri);
+			goto clean;
+		}
+		b->thread_started = true;
+	}
+
+	merge_blocks();
+
+	//Any board which stopped ends the capture for all of them
+	stop_loop = true;
+	ret = EXIT_SUCCESS;
+	for(i = 0; i < coord.num_boards; i++) {
+		b = &coord.boards[i];
+		if(b->thread_started) {
+			pthread_join(b->thread, NULL);
+			b->thread_started = false;
+		}
+		if(b->result < 0 || !b->buff) {
+			ret = EXIT_FAILURE;
+		}
+	}
+	print_results((now_ns() - t_start) / 1e9);
+
+clean:
+	for(i = 0; i < coord.num_boards; i++) {
+		if(coord.boards[i].thread_started) {
+			stop_loop = true;
+			pthread_join(coord.boards[i].thread, NULL);
+		}
+		board_close(&coord.boards[i]);
+	}
+	if(coord.out) {
+		fclose(coord.out);
+	}
+	free(coord.stage);
+	sem_destroy(&coord.ready);
+	ad9081_trace_close();
+	return ret;
+}
@@ -19,23 +19,79 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
-/* The AD9081 has a configurable number of channels based on the JESD and
- * device setup.
- * Unless otherwise provided at build time, assume the application is working
- * with 8 pairs of I&Q for both input and output
+#include "ad9081_ctx.h"
+#include "ad9081_regs.h"
+#include "ad9081_buf.h"
+#include "ad9081_trace.h"
+#include "ad9081_rt.h"
+
+/* Pick the vector unit for the Tx fill kernel. NEON on the A53/A72, SSE2 or
+ * AVX2 when built for an x86 host driving a remote context. Everything else
+ * uses the scalar fill.
  */
-#ifndef NUM_TX_CH
-#define NUM_TX_CH   8
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FILL_VEC_NAME	"NEON"
+#define FILL_VEC_LANES	8
+typedef uint16x8_t fill_vec_t;
+#define fill_vec_load(p)	vld1q_u16(p)
+#define fill_vec_store(p, v)	vst1q_u16((p), (v))
+#define fill_vec_add(a, b)	vaddq_u16((a), (b))
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define FILL_VEC_NAME	"AVX2"
+#define FILL_VEC_LANES	16
+typedef __m256i fill_vec_t;
+#define fill_vec_load(p)	_mm256_loadu_si256((const __m256i*)(p))
+#define fill_vec_store(p, v)	_mm256_storeu_si256((__m256i*)(p), (v))
+#define fill_vec_add(a, b)	_mm256_add_epi16((a), (b))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FILL_VEC_NAME	"SSE2"
+#define FILL_VEC_LANES	8
+typedef __m128i fill_vec_t;
+#define fill_vec_load(p)	_mm_loadu_si128((const __m128i*)(p))
+#define fill_vec_store(p, v)	_mm_storeu_si128((__m128i*)(p), (v))
+#define fill_vec_add(a, b)	_mm_add_epi16((a), (b))
+#else
+#define FILL_VEC_NAME	"scalar"
 #endif
 
-/* Length of temporary buffers for holding channel names */
-#define TEMP_BUFF_LEN	64
+/* Streaming mode parameters. A block is one iio_buffer worth of frames */
+#define DEFAULT_POOL_BLOCKS	8
+#define MAX_POOL_BLOCKS		64
+#define DEFAULT_WORKERS		2
+#define MAX_WORKERS		16
+#define STATUS_POLL_US		1000	/* VDMA status polling period */
+#define STATUS_REPORT_POLLS	1000	/* Polls between live reports */
+#define MIN_WATCH_US		100	/* Fastest register watch period */
+
+/* Most blocks of the kernel DMA buffer, the iio_buffers queued to the DMA at
+ * once. While more than one is queued the DMA always has the next one ready,
+ * and a push only waits when all of them are in flight
+ */
+#define MAX_KERNEL_BLOCKS	64
+
+/* Tx buffer length per enabled I/Q lane. Each buffer is TX_BUFF_SAMPLES *
+ * num_tx_ch * 2 frames, which is that many samples on every channel, so the
+ * buffer gets longer with each Tx channel enabled
+ */
+#define TX_BUFF_SAMPLES		0x10000
+
+/* Longest to wait for the DAC channels to leave DMA mode after the buffer is
+ * destroyed, and how often to check
+ */
+#define DAC_SETTLE_TIMEOUT_US	500000
+#define DAC_SETTLE_POLL_US	200
 
-/* Constants for direct register access for channel information */
-#define DAC_CH_REG_BASE		0x400
-#define DAC_CH_REG_STEP		0x40
-#define DAC_CH_CTRL_OFFSET	0x18
+/* Blocks pushed in each mode of the reconfiguration loop, and the most mode
+ * switches asked for at once
+ */
+#define RECONFIG_PUSHES		4
+#define MAX_RECONFIG_SWITCHES	1000000
 
 #define ARGS(fmt, ...)	__VA_ARGS__
 #define FMT(fmt, ...)	fmt
@@ -45,32 +101,87 @@
 #define info(...) \
 	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
 
-/* Helper struct for holding channel pair information. The config_ channels are
- * from the ad9081 'PHY' and used for configuring things like the NCO freq.
- * The dac_ channels are from the DAC/DMA block and are use for setting up the
- * data buffers
- *
- * For test purposes, the software just generates a linear ramp, setup by the
- * remaining parameters
+/* For test purposes, the software just generates a linear ramp on each
+ * channel pair, setup by these parameters
  */
 typedef struct {
-	struct iio_channel *config_i;
-	struct iio_channel *config_q;
-	struct iio_channel *dac_i;
-	struct iio_channel *dac_q;
 	uint16_t ramp_i;
 	uint16_t ramp_q;
 	uint16_t ramp_inc;
-} tx_channel_pair_t;
+} tx_ramp_t;
+
+/* Discovered devices and channels. The config channels of each Tx row are
+ * from the ad9081 'PHY' and used for configuring things like the NCO freq.
+ * The dac channels are from the DAC/DMA block and are use for setting up the
+ * data buffers
+ */
+static ad9081_ctx_t ad;
+
+/* Number of Tx channel pairs in use, found at run time, and their ramps */
+static unsigned int num_tx_ch;
+static tx_ramp_t tx_ramps[AD9081_MAX_CH];
 
-/* Holds all the channel pairs */
-static tx_channel_pair_t tx_channels[NUM_TX_CH];
+/* Most uint16_t values in one frame of the buffer, [ch0_i, ch0_q, ...] */
+#define MAX_FRAME_LANES	(AD9081_MAX_CH * 2)
+
+/* A preallocated block of frames in the streaming pool */
+typedef struct {
+	uint16_t* data;
+	ad9081_mem_t mem;	/* Backing of data, hugepages when there are some */
+	unsigned long long seq;	/* Sequence number of the block held */
+	bool ready;		/* Filled and waiting to be pushed */
+} tx_pool_block_t;
+
+/* Pool of blocks filled ahead of the pusher by the worker threads. Blocks are
+ * identified by a sequence number, and block seq always lives in slot
+ * seq % num_blocks. Workers can claim sequence numbers up to num_blocks ahead
+ * of the pusher. The lock is only held to claim and hand off blocks, never
+ * while filling or pushing.
+ */
+typedef struct {
+	tx_pool_block_t blocks[MAX_POOL_BLOCKS];
+	unsigned int num_blocks;
+	size_t frames;				/* Frames per block */
+	tx_ramp_t start[AD9081_MAX_CH];		/* Ramp state before block 0 */
+	unsigned long long next_fill;		/* Next block for a worker to claim */
+	unsigned long long next_push;		/* Next block the pusher needs */
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t freed;
+} tx_pool_t;
+
+/* Counters for the streaming mode. The counts are read by the status thread
+ * while the pusher and it update them, so they are only accessed atomically
+ */
+typedef struct {
+	unsigned long long blocks_pushed;
+	unsigned long long late_blocks;		/* Pusher had to wait on the workers */
+	unsigned long long unf_polls;		/* Polls which saw the UNF flag */
+	unsigned long long ovf_polls;		/* Polls which saw the OVF flag */
+	double push_time;			/* Time spent in iio_buffer_push, s */
+	double push_max;			/* Longest single push, s */
+	double elapsed;				/* From the first push to the stop, s */
+} tx_stream_stats_t;
+
+static tx_stream_stats_t stream_stats;
 
 static bool stop_loop = false;
 
 static struct iio_context *ctx = NULL;
-static struct iio_device *ad9081 = NULL;
-static struct iio_device *ad9081_tx = NULL;
+
+/* The Tx buffer, kept open across the mode changes of the reconfiguration
+ * loop
+ */
+static ad9081_buf_t tx_buf;
+
+/* Register access to the DAC core, and the optional register watch thread */
+static ad9081_regs_t dac_regs;
+static unsigned int watch_period_us = 0;
+static volatile bool watch_stop = false;
+
+/* CPU and priority placement of the push and worker threads */
+static ad9081_rt_t rt;
 
 /**
  * Handle keyboard interrupts to gracefully exit.
@@ -86,108 +197,829 @@ static void handle_sig(int sig)
  */
 static void inspect_dac_regs(void)
 {
-	int i;
-	uint32_t reg_val;
-	uint32_t reg_addr;
+	unsigned int i;
+	ad9081_dac_snapshot_t snap;
+
+	ad9081_regs_snapshot(&dac_regs, &snap);
 	printf("**DAC Regs**\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		reg_addr = DAC_CH_REG_BASE + (i * DAC_CH_REG_STEP) + DAC_CH_CTRL_OFFSET;
-		iio_device_reg_read(ad9081_tx, reg_addr, &reg_val);
-		printf("Ch %d: CTRL7 (0x%X) = 0x%02X\n", i, reg_addr, reg_val);
+	for( i = 0; i < snap.num_dac_ch; i++ ) {
+		printf("Ch %u: CTRL7 (0x%X) = 0x%02X\n", i,
+		       DAC_CH_REG(i, DAC_CH_CTRL_OFFSET), snap.ctrl[i]);
 	}
-	printf("\n\n");
+	printf("VDMA Status (0x%X) = 0x%02X\n", ADI_REG_VDMA_STATUS, snap.vdma_status);
+	printf("Snapshot in %.1f us (%s)\n\n\n", (snap.t_end - snap.t_start) * 1e6,
+	       ad9081_regs_path_name(&dac_regs));
 }
 
 /**
- * Loads the Tx channels into the tx_channels array.  Loads both the config
- * channels from the ad9081 'PHY', and the buffer channels from the DAC
+ * Prints a snapshot on one line, relative to the watch start time
  */
-static int load_channels(void)
+static void print_snapshot(const ad9081_dac_snapshot_t* snap, double t0)
 {
-	int i;
-	int result = 0; //Assume successful
-	char ch_buff[TEMP_BUFF_LEN];
+	unsigned int i;
+	char line[AD9081_MAX_DAC_CH * 3 + 1] = "";
 
-	for(i = 0; i < NUM_TX_CH; i++) {
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_i", i);
-		if((tx_channels[i].config_i = iio_device_find_channel(ad9081, ch_buff, false)) == NULL) {
-			result = -1;
-			error("Error finding Output (Config) Channel %s\n",ch_buff);
+	for( i = 0; i < snap->num_dac_ch; i++ ) {
+		snprintf(&line[i * 3], 4, " %02X", snap->ctrl[i] & 0xFF);
+	}
+	info("+%10.3f ms CTRL7%s VDMA 0x%X\n", (snap->t_start - t0) * 1000.0,
+	     line, snap->vdma_status);
+}
+
+/**
+ * Register watch thread. Snapshots the DAC core every watch_period_us, and
+ * prints a line with the time whenever anything changed since the previous
+ * snapshot, so each transition can be placed within one period.
+ */
+static void* reg_watch_thread(void* arg)
+{
+	ad9081_dac_snapshot_t prev, snap;
+	unsigned long long count = 1;
+	double t0, busy = 0.0;
+
+	ad9081_trace_thread_name("reg watch");
+	ad9081_regs_snapshot(&dac_regs, &prev);
+	t0 = prev.t_start;
+	print_snapshot(&prev, t0);
+
+	while (!watch_stop) {
+		usleep(watch_period_us);
+		ad9081_regs_snapshot(&dac_regs, &snap);
+		busy += snap.t_end - snap.t_start;
+		count++;
+		if (snap.vdma_status != prev.vdma_status ||
+		    memcmp(snap.ctrl, prev.ctrl, snap.num_dac_ch * sizeof(snap.ctrl[0])) != 0) {
+			print_snapshot(&snap, t0);
+			prev = snap;
 		}
-		if((tx_channels[i].dac_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output (DAC) Channel %s\n",ch_buff);
+	}
+	info("Register watch took %llu snapshots, %.1f us each (%s)\n", count,
+	     busy * 1e6 / count, ad9081_regs_path_name(&dac_regs));
+	return NULL;
+}
+
+/**
+ * Sets up the dummy ramp of each Tx channel pair
+ */
+static void init_ramps(tx_ramp_t* ramps, unsigned int num_ch)
+{
+	unsigned int i;
+
+	for(i = 0; i < num_ch; i++) {
+		ramps[i].ramp_i = 0x0;
+		ramps[i].ramp_q = 0x8000;
+		ramps[i].ramp_inc = 1 << i; //Different ramp rate for each pair
+	}
+}
+
+
+/**
+ * Reference fill of num_frames interleaved frames of num_ch channels from the
+ * per-channel ramp state, one value at a time. The ramp state is advanced as
+ * it goes.
+ */
+static void fill_frames_scalar(tx_ramp_t* chans, unsigned int num_ch,
+			       uint16_t* p_dat, size_t num_frames)
+{
+	unsigned int i;
+	size_t f;
+
+	for( f = 0; f < num_frames; f++ ) {
+		for( i = 0; i < num_ch; i++ ) {
+			*p_dat++ = chans[i].ramp_i = chans[i].ramp_i + chans[i].ramp_inc;
+			*p_dat++ = chans[i].ramp_q = chans[i].ramp_q + chans[i].ramp_inc;
 		}
+	}
+}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_q", i);
-		if((tx_channels[i].config_q = iio_device_find_channel(ad9081, ch_buff, false)) == NULL) {
-			result = -1;
-			error("Error finding Output (Config) Channel %s\n",ch_buff);
+#ifdef FILL_VEC_LANES
+static size_t gcd_size(size_t a, size_t b)
+{
+	size_t t;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/**
+ * Vectorized fill of num_frames interleaved frames, bit identical to
+ * fill_frames_scalar().
+ *
+ * The output is a ramp per lane, so it is periodic in its lane layout: every
+ * lcm(frame lanes, FILL_VEC_LANES) values the same lanes line up with the
+ * same channel again. One vector per position in that period is seeded with
+ * its first values, and each pass of the loop stores them and adds the
+ * channel increment times the number of frames in a period. Whatever is left
+ * over at the end that doesn't fill a whole period is done by the scalar fill.
+ */
+static void fill_frames(tx_ramp_t* chans, unsigned int num_ch, uint16_t* p_dat,
+			size_t num_frames)
+{
+	size_t frame_lanes = num_ch * 2;
+	size_t period_lanes = (frame_lanes / gcd_size(frame_lanes, FILL_VEC_LANES)) * FILL_VEC_LANES;
+	size_t period_frames = period_lanes / frame_lanes;
+	size_t num_vecs = period_lanes / FILL_VEC_LANES;
+	size_t num_periods = num_frames / period_frames;
+	size_t v, l, p, lane, frame;
+	unsigned int i;
+	uint16_t start[MAX_FRAME_LANES], inc[MAX_FRAME_LANES];
+	uint16_t seed[FILL_VEC_LANES], step[FILL_VEC_LANES];
+	fill_vec_t vals[MAX_FRAME_LANES];	/* num_vecs never exceeds the frame lanes */
+	fill_vec_t steps[MAX_FRAME_LANES];
+
+	if (num_periods == 0) {
+		fill_frames_scalar(chans, num_ch, p_dat, num_frames);
+		return;
+	}
+
+	for( i = 0; i < num_ch; i++ ) {
+		start[i * 2] = chans[i].ramp_i;
+		start[i * 2 + 1] = chans[i].ramp_q;
+		inc[i * 2] = inc[i * 2 + 1] = chans[i].ramp_inc;
+	}
+
+	for( v = 0; v < num_vecs; v++ ) {
+		for( l = 0; l < FILL_VEC_LANES; l++ ) {
+			lane = (v * FILL_VEC_LANES + l) % frame_lanes;
+			frame = (v * FILL_VEC_LANES + l) / frame_lanes;
+			seed[l] = start[lane] + (uint16_t)((frame + 1) * inc[lane]);
+			step[l] = (uint16_t)(period_frames * inc[lane]);
 		}
-		if((tx_channels[i].dac_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output (DAC) Channel %s\n",ch_buff);
+		vals[v] = fill_vec_load(seed);
+		steps[v] = fill_vec_load(step);
+	}
+
+	for( p = 0; p < num_periods; p++ ) {
+		for( v = 0; v < num_vecs; v++ ) {
+			fill_vec_store(p_dat, vals[v]);
+			vals[v] = fill_vec_add(vals[v], steps[v]);
+			p_dat += FILL_VEC_LANES;
 		}
+	}
 
-		/* Initialize the dummy ramp value */
-		tx_channels[i].ramp_i = 0x0;
-		tx_channels[i].ramp_q = 0x8000;
-		tx_channels[i].ramp_inc = 1 << i; //Different ramp rate for each pair
+	//Advance the ramp state past everything written so far, then finish off
+	for( i = 0; i < num_ch; i++ ) {
+		chans[i].ramp_i += (uint16_t)(num_periods * period_frames * chans[i].ramp_inc);
+		chans[i].ramp_q += (uint16_t)(num_periods * period_frames * chans[i].ramp_inc);
 	}
+	fill_frames_scalar(chans, num_ch, p_dat, num_frames - num_periods * period_frames);
+}
+#else
+#define fill_frames fill_frames_scalar
+#endif
 
-	return result;
+/**
+ * Helper to get the monotonic time in seconds
+ */
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Worker thread for the streaming mode. Claims the next free block of the pool,
+ * works out the ramp state at the start of that block from the state before
+ * block 0, so blocks can be filled in any order by any number of workers, and
+ * marks it ready for the pusher.
+ */
+static void* tx_worker_thread(void* arg)
+{
+	tx_pool_t* pool = (tx_pool_t*)arg;
+	tx_pool_block_t* block;
+	tx_ramp_t state[AD9081_MAX_CH];
+	unsigned long long seq;
+	uint16_t advance;
+	unsigned int i;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->done && pool->next_fill - pool->next_push >= pool->num_blocks) {
+			pthread_cond_wait(&pool->freed, &pool->lock);
+		}
+		if (pool->done) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		seq = pool->next_fill++;
+		pthread_mutex_unlock(&pool->lock);
+
+		memcpy(state, pool->start, sizeof(state));
+		for( i = 0; i < num_tx_ch; i++ ) {
+			advance = (uint16_t)(seq * pool->frames * state[i].ramp_inc);
+			state[i].ramp_i += advance;
+			state[i].ramp_q += advance;
+		}
+		block = &pool->blocks[seq % pool->num_blocks];
+		fill_frames(state, num_tx_ch, block->data, pool->frames);
+
+		pthread_mutex_lock(&pool->lock);
+		block->seq = seq;
+		block->ready = true;
+		pthread_cond_broadcast(&pool->filled);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Status thread for the streaming mode. Polls the DAC DMA status register for
+ * underflow/overflow, clears whatever it sees, and periodically prints the
+ * counts. Each poll which sees a flag counts once, so the counts are the
+ * number of polling periods in which at least one event happened.
+ */
+static void* tx_status_thread(void* arg)
+{
+	uint32_t status;
+	unsigned int polls = 0;
+
+	ad9081_trace_thread_name("tx status");
+	while (!stop_loop) {
+		if (ad9081_regs_read(&dac_regs, ADI_REG_VDMA_STATUS, &status) == 0 &&
+		    (status & (ADI_VDMA_UNF | ADI_VDMA_OVF))) {
+			if (status & ADI_VDMA_UNF) {
+				__atomic_fetch_add(&stream_stats.unf_polls, 1, __ATOMIC_RELAXED);
+			}
+			if (status & ADI_VDMA_OVF) {
+				__atomic_fetch_add(&stream_stats.ovf_polls, 1, __ATOMIC_RELAXED);
+			}
+			ad9081_regs_write(&dac_regs, ADI_REG_VDMA_STATUS,
+					  status & (ADI_VDMA_UNF | ADI_VDMA_OVF));
+		}
+
+		if (++polls == STATUS_REPORT_POLLS) {
+			polls = 0;
+			info("Pushed %llu, late %llu, UNF %llu, OVF %llu\n",
+			     __atomic_load_n(&stream_stats.blocks_pushed, __ATOMIC_RELAXED),
+			     __atomic_load_n(&stream_stats.late_blocks, __ATOMIC_RELAXED),
+			     __atomic_load_n(&stream_stats.unf_polls, __ATOMIC_RELAXED),
+			     __atomic_load_n(&stream_stats.ovf_polls, __ATOMIC_RELAXED));
+			ad9081_trace_write_metrics();
+		}
+		usleep(STATUS_POLL_US);
+	}
+	return NULL;
+}
+
+/**
+ * Prints the rate pushed blocks crossed the network to iiod and, when the link
+ * rate is known, how much of the link that used. Only the sample bytes are
+ * counted, the TCP/IP and iiod framing puts the wire a few percent higher.
+ */
+static void print_link(unsigned long long bytes, double elapsed, unsigned int link_mbps)
+{
+	double mbps;
+
+	if (elapsed <= 0.0) {
+		return;
+	}
+	mbps = bytes * 8.0 / elapsed / 1e6;
+	if (link_mbps) {
+		info("Link %.1f Mb/s, %.1f%% of %u Mb/s\n", mbps, mbps * 100.0 / link_mbps,
+		     link_mbps);
+	} else {
+		info("Link %.1f Mb/s\n", mbps);
+	}
 }
 
+/**
+ * Streaming mode. num_workers threads fill the pool ahead of the calling
+ * thread, which owns the iio_buffer and only copies a ready block in and
+ * pushes it. A block that isn't ready in time is counted as late, and actual
+ * DAC underflows are counted by the status thread.
+ */
+static int stream_tx(struct iio_buffer* buff, unsigned int num_workers,
+		     unsigned int num_blocks)
+{
+	int ret = 0;
+	ssize_t result;
+	unsigned int b, w;
+	unsigned int num_started = 0;
+	size_t block_bytes;
+	double t_push, t_start;
+	tx_pool_t* pool;
+	tx_pool_block_t* block;
+	pthread_t workers[MAX_WORKERS];
+	pthread_t status;
+	char name[16];
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+		error("Could not allocate the Tx pool\n");
+		return -1;
+	}
+
+	block_bytes = (uint8_t*)iio_buffer_end(buff) - (uint8_t*)iio_buffer_start(buff);
+	pool->num_blocks = num_blocks;
+	pool->frames = block_bytes / (num_tx_ch * 2 * sizeof(uint16_t));
+	memcpy(pool->start, tx_ramps, sizeof(pool->start));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->filled, NULL);
+	pthread_cond_init(&pool->freed, NULL);
+	for( b = 0; b < num_blocks; b++ ) {
+		if (ad9081_mem_alloc(&pool->blocks[b].mem, block_bytes) < 0) {
+			error("Could not allocate Tx pool block %u\n", b);
+			ret = -1;
+			goto clean;
+		}
+		pool->blocks[b].data = pool->blocks[b].mem.data;
+	}
+	info("Pool of %u blocks of %zu bytes from %s\n", num_blocks, block_bytes,
+	     ad9081_mem_path_name(pool->blocks[0].mem.path));
+
+	for( w = 0; w < num_workers; w++ ) {
+		if (pthread_create(&workers[w], NULL, tx_worker_thread, pool) != 0) {
+			error("Could not start Tx worker %u\n", w);
+			ret = -1;
+			goto stop;
+		}
+		num_started++;
+		snprintf(name, sizeof(name), "tx worker %u", w);
+		ad9081_rt_add_thread(&rt, workers[w], name);
+	}
+
+	//Start from a clean status so only underflows from streaming are counted
+	ad9081_regs_write(&dac_regs, ADI_REG_VDMA_STATUS, ADI_VDMA_UNF | ADI_VDMA_OVF);
+	if (pthread_create(&status, NULL, tx_status_thread, NULL) != 0) {
+		error("Could not start the status thread\n");
+		ret = -1;
+		goto stop;
+	}
+
+	ad9081_rt_start(&rt);
+	t_start = now_sec();
+	while (stop_loop == false) {
+		block = &pool->blocks[pool->next_push % pool->num_blocks];
+
+		pthread_mutex_lock(&pool->lock);
+		if (!(block->ready && block->seq == pool->next_push)) {
+			//The workers only start with the stream, so the first block is never ready
+			if (pool->next_push) {
+				__atomic_fetch_add(&stream_stats.late_blocks, 1, __ATOMIC_RELAXED);
+			}
+			while (!(block->ready && block->seq == pool->next_push)) {
+				pthread_cond_wait(&pool->filled, &pool->lock);
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		memcpy(iio_buffer_start(buff), block->data, block_bytes);
+
+		//The block is in the iio_buffer now, so a worker can start on it
+		pthread_mutex_lock(&pool->lock);
+		block->ready = false;
+		pool->next_push++;
+		pthread_cond_broadcast(&pool->freed);
+		pthread_mutex_unlock(&pool->lock);
+
+		t_push = now_sec();
+		if ((result = AD9081_TRACED(AD9081_TP_PUSH, block_bytes, iio_buffer_push(buff))) < 0) {
+			error("Error code %zd when pushing buffer\n", result);
+			ret = -1;
+			break;
+		}
+		ad9081_rt_mark(&rt, ad9081_trace_now());
+		t_push = now_sec() - t_push;
+		stream_stats.push_time += t_push;
+		if (t_push > stream_stats.push_max) {
+			stream_stats.push_max = t_push;
+		}
+		__atomic_fetch_add(&stream_stats.blocks_pushed, 1, __ATOMIC_RELAXED);
+	}
+
+	stream_stats.elapsed = now_sec() - t_start;
+
+	//The status thread watches stop_loop too
+	stop_loop = true;
+	pthread_join(status, NULL);
+
+stop:
+	pthread_mutex_lock(&pool->lock);
+	pool->done = true;
+	pthread_cond_broadcast(&pool->freed);
+	pthread_mutex_unlock(&pool->lock);
+	for( w = 0; w < num_started; w++ ) {
+		pthread_join(workers[w], NULL);
+	}
+
+	//Carry the ramp state on from the last block pushed
+	for( b = 0; b < num_tx_ch; b++ ) {
+		tx_ramps[b].ramp_i += (uint16_t)(pool->next_push * pool->frames * tx_ramps[b].ramp_inc);
+		tx_ramps[b].ramp_q += (uint16_t)(pool->next_push * pool->frames * tx_ramps[b].ramp_inc);
+	}
+
+	info("Pushed %llu blocks, %llu late, UNF seen in %llu polls, OVF seen in %llu polls\n",
+	     stream_stats.blocks_pushed, stream_stats.late_blocks,
+	     stream_stats.unf_polls, stream_stats.ovf_polls);
+	if (stream_stats.blocks_pushed) {
+		info("Push time avg %.3f ms, max %.3f ms\n",
+		     stream_stats.push_time * 1000.0 / stream_stats.blocks_pushed,
+		     stream_stats.push_max * 1000.0);
+	}
+	ad9081_rt_report(&rt, "Push");
+
+clean:
+	for( b = 0; b < num_blocks; b++ ) {
+		ad9081_mem_free(&pool->blocks[b].mem);
+	}
+	pthread_cond_destroy(&pool->freed);
+	pthread_cond_destroy(&pool->filled);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return ret;
+}
+
+/**
+ * Waits for every DAC channel to leave DMA mode once the buffer is destroyed,
+ * rather than sleeping for as long as the driver could possibly need
+ */
+static void wait_dac_idle(void)
+{
+	unsigned int i;
+	ad9081_dac_snapshot_t snap;
+	double t0 = now_sec();
+
+	do {
+		if (ad9081_regs_snapshot(&dac_regs, &snap) < 0) {
+			return;
+		}
+		//Stops at the first channel still in DMA mode
+		for( i = 0; i < snap.num_dac_ch && snap.ctrl[i] != 0x2; i++ ) {
+		}
+		if (i == snap.num_dac_ch) {
+			info("DAC left DMA mode in %.3f ms\n", (snap.t_end - t0) * 1000.0);
+			return;
+		}
+		usleep(DAC_SETTLE_POLL_US);
+	} while ((now_sec() - t0) * 1e6 < DAC_SETTLE_TIMEOUT_US);
+	error("DAC still in DMA mode after %d ms\n", DAC_SETTLE_TIMEOUT_US / 1000);
+}
+
+/**
+ * Reconfiguration loop. Switches between all the Tx channels and the first
+ * half of them, the way an application changing modes would, and pushes a
+ * few blocks in each mode. The buffer was opened with every channel, so each
+ * switch only changes the enabled channels and reattaches to it. That only
+ * changes the libiio mask, the kernel scan mask stays at every channel, so the
+ * channels switched off stay in DMA mode and get their lanes cleared before
+ * each push, muting them rather than turning them off. The CTRL7 register of
+ * each of them is checked after the first push of a narrow mode to show it.
+ */
+static int reconfig_tx(unsigned int switches, size_t samples)
+{
+	unsigned int s, i, p, active;
+	unsigned int muted_checked = 0, muted_dma = 0;
+	unsigned long long created = tx_buf.created;
+	unsigned long long reattached = tx_buf.reattached;
+	ad9081_dac_snapshot_t snap;
+	double t_switch, t;
+	double get_total = 0.0, get_max = 0.0;
+	double switch_total = 0.0, switch_max = 0.0;
+	struct iio_buffer* buff;
+	uint16_t* p_dat, *p_end;
+	ssize_t result;
+
+	for( s = 0; s < switches && !stop_loop; s++ ) {
+		active = (s % 2) ? (num_tx_ch + 1) / 2 : num_tx_ch;
+		t_switch = now_sec();
+		for( i = 0; i < num_tx_ch; i++ ) {
+			if (i < active) {
+				iio_channel_enable(ad.tx[i].dac.ch_i);
+				iio_channel_enable(ad.tx[i].dac.ch_q);
+			} else {
+				iio_channel_disable(ad.tx[i].dac.ch_i);
+				iio_channel_disable(ad.tx[i].dac.ch_q);
+			}
+		}
+		if ((buff = ad9081_buf_get(&tx_buf, samples, false)) == NULL) {
+			error("Could not get a buffer for %u channels: %d\n", active, -errno);
+			return -1;
+		}
+		get_total += tx_buf.last_get;
+		if (tx_buf.last_get > get_max) {
+			get_max = tx_buf.last_get;
+		}
+
+		for( p = 0; p < RECONFIG_PUSHES; p++ ) {
+			//The buffer has every channel, so fill them all and clear the
+			//ones switched off
+			p_dat = iio_buffer_start(buff);
+			p_end = (uint16_t*)iio_buffer_end(buff);
+			fill_frames(tx_ramps, num_tx_ch, p_dat, (p_end - p_dat) / (num_tx_ch * 2));
+			ad9081_buf_clear_unused(&tx_buf);
+			if ((result = AD9081_TRACED(AD9081_TP_PUSH, (uint8_t*)p_end - (uint8_t*)p_dat,
+						    iio_buffer_push(buff))) < 0) {
+				error("Error code %zd when pushing buffer\n", result);
+				return -1;
+			}
+			if (p == 0) {
+				t = now_sec() - t_switch;
+				switch_total += t;
+				if (t > switch_max) {
+					switch_max = t;
+				}
+			}
+		}
+
+		//Two DAC channels per Tx channel, CTRL7 of 0x2 is DMA mode
+		if (active < num_tx_ch && ad9081_regs_snapshot(&dac_regs, &snap) == 0) {
+			for( i = active * 2; i < num_tx_ch * 2 && i < snap.num_dac_ch; i++ ) {
+				muted_checked++;
+				if (snap.ctrl[i] == 0x2) {
+					muted_dma++;
+				}
+			}
+		}
+	}
+
+	info("%u mode switches, %llu created the buffer, %llu reattached\n", s,
+	     tx_buf.created - created, tx_buf.reattached - reattached);
+	if (muted_checked) {
+		info("%u of %u checks of a disabled DAC channel found it in DMA mode, muted\n",
+		     muted_dma, muted_checked);
+	}
+	if (s) {
+		info("Buffer get avg %.3f ms, max %.3f ms\n", get_total * 1000.0 / s,
+		     get_max * 1000.0);
+		info("Switch to first push avg %.3f ms, max %.3f ms\n",
+		     switch_total * 1000.0 / s, switch_max * 1000.0);
+	}
+	return 0;
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-t] [-s] [-w workers] [-b blocks] [-k blocks] [-r period_us] [-L mbps]\n"
+	       "          [-R switches] [-a cpus] [-P prio] [-M] [-I cpu] [-J blocks]\n"
+	       "  -t          Check the fill kernel against the scalar path for every\n"
+	       "              channel count and exit\n"
+	       "  -s          Streaming mode. Worker threads fill a pool of blocks ahead\n"
+	       "              of the push thread, and DAC underflows are reported\n"
+	       "  -w workers  Number of worker threads in streaming mode (default %d)\n"
+	       "  -b blocks   Number of blocks in the streaming pool (default %d)\n"
+	       "  -k blocks   Number of kernel DMA blocks queued at once, 1-%d\n"
+	       "              (default is the libiio default)\n"
+	       "  -r period   Watch the DAC registers every period us and log each\n"
+	       "              change with its time (min %d)\n"
+	       "  -L mbps     Link rate in Mb/s to report the streaming utilization of\n"
+	       "              a network context against\n"
+	       "  -R switches Switch between all and half the channels this many times,\n"
+	       "              1-%d, keeping the buffer open and muting the channels\n"
+	       "              switched off, and report the switch times\n"
+	       "  -a cpus     Pin the push thread to the first CPU of a comma separated\n"
+	       "              list, i.e. 3,1,2, and the workers to the others in turn\n"
+	       "  -P prio     Run the push thread SCHED_FIFO at prio, 1-99, and the\n"
+	       "              workers one below it\n"
+	       "  -M          Lock all the memory of the process, mlockall()\n"
+	       "  -I cpu      Move the AXI DMA interrupts to cpu while pushing\n"
+	       "  -J blocks   Blocks pushed before the placement is applied, after the\n"
+	       "              kernel blocks, to compare the push jitter against\n"
+	       "              (default %d, 0 applies it first)\n",
+	       name, DEFAULT_WORKERS, DEFAULT_POOL_BLOCKS, MAX_KERNEL_BLOCKS, MIN_WATCH_US,
+	       MAX_RECONFIG_SWITCHES, AD9081_RT_DEFAULT_BASELINE);
+}
+
+/**
+ * Checks that the fill kernel produces the same output and ramp state as the
+ * scalar path for num_ch channels, bit for bit. Several buffers are filled
+ * back to back so the state carried between pushes is checked too, followed
+ * by odd sized fills that exercise the scalar tail. No hardware is needed.
+ */
+static int check_fill_kernel(unsigned int num_ch, size_t num_frames)
+{
+	unsigned int i;
+	int pass;
+	int result = 0;
+	size_t lens[] = { num_frames, num_frames, 1, 7, num_frames - 3, 0 };
+	size_t frame_lanes = num_ch * 2;
+	tx_ramp_t ref[AD9081_MAX_CH], test[AD9081_MAX_CH];
+	uint16_t* ref_buff;
+	uint16_t* test_buff;
+	double t_ref = 0.0, t_test = 0.0, t_start;
+
+	ref_buff = malloc(num_frames * frame_lanes * sizeof(uint16_t));
+	test_buff = malloc(num_frames * frame_lanes * sizeof(uint16_t));
+	if (!ref_buff || !test_buff) {
+		error("Could not allocate check buffers\n");
+		free(ref_buff);
+		free(test_buff);
+		return -1;
+	}
+
+	init_ramps(ref, num_ch);
+	memcpy(test, ref, sizeof(ref));
+
+	for( pass = 0; pass < (int)(sizeof(lens)/sizeof(lens[0])); pass++ ) {
+		t_start = now_sec();
+		fill_frames_scalar(ref, num_ch, ref_buff, lens[pass]);
+		t_ref += now_sec() - t_start;
+
+		t_start = now_sec();
+		fill_frames(test, num_ch, test_buff, lens[pass]);
+		t_test += now_sec() - t_start;
+
+		if (memcmp(ref_buff, test_buff, lens[pass] * frame_lanes * sizeof(uint16_t)) != 0) {
+			error("Fill output mismatch on pass %d (%zu frames)\n", pass, lens[pass]);
+			result = -1;
+		}
+		for( i = 0; i < num_ch; i++ ) {
+			if (ref[i].ramp_i != test[i].ramp_i || ref[i].ramp_q != test[i].ramp_q) {
+				error("Ramp state mismatch on pass %d, channel %u\n", pass, i);
+				result = -1;
+			}
+		}
+	}
+
+	info("Fill kernel check %2u ch %s. Scalar %.3f ms, %s kernel %.3f ms\n",
+	     num_ch, result ? "FAILED" : "passed", t_ref * 1000.0, FILL_VEC_NAME,
+	     t_test * 1000.0);
+
+	free(ref_buff);
+	free(test_buff);
+	return result;
+}
 
 int main(int argc, char* argv[])
 {
-	int ret;
+	int ret = EXIT_SUCCESS;
 	int result;
-	int i;
+	unsigned int i;
+	int opt;
+	bool streaming = false;
+	unsigned int num_workers = DEFAULT_WORKERS;
+	unsigned int num_blocks = DEFAULT_POOL_BLOCKS;
+	unsigned int kernel_blocks = 0;		/* 0 keeps the libiio default */
+	unsigned int link_mbps = 0;
+	unsigned int switches = 0;
 	uint16_t* p_dat, *p_end;
 
-	struct iio_channel *dac1_dds_ctrl = NULL;
 	struct iio_buffer  *sample_buff = NULL;
+	pthread_t watch;
+	bool watching = false;
+	char* end;
+
+	ad9081_rt_init(&rt);
+	while ((opt = getopt(argc, argv, "tsw:b:k:r:L:R:a:P:MI:J:")) != -1) {
+		switch (opt) {
+		case 't':
+			//Only verify the fill kernel against the scalar path, no hardware needed
+			for( i = 1; i <= AD9081_MAX_CH; i++ ) {
+				if (check_fill_kernel(i, TX_BUFF_SAMPLES * 2) < 0) {
+					ret = EXIT_FAILURE;
+				}
+			}
+			return ret;
+		case 's':
+			streaming = true;
+			break;
+		case 'w':
+			num_workers = strtoul(optarg, NULL, 0);
+			if (num_workers < 1 || num_workers > MAX_WORKERS) {
+				error("Workers must be 1-%d\n", MAX_WORKERS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			num_blocks = strtoul(optarg, NULL, 0);
+			if (num_blocks < 2 || num_blocks > MAX_POOL_BLOCKS) {
+				error("Pool blocks must be 2-%d\n", MAX_POOL_BLOCKS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'k':
+			kernel_blocks = strtoul(optarg, NULL, 0);
+			if (kernel_blocks < 1 || kernel_blocks > MAX_KERNEL_BLOCKS) {
+				error("Kernel blocks must be 1-%d\n", MAX_KERNEL_BLOCKS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			watch_period_us = strtoul(optarg, NULL, 0);
+			if (watch_period_us < MIN_WATCH_US) {
+				error("Watch period must be at least %d us\n", MIN_WATCH_US);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'L':
+			link_mbps = strtoul(optarg, NULL, 0);
+			if (link_mbps == 0) {
+				error("Link rate must be at least 1 Mb/s\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'R':
+			switches = strtoul(optarg, &end, 0);
+			if (*end != '\0' || optarg[0] == '-' || switches < 1 ||
+			    switches > MAX_RECONFIG_SWITCHES) {
+				error("Mode switches must be 1-%d\n", MAX_RECONFIG_SWITCHES);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			if (ad9081_rt_parse_cpus(&rt, optarg) < 0) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			rt.priority = strtoul(optarg, NULL, 0);
+			if (rt.priority < 1 || rt.priority > 99) {
+				error("Priority must be 1-99\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'M':
+			rt.lock_memory = true;
+			break;
+		case 'I':
+			rt.irq_cpu = strtol(optarg, &end, 0);
+			if (*end != '\0' || rt.irq_cpu < 0 || rt.irq_cpu >= sysconf(_SC_NPROCESSORS_CONF)) {
+				error("Interrupt CPU must be 0-%ld\n", sysconf(_SC_NPROCESSORS_CONF) - 1);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'J':
+			if (ad9081_rt_parse_baseline(&rt, optarg) < 0) {
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
 
 	signal(SIGINT, handle_sig);
 
+	//The first pushes only fill the kernel queue, so they aren't timed
+	if (kernel_blocks) {
+		rt.warmup = kernel_blocks;
+	}
+
+	//Tracing is switched on from the environment, see ../common
+	if (ad9081_trace_open() < 0) {
+		return EXIT_FAILURE;
+	}
+	ad9081_trace_thread_name("main");
+	ad9081_rt_add_thread(&rt, pthread_self(), "push");
+
 	ctx = iio_create_default_context();
 	if (!ctx) {
 		error("Could not create IIO context\n");
 		ret = EXIT_FAILURE;
 		goto clean;
 	}
-
-	//Devices are found by their IIO name
-	ad9081_tx = iio_context_find_device(ctx, "axi-ad9081-tx-hpc");
-	ad9081 = iio_context_find_device(ctx, "axi-ad9081-rx-hpc");
-	if (!ad9081 || !ad9081_tx) {
-		error("Could not find AD9081 Device\n");
-		ret = EXIT_FAILURE;
-		goto clean;
+	if (rt.irq_cpu >= 0 && strcmp(iio_context_get_name(ctx), "network") == 0) {
+		//The DMA interrupts are on the target, with iiod doing the pushes
+		info("-I only moves the interrupts of a local context, ignored\n");
+		rt.irq_cpu = -1;
 	}
 
-	//Load the Tx channels
+	//Find the devices and load the Tx channels
 	info("Loading Channels\n");
-	result = load_channels();
+	result = ad9081_ctx_open(&ad, ctx);
 
-	//We need to find just 1 DDS control channel which has a global effect on
+	//We need just 1 DDS control channel which has a global effect on
 	//all DAC channels when the raw parameter is set
-	dac1_dds_ctrl = iio_device_find_channel(ad9081_tx, "altvoltage0", true);
-	if ((!dac1_dds_ctrl) || (result != 0)) {
+	if ((result != 0) || (!ad.dds_ctrl)) {
 		error("Could not find all the AD9081 channels\n");
 		ret = EXIT_FAILURE;
 		goto clean;
 	}
+	num_tx_ch = ad.num_tx_ch;
+	init_ramps(tx_ramps, num_tx_ch);
+	ad9081_buf_init(&tx_buf, ad.tx_dev);
+	info("Found %u Tx channels\n", num_tx_ch);
+
+	if (ad9081_regs_open(&dac_regs, &ad) < 0) {
+		error("Could not access the DAC registers\n");
+		ret = EXIT_FAILURE;
+		goto clean;
+	}
 
 	//Do an initial inspection of Channel Control regs to get the default state
 	inspect_dac_regs();
 
+	//Optionally watch all the transitions from here on
+	if (watch_period_us) {
+		if (pthread_create(&watch, NULL, reg_watch_thread, NULL) != 0) {
+			error("Could not start the register watch\n");
+			ret = EXIT_FAILURE;
+			goto clean;
+		}
+		watching = true;
+	}
+
 	/****
 	 * At this point the NCO and other parameters can be adjusted based on the
 	 * application using the config channel loaded. For example:
 	 * //Set NCO Freq
-	 * if(iio_channel_attr_write_longlong(tx_channels[0].config_i, "main_nco_frequency", 800000000LL) < 0) {
+	 * if(iio_channel_attr_write_longlong(ad.tx[0].cfg.ch_i, "main_nco_frequency", 800000000LL) < 0) {
 	 * 		error("Could not set the NCO Freq\n");
 	 *		ret = EXIT_FAILURE;
 	 *		goto clean;
@@ -199,7 +1031,8 @@ int main(int argc, char* argv[])
 	 * mode for all channels, and get it ready to have a scan mask
 	 */
 	info("Configuring for Raw Mode\n");
-	if(iio_channel_attr_write_bool(dac1_dds_ctrl, "raw", false) < 0) {
+	if(AD9081_TRACED(AD9081_TP_ATTR_WRITE, AD9081_TRACE_ATTR("raw"),
+			 iio_channel_attr_write_bool(ad.dds_ctrl, "raw", false)) < 0) {
 		error("Could not set raw mode\n");
 		ret = EXIT_FAILURE;
 		goto clean;
@@ -211,10 +1044,10 @@ int main(int argc, char* argv[])
 
 	/* Step 2: Enable all the channels that want to be outputted. */
 	info("Enabling Channels\n");
-	for( i = 0; i < NUM_TX_CH; i++ ) {
+	for( i = 0; i < num_tx_ch; i++ ) {
 		//Enabling the DAC channels
-		iio_channel_enable(tx_channels[i].dac_i);
-		iio_channel_enable(tx_channels[i].dac_q);
+		iio_channel_enable(ad.tx[i].dac.ch_i);
+		iio_channel_enable(ad.tx[i].dac.ch_q);
 	}
 
 	//Do another inspection of Channel Control regs
@@ -222,52 +1055,92 @@ int main(int argc, char* argv[])
 
 
 	/* Step 3: Create the sample buffer. In this case 65K-Samples * Num channels
-	 * Not cyclic
+	 * Not cyclic. Pushes return as soon as the block is queued to the DMA, so
+	 * with several kernel blocks the next one is filled while the last transfers
 	 */
+	if (kernel_blocks) {
+		info("Using %u kernel DMA blocks\n", kernel_blocks);
+		if ((result = iio_device_set_kernel_buffers_count(ad.tx_dev, kernel_blocks)) < 0) {
+			error("Could not set the kernel buffer count: %d\n", result);
+			ret = EXIT_FAILURE;
+			goto clean;
+		}
+	}
 	info("Opening the buffer\n");
-	if((sample_buff = iio_device_create_buffer(ad9081_tx, 0x10000 * NUM_TX_CH * 2, false)) == NULL){
+	if((sample_buff = ad9081_buf_get(&tx_buf, TX_BUFF_SAMPLES * num_tx_ch * 2, false)) == NULL){
 		error("Could not create data buffer\n");
 		ret = EXIT_FAILURE;
 		goto clean;
 	}
+	info("Buffer created in %.3f ms\n", tx_buf.last_get * 1000.0);
 
 	//Do another inspection of Channel Control regs
 	inspect_dac_regs();
 
+	if (streaming) {
+		info("Starting Streaming with %u workers, %u blocks\n", num_workers, num_blocks);
+		if (stream_tx(sample_buff, num_workers, num_blocks) < 0) {
+			ret = EXIT_FAILURE;
+		}
+		//Every pushed block is sent to iiod on a network context
+		if (strcmp(iio_context_get_name(ctx), "network") == 0) {
+			print_link(stream_stats.blocks_pushed *
+				   (unsigned long long)((uint8_t*)iio_buffer_end(sample_buff) -
+							(uint8_t*)iio_buffer_start(sample_buff)),
+				   stream_stats.elapsed, link_mbps);
+		}
+		goto clean;
+	}
+
+	if (switches) {
+		info("Starting %u mode switches\n", switches);
+		if (reconfig_tx(switches, TX_BUFF_SAMPLES * num_tx_ch * 2) < 0) {
+			ret = EXIT_FAILURE;
+		}
+		goto clean;
+	}
+
 	info("Starting Writing\n");
+	ad9081_rt_start(&rt);
 	while( stop_loop == false ) {
 
 		//Just do a simple linear ramp for testing purposes
 		p_dat = iio_buffer_start(sample_buff);
 		p_end = (uint16_t*)iio_buffer_end(sample_buff);
-		while(p_dat < p_end) {
-			for( i = 0; i < NUM_TX_CH; i++ ) {
-				*p_dat++ = tx_channels[i].ramp_i = tx_channels[i].ramp_i + tx_channels[i].ramp_inc;
-				*p_dat++ = tx_channels[i].ramp_q = tx_channels[i].ramp_q + tx_channels[i].ramp_inc;
-			}
-		}
+		fill_frames(tx_ramps, num_tx_ch, p_dat, (p_end - p_dat) / (num_tx_ch * 2));
 
-		if((result = iio_buffer_push(sample_buff)) < 0) {
+		if((result = AD9081_TRACED(AD9081_TP_PUSH, (uint8_t*)p_end - (uint8_t*)p_dat,
+					   iio_buffer_push(sample_buff))) < 0) {
 			error("Error code %d when pushing buffer\n", result);
 			ret = EXIT_FAILURE;
 			goto clean;
 		}
+		ad9081_rt_mark(&rt, ad9081_trace_now());
 	}
 	info("Completed sampling\n");
+	ad9081_rt_report(&rt, "Push");
 
 clean:
 	if(sample_buff) {
 		info("Cleaning up the buffer\n");
-		iio_buffer_destroy(sample_buff);
+		ad9081_buf_release(&tx_buf);
 
-		//Small delay to let the driver cleanup
-		usleep(500000);
+		//Let the driver clean up, only for as long as it takes
+		wait_dac_idle();
 
 		//Do another inspection of Channel Control regs
 		inspect_dac_regs();
 	}
+	if (watching) {
+		watch_stop = true;
+		pthread_join(watch, NULL);
+	}
+	ad9081_regs_close(&dac_regs);
+	ad9081_ctx_close(&ad);
 	if(ctx) {
 		iio_context_destroy(ctx);
 	}
+	ad9081_trace_close();
+	ad9081_rt_release(&rt);
 	return ret;
 }
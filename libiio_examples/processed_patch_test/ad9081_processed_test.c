@@ -20,23 +20,40 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
 
-/* The AD9081 has a configurable number of channels based on the JESD and
- * device setup.
- * Unless otherwise provided at build time, assume the application is working
- * with 8 pairs of I&Q for both input and output
+#include "ad9081_ctx.h"
+#include "ad9081_regs.h"
+#include "ad9081_trace.h"
+
+/* Longest to wait for the DAC channels to settle after a buffer is destroyed,
+ * and how often to check
+ */
+#define SETTLE_TIMEOUT_US	500000
+#define SETTLE_POLL_US		200
+
+/* Test buffer length per enabled I/Q lane. Each buffer is TEST_BUFF_SAMPLES
+ * times the I/Q lanes enabled, in frames, as in ad9081_multich_tx
  */
-#ifndef NUM_TX_CH
-#define NUM_TX_CH   8
-#endif
+#define TEST_BUFF_SAMPLES	0x10000
+
+/* Timing loop progress is reported every this many loops */
+#define PROGRESS_LOOPS		1000
+
+/* Most timing loops, each keeps a latency per transition */
+#define MAX_LOOPS		1000000
+
+/* Default and largest percentage a transition may be slower than its baseline by */
+#define DEFAULT_TOLERANCE_PCT	25.0
+#define MAX_TOLERANCE_PCT	1000.0
 
-/* Length of temporary buffers for holding channel names */
-#define TEMP_BUFF_LEN	64
+/* Smallest change in latency flagged, however quick the snapshots are, as the
+ * scheduling noise of a loaded target is a few us
+ */
+#define MIN_SLACK_US		5.0
 
-/* Constants for direct register access for channel information */
-#define DAC_CH_REG_BASE		0x400
-#define DAC_CH_REG_STEP		0x40
-#define DAC_CH_CTRL_OFFSET	0x18
+/* Fewest loops for the drift between the start and end of a run to be checked */
+#define MIN_DRIFT_LOOPS		100
 
 #define ARGS(fmt, ...)	__VA_ARGS__
 #define FMT(fmt, ...)	fmt
@@ -46,96 +63,452 @@
 #define info(...) \
 	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
 
-/* Helper struct for holding channel pair information. The dds_ channels are
- * from the ad9081 DDS engine.
- * The dac_ channels are from the DAC/DMA block and are use for setting up the
- * data buffers
+/* Discovered devices and channels. The number of Tx channels is found at run
+ * time from the device
+ */
+static ad9081_ctx_t ad;
+static ad9081_regs_t dac_regs;
+static struct iio_context *ctx = NULL;
+
+static volatile bool stop_loop = false;
+
+/* Transitions timed by the timing loop, in the order of each loop. Each one
+ * starts from the state the one before left, and is timed from the start of
+ * the attribute write (or buffer call) until every CTRL7 reads expected.
  */
+enum {
+	TR_RAW_ZERO = 0,	/* raw = 0, DDS to zero */
+	TR_RAW_DDS,		/* raw = 1, zero to DDS */
+	TR_PROCESSED_ON,	/* input = 1, DDS to DMA */
+	TR_PROCESSED_OFF,	/* input = 0, DMA to DDS */
+	TR_BUFFER_OPEN,		/* Buffer created, DDS to DMA */
+	TR_BUFFER_CLOSE,	/* Buffer destroyed, DMA to DDS */
+	NUM_TRANSITIONS
+};
+
 typedef struct {
-	struct iio_channel *dds1_i;
-	struct iio_channel *dds1_q;
-	struct iio_channel *dds2_i;
-	struct iio_channel *dds2_q;
-	struct iio_channel *dac_i;
-	struct iio_channel *dac_q;
-} tx_channel_pair_t;
+	const char* name;	/* Name in the reports, CSV and baseline files */
+	uint32_t expected;	/* CTRL7 of every DAC channel once done */
+	double* latency;	/* Latency of each loop, in seconds */
+	unsigned int count;
+	bool has_base;		/* Baseline to compare against, in seconds */
+	double base_p50;
+	double base_p99;
+} transition_t;
+
+static transition_t transitions[NUM_TRANSITIONS] = {
+	[TR_RAW_ZERO]		= { "raw_zero", 0x3 },
+	[TR_RAW_DDS]		= { "raw_dds", 0x0 },
+	[TR_PROCESSED_ON]	= { "processed_on", 0x2 },
+	[TR_PROCESSED_OFF]	= { "processed_off", 0x0 },
+	[TR_BUFFER_OPEN]	= { "buffer_open", 0x2 },
+	[TR_BUFFER_CLOSE]	= { "buffer_close", 0x0 },
+};
+
+/* Time spent taking the snapshots of the timing loop, which is the resolution
+ * of its latencies
+ */
+static double snap_total = 0.0;
+static unsigned long long snap_count = 0;
 
-/* Holds all the channel pairs */
-static tx_channel_pair_t tx_channels[NUM_TX_CH];
+/**
+ * Handle keyboard interrupts to stop the timing loop early.
+ */
+static void handle_sig(int sig)
+{
+	stop_loop = true;
+}
 
-static struct iio_context *ctx = NULL;
-static struct iio_device *ad9081 = NULL;
-static struct iio_device *ad9081_tx = NULL;
+/**
+ * Helper to get the time in seconds, on the same clock as the snapshots
+ */
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 /**
- * Helper function to inspect register values from the DAC engine for
- * each channel
+ * Checks the CTRL register of every DAC channel from a single snapshot of the
+ * DAC engine. DAC channels in mask should be set to set, the rest to clear
  */
-static uint32_t get_dac_reg(int ch, int reg)
+static bool dac_ctrl_split(uint32_t mask, uint32_t set, uint32_t clear)
 {
-	int i;
-	uint32_t reg_val;
-	uint32_t reg_addr;
-	reg_addr = DAC_CH_REG_BASE + (ch * DAC_CH_REG_STEP) + reg;
-	iio_device_reg_read(ad9081_tx, reg_addr, &reg_val);
-	return reg_val;
+	unsigned int i;
+	uint32_t expected;
+	ad9081_dac_snapshot_t snap;
+
+	if(ad9081_regs_snapshot(&dac_regs, &snap) < 0) {
+		return false;
+	}
+	for( i = 0; i < snap.num_dac_ch; i++ ) {
+		expected = (mask & (1u << i)) ? set : clear;
+		if(snap.ctrl[i] != expected) {
+			error("Ch %u: CTRL7 = 0x%X, expected 0x%X\n", i, snap.ctrl[i], expected);
+			return false;
+		}
+	}
+	return true;
 }
 
 /**
- * Loads the Tx channels into the tx_channels array.  Loads both the DDS and DMA
- * channels from the Tx engine.
+ * Checks the CTRL register of every DAC channel is set to expected
  */
-static int load_channels(void)
+static bool dac_ctrl_all(uint32_t expected)
 {
-	int i;
-	int result = 0; //Assume successful
-	char ch_buff[TEMP_BUFF_LEN];
-
-	for(i = 0; i < NUM_TX_CH; i++) {
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_i", i);
-		if((tx_channels[i].dac_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output (DAC) Channel %s\n",ch_buff);
+	return dac_ctrl_split(0, expected, expected);
+}
+
+/**
+ * Polls the DAC engine until the CTRL registers are set as for
+ * dac_ctrl_split(), and reports how long the transition took
+ */
+static bool dac_ctrl_wait_split(uint32_t mask, uint32_t set, uint32_t clear)
+{
+	unsigned int i;
+	ad9081_dac_snapshot_t snap;
+	double t0 = -1.0;
+
+	do {
+		if(ad9081_regs_snapshot(&dac_regs, &snap) < 0) {
+			return false;
+		}
+		if(t0 < 0.0) {
+			t0 = snap.t_start;
+		}
+		for( i = 0; i < snap.num_dac_ch &&
+			    snap.ctrl[i] == ((mask & (1u << i)) ? set : clear); i++ );
+		if(i == snap.num_dac_ch) {
+			info("DAC settled in %.3f ms\n", (snap.t_end - t0) * 1000.0);
+			return true;
 		}
+		usleep(SETTLE_POLL_US);
+	} while((snap.t_end - t0) * 1e6 < SETTLE_TIMEOUT_US);
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "voltage%d_q", i);
-		if((tx_channels[i].dac_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Output (DAC) Channel %s\n",ch_buff);
+	return dac_ctrl_split(mask, set, clear);
+}
+
+/**
+ * Polls the DAC engine until every CTRL register is set to expected
+ */
+static bool dac_ctrl_wait(uint32_t expected)
+{
+	return dac_ctrl_wait_split(0, expected, expected);
+}
+
+/**
+ * Takes snapshots back to back, without sleeping, until every CTRL register
+ * is set to expected, and gives the time from t0 to the end of the first
+ * snapshot which shows it. That is at most one snapshot later than the
+ * moment the registers changed.
+ */
+static bool dac_ctrl_time(uint32_t expected, double t0, double* latency)
+{
+	unsigned int i;
+	ad9081_dac_snapshot_t snap;
+
+	do {
+		if(ad9081_regs_snapshot(&dac_regs, &snap) < 0) {
+			return false;
+		}
+		snap_total += snap.t_end - snap.t_start;
+		snap_count++;
+		for( i = 0; i < snap.num_dac_ch && snap.ctrl[i] == expected; i++ );
+		if(i == snap.num_dac_ch) {
+			*latency = snap.t_end - t0;
+			return true;
 		}
+	} while((snap.t_end - t0) * 1e6 < SETTLE_TIMEOUT_US);
 
-		/* Tone indexes start at 1, not 0.  The DDS engines support independent
-		 * I & Q signal generation on each output channel, for 2 tones, for a
-		 * total of 4 IIO channels each.
-		 */
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_I_F1", i+1);
-		if((tx_channels[i].dds1_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 1 I Channel %s\n",ch_buff);
+	error("DAC did not settle within %d us\n", SETTLE_TIMEOUT_US);
+	dac_ctrl_all(expected);
+	return false;
+}
+
+/**
+ * Enables the DAC channels of Tx channels first to last - 1 for a buffer,
+ * and disables all the others
+ */
+static void enable_tx_range(unsigned int first, unsigned int last)
+{
+	unsigned int i;
+
+	for( i = 0; i < ad.num_tx_ch; i++ ) {
+		if(i >= first && i < last) {
+			iio_channel_enable(ad.tx[i].dac.ch_i);
+			iio_channel_enable(ad.tx[i].dac.ch_q);
+		} else {
+			iio_channel_disable(ad.tx[i].dac.ch_i);
+			iio_channel_disable(ad.tx[i].dac.ch_q);
 		}
+	}
+}
+
+/**
+ * Reports the timing of the processed switches done by the driver, from the
+ * processed_switch_stats debug attribute. Older drivers don't have it
+ */
+static void print_switch_stats(void)
+{
+	char buf[256];
+	ssize_t len;
+
+	len = iio_device_debug_attr_read(ad.tx_dev, "processed_switch_stats", buf, sizeof(buf));
+	if(len > 0) {
+		info("Driver processed switches: %s", buf);
+	}
+}
+
+/**
+ * Records the latency of transition tr in loop n, which started at t0 and
+ * whose call returned result. Returns false if the call failed or the
+ * registers never got to the expected state.
+ */
+static bool record_transition(unsigned int tr, unsigned int n, double t0, int result, FILE* csv)
+{
+	transition_t* t = &transitions[tr];
+	double latency;
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_Q_F1", i+1);
-		if((tx_channels[i].dds1_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 1 Q Channel %s\n",ch_buff);
+	if(result < 0) {
+		error("Loop %u: %s failed with %d\n", n, t->name, result);
+		return false;
+	}
+	if(!dac_ctrl_time(t->expected, t0, &latency)) {
+		error("Loop %u: %s did not reach 0x%X\n", n, t->name, t->expected);
+		return false;
+	}
+	t->latency[t->count++] = latency;
+	if(csv) {
+		fprintf(csv, "%u,%s,%.3f\n", n, t->name, latency * 1e6);
+	}
+	return true;
+}
+
+/**
+ * Goes round every transition loops times, or until Ctrl-C. Starts and ends
+ * on DDS, with processed off and no buffer. Returns the loops completed, or
+ * negative if a transition failed.
+ */
+static int run_timing_loop(unsigned int loops, FILE* csv)
+{
+	unsigned int n;
+	int result;
+	double t0;
+	struct iio_buffer* buff = NULL;
+	struct iio_channel* raw_ch = ad.tx[0].dds.tone1.ch_i;
+	struct iio_channel* input_ch = ad.tx[0].dac.ch_i;
+
+	enable_tx_range(0, ad.num_tx_ch);
+	for( n = 0; n < loops && !stop_loop; n++ ) {
+		t0 = now_sec();
+		result = iio_channel_attr_write_bool(raw_ch, "raw", false);
+		if(!record_transition(TR_RAW_ZERO, n, t0, result, csv)) {
+			goto fail;
+		}
+
+		t0 = now_sec();
+		result = iio_channel_attr_write_bool(raw_ch, "raw", true);
+		if(!record_transition(TR_RAW_DDS, n, t0, result, csv)) {
+			goto fail;
+		}
+
+		t0 = now_sec();
+		result = iio_channel_attr_write_bool(input_ch, "input", true);
+		if(!record_transition(TR_PROCESSED_ON, n, t0, result, csv)) {
+			goto fail;
+		}
+
+		t0 = now_sec();
+		result = iio_channel_attr_write_bool(input_ch, "input", false);
+		if(!record_transition(TR_PROCESSED_OFF, n, t0, result, csv)) {
+			goto fail;
 		}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_I_F2", i+1);
-		if((tx_channels[i].dds2_i = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 2 I Channel %s\n",ch_buff);
+		t0 = now_sec();
+		buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * ad.num_tx_ch * 2, false);
+		if(!record_transition(TR_BUFFER_OPEN, n, t0, buff ? 0 : -errno, csv)) {
+			goto fail;
+		}
+
+		t0 = now_sec();
+		iio_buffer_destroy(buff);
+		buff = NULL;
+		if(!record_transition(TR_BUFFER_CLOSE, n, t0, 0, csv)) {
+			goto fail;
+		}
+
+		if((n + 1) % PROGRESS_LOOPS == 0) {
+			info("Loop %u of %u\n", n + 1, loops);
+		}
+	}
+	return n;
+
+fail:
+	//Put the core back on DDS for whoever runs next
+	if(buff) {
+		iio_buffer_destroy(buff);
+	}
+	iio_channel_attr_write_bool(input_ch, "input", false);
+	iio_channel_attr_write_bool(raw_ch, "raw", true);
+	return -1;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Value at fraction p of the num sorted values
+ */
+static double percentile(const double* sorted, unsigned int num, double p)
+{
+	return sorted[(unsigned int)(p * (num - 1) + 0.5)];
+}
+
+/**
+ * Median of num values, sorting them
+ */
+static double median(double* vals, unsigned int num)
+{
+	qsort(vals, num, sizeof(double), cmp_double);
+	return percentile(vals, num, 0.5);
+}
+
+/**
+ * Reports the latency of every transition, and flags the regressions against
+ * the baseline and the drift from the first to the last tenth of the loops.
+ * A change of less than the slack, one snapshot or MIN_SLACK_US, is within the
+ * resolution of the measurement and not flagged. Returns the number of transitions flagged.
+ */
+static unsigned int report_transitions(double tol_pct, double slack)
+{
+	unsigned int i, tenth, flagged = 0;
+	double p50, p99, first, last;
+	double scale = 1.0 + tol_pct / 100.0;
+	bool regress, drift;
+	transition_t* t;
+
+	if(slack < MIN_SLACK_US / 1e6) {
+		slack = MIN_SLACK_US / 1e6;
+	}
+	for( i = 0; i < NUM_TRANSITIONS; i++ ) {
+		t = &transitions[i];
+		if(t->count == 0) {
+			continue;
+		}
+		//Drift first, while the latencies are still in loop order
+		drift = false;
+		first = last = 0.0;
+		if(t->count >= MIN_DRIFT_LOOPS) {
+			tenth = t->count / 10;
+			first = median(t->latency, tenth);
+			last = median(t->latency + t->count - tenth, tenth);
+			drift = last > first * scale + slack;
 		}
+		qsort(t->latency, t->count, sizeof(double), cmp_double);
+		p50 = percentile(t->latency, t->count, 0.5);
+		p99 = percentile(t->latency, t->count, 0.99);
+		regress = t->has_base && (p50 > t->base_p50 * scale + slack ||
+					  p99 > t->base_p99 * scale + slack);
+
+		info("%-13s min %9.1f p50 %9.1f p99 %9.1f max %9.1f us, drift %+6.1f%%%s%s\n",
+		     t->name, t->latency[0] * 1e6, p50 * 1e6, p99 * 1e6,
+		     t->latency[t->count - 1] * 1e6,
+		     first > 0.0 ? (last - first) * 100.0 / first : 0.0,
+		     regress ? " REGRESSION" : "", drift ? " DRIFT" : "");
+		if(t->has_base) {
+			info("%-13s baseline p50 %9.1f p99 %9.1f us\n", t->name,
+			     t->base_p50 * 1e6, t->base_p99 * 1e6);
+		}
+		if(regress || drift) {
+			flagged++;
+		}
+	}
+	return flagged;
+}
 
-		snprintf(ch_buff, TEMP_BUFF_LEN, "TX%d_Q_F2", i+1);
-		if((tx_channels[i].dds2_q = iio_device_find_channel(ad9081_tx, ch_buff, true)) == NULL) {
-			result = -1;
-			error("Error finding Tone 2 Q Channel %s\n",ch_buff);
+/**
+ * Loads the p50 and p99 of each transition from a baseline file, as written
+ * by save_baseline()
+ */
+static int load_baseline(const char* name)
+{
+	FILE* f;
+	char line[128], tr_name[32];
+	unsigned int i, count, loaded = 0;
+	double p50, p99, max;
+
+	if((f = fopen(name, "r")) == NULL) {
+		error("Could not open baseline %s\n", name);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "%31[^,],%u,%lf,%lf,%lf", tr_name, &count, &p50, &p99, &max) != 5) {
+			continue;
+		}
+		for( i = 0; i < NUM_TRANSITIONS; i++ ) {
+			if(strcmp(tr_name, transitions[i].name) == 0) {
+				transitions[i].has_base = true;
+				transitions[i].base_p50 = p50 / 1e6;
+				transitions[i].base_p99 = p99 / 1e6;
+				loaded++;
+			}
 		}
 	}
+	fclose(f);
+	info("Loaded the baseline of %u transitions from %s\n", loaded, name);
+	return loaded ? 0 : -1;
+}
+
+/**
+ * Writes the latency of every transition to a baseline file, sorting them
+ */
+static int save_baseline(const char* name)
+{
+	FILE* f;
+	unsigned int i;
+	transition_t* t;
 
-	return result;
+	if((f = fopen(name, "w")) == NULL) {
+		error("Could not create baseline %s\n", name);
+		return -1;
+	}
+	fprintf(f, "transition,count,p50_us,p99_us,max_us\n");
+	for( i = 0; i < NUM_TRANSITIONS; i++ ) {
+		t = &transitions[i];
+		if(t->count) {
+			qsort(t->latency, t->count, sizeof(double), cmp_double);
+			fprintf(f, "%s,%u,%.3f,%.3f,%.3f\n", t->name, t->count,
+				percentile(t->latency, t->count, 0.5) * 1e6,
+				percentile(t->latency, t->count, 0.99) * 1e6,
+				t->latency[t->count - 1] * 1e6);
+		}
+	}
+	fclose(f);
+	info("Saved the baseline to %s\n", name);
+	return 0;
 }
 
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-l loops] [-o csvfile] [-B baseline] [-W baseline] [-T percent]\n"
+	       "  -l loops    After the test, time every transition this many times\n"
+	       "              (default 0, no timing loop, at most %d)\n"
+	       "  -o file     Write the latency of every transition of every loop to file\n"
+	       "  -B file     Fail if a transition is slower than in this baseline\n"
+	       "  -W file     Save the latencies of this run as a baseline, if it passed\n"
+	       "  -T percent  How much slower than the baseline, or at the end of the\n"
+	       "              run than at the start, is a regression (default %.0f,\n"
+	       "              at most %.0f)\n",
+	       name, MAX_LOOPS, DEFAULT_TOLERANCE_PCT, MAX_TOLERANCE_PCT);
+}
 
 /* Helper macro to check conditions, print some error and jump to the end */
 #define TEST_ASSERT(cond) \
@@ -143,13 +516,80 @@ static int load_channels(void)
 
 int main(int argc, char* argv[])
 {
-	int ret;
+	int ret = EXIT_FAILURE;
 	int result;
 	int i;
+	int opt;
 	bool bval;
-	uint32_t uval;
+	long long mask_val;
+	unsigned int half;
+	uint32_t mask;
+	unsigned int loops = 0;
+	unsigned int flagged;
+	double tol_pct = DEFAULT_TOLERANCE_PCT;
+	const char* csv_name = NULL;
+	const char* base_name = NULL;
+	const char* save_name = NULL;
+	char* end;
+	FILE* csv = NULL;
 	struct iio_buffer  *sample_buff = NULL;
 
+	while((opt = getopt(argc, argv, "l:o:B:W:T:h")) != -1) {
+		switch(opt) {
+		case 'l':
+			loops = strtoul(optarg, &end, 0);
+			if(*end != '\0' || end == optarg || optarg[0] == '-' || loops > MAX_LOOPS) {
+				error("Loops must be 0-%d\n", MAX_LOOPS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			csv_name = optarg;
+			break;
+		case 'B':
+			base_name = optarg;
+			break;
+		case 'W':
+			save_name = optarg;
+			break;
+		case 'T':
+			tol_pct = strtod(optarg, &end);
+			if(*end != '\0' || end == optarg ||
+			   !(tol_pct >= 0.0 && tol_pct <= MAX_TOLERANCE_PCT)) {
+				error("Tolerance must be 0-%.0f percent\n", MAX_TOLERANCE_PCT);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	//Tracing is switched on from the environment, see ../common
+	if(ad9081_trace_open() < 0) {
+		return EXIT_FAILURE;
+	}
+	if(loops > 0) {
+		for( i = 0; i < NUM_TRANSITIONS; i++ ) {
+			transitions[i].latency = calloc(loops, sizeof(double));
+			if(transitions[i].latency == NULL) {
+				error("Could not allocate the latencies of %u loops\n", loops);
+				goto clean;
+			}
+		}
+		if(base_name && load_baseline(base_name) < 0) {
+			goto clean;
+		}
+		if(csv_name) {
+			if((csv = fopen(csv_name, "w")) == NULL) {
+				error("Could not create %s\n", csv_name);
+				goto clean;
+			}
+			fprintf(csv, "loop,transition,latency_us\n");
+		}
+		signal(SIGINT, handle_sig);
+	}
+
 	ctx = iio_create_default_context();
 	if (!ctx) {
 		error("Could not create IIO context\n");
@@ -157,29 +597,38 @@ int main(int argc, char* argv[])
 		goto clean;
 	}
 
-	//Devices are found by their IIO name
-	ad9081_tx = iio_context_find_device(ctx, "axi-ad9081-tx-hpc");
-	ad9081 = iio_context_find_device(ctx, "axi-ad9081-rx-hpc");
-	if (!ad9081 || !ad9081_tx) {
-		error("Could not find AD9081 Device\n");
+	//Find the devices and load the Tx channels
+	info("Loading Channels\n");
+	result = ad9081_ctx_open(&ad, ctx);
+	if (result != 0) {
+		error("Could not find all the AD9081 channels\n");
 		ret = EXIT_FAILURE;
 		goto clean;
 	}
+	//The DDS raw attribute is what the test switches
+	if (!ad.tx[0].dds.tone1.ch_i) {
+		error("The Tx device has no DDS\n");
+		ret = EXIT_FAILURE;
+		goto clean;
+	}
+	info("Found %u Tx channels\n", ad.num_tx_ch);
 
-	//Load the Tx channels
-	info("Loading Channels\n");
-	result = load_channels();
+	result = ad9081_regs_open(&dac_regs, &ad);
 	if (result != 0) {
-		error("Could not find all the AD9081 channels\n");
+		error("Could not access the DAC registers\n");
 		ret = EXIT_FAILURE;
 		goto clean;
 	}
+	info("DAC registers accessed through %s\n", ad9081_regs_path_name(&dac_regs));
+
+	/* Only the switches made by this test are reported at the end */
+	iio_device_debug_attr_write(ad.tx_dev, "processed_switch_stats", "0");
 
 	/**************************************************
 	 * Verify the test is in a good place to start
 	 **************************************************/
 	printf("Verifying Processed/Input is disabled to start...\n");
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
 
@@ -191,44 +640,34 @@ int main(int argc, char* argv[])
 	 * buffer is opened, Input should be locked out
 	 **************************************************/
 	printf("Setting Raw = 0. Verifying Registers...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", false);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x3);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x3));
 
 	printf("Creating a DMA buffer...\n");
-	for( i = 0; i < NUM_TX_CH; i++) {
-		iio_channel_enable(tx_channels[i].dac_i);
-		iio_channel_enable(tx_channels[i].dac_q);
+	for( i = 0; i < (int)ad.num_tx_ch; i++) {
+		iio_channel_enable(ad.tx[i].dac.ch_i);
+		iio_channel_enable(ad.tx[i].dac.ch_q);
 	}
-	sample_buff = iio_device_create_buffer(ad9081_tx, 0x10000 * NUM_TX_CH * 2, false);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * ad.num_tx_ch * 2, false);
 	TEST_ASSERT(sample_buff != NULL);
 
 	printf("Verifying Processed/Input Locked Out...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", true);
 	TEST_ASSERT(result == -EBUSY);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
 
 	printf("Verifying Registers are DMA Mode...\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x2);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x2));
 
 	printf("Destroying The Buffer...\n");
 	iio_buffer_destroy(sample_buff);
-	usleep(500000);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x0);
-	}
+	TEST_ASSERT(dac_ctrl_wait(0x0));
 
 	/**************************************************
 	 * Setup our new processed/input mode.  Raw is set to 0 to start this, which
@@ -237,51 +676,42 @@ int main(int argc, char* argv[])
 	 * Input is enabled. Once input is disabled, all the channels back to DDS.
 	 **************************************************/
 	printf("Setting Raw = 0. Verifying Registers...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", false);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x3);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x3));
 
 	printf("Enabling Processed/Input Mode...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", true);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == true);
 
 	printf("Verifying Registers are DMA...\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x2);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x2));
 
 	printf("Verifying RAW is locked out...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", false);
 	TEST_ASSERT(result == -EBUSY);
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", true);
 	TEST_ASSERT(result == -EBUSY);
 
 	printf("Verifying Buffers locked out...\n");
-	sample_buff = iio_device_create_buffer(ad9081_tx, 0x10000 * NUM_TX_CH * 2, false);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * ad.num_tx_ch * 2, false);
 	TEST_ASSERT(sample_buff == NULL);
 
 	printf("Disabling Processed/Input mode...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", false);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
 
 	printf("Verifying Registers back to DDS...\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x0);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x0));
 
 
 	/**************************************************
@@ -289,33 +719,26 @@ int main(int argc, char* argv[])
 	 * functionality comes back.
 	 **************************************************/
 	printf("Enabling Buffers again...\n");
-	for( i = 0; i < NUM_TX_CH; i++) {
-		iio_channel_enable(tx_channels[i].dac_i);
-		iio_channel_enable(tx_channels[i].dac_q);
+	for( i = 0; i < (int)ad.num_tx_ch; i++) {
+		iio_channel_enable(ad.tx[i].dac.ch_i);
+		iio_channel_enable(ad.tx[i].dac.ch_q);
 	}
-	sample_buff = iio_device_create_buffer(ad9081_tx, 0x10000 * NUM_TX_CH * 2, false);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * ad.num_tx_ch * 2, false);
 	TEST_ASSERT(sample_buff != NULL);
 
 	printf("Verifying Processed/Input is locked out...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", true);
 	TEST_ASSERT(result == -EBUSY);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
 
 	printf("Verifying Registers are DMA...\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x2);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x2));
 
 	printf("Destroying the Buffer...\n");
 	iio_buffer_destroy(sample_buff);
-	usleep(500000);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x0);
-	}
+	TEST_ASSERT(dac_ctrl_wait(0x0));
 
 
 	/**************************************************
@@ -325,56 +748,145 @@ int main(int argc, char* argv[])
 	 * Input is enabled. Once input is disabled, all the channels back to DDS.
 	 **************************************************/
 	printf("Setting Raw = 1. Verifying Registers...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", true);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x0);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x0));
 
 	printf("Enabling Processed/Input Mode...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", true);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == true);
 
 	printf("Verifying Registers are DMA...\n");
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x2);
-	}
+	TEST_ASSERT(dac_ctrl_all(0x2));
 
 	printf("Verifying RAW locked out...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", false);
 	TEST_ASSERT(result == -EBUSY);
-	result = iio_channel_attr_write_bool(tx_channels[0].dds1_i, "raw", true);
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", true);
 	TEST_ASSERT(result == -EBUSY);
 
 
 	printf("Verifying Buffers locked out...\n");
-	sample_buff = iio_device_create_buffer(ad9081_tx, 0x10000 * NUM_TX_CH * 2, false);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * ad.num_tx_ch * 2, false);
 	TEST_ASSERT(sample_buff == NULL);
 
 	printf("Disabling Processed/Input Mode...\n");
-	result = iio_channel_attr_write_bool(tx_channels[0].dac_i, "input", false);
+	result = iio_channel_attr_write_bool(ad.tx[0].dac.ch_i, "input", false);
 	TEST_ASSERT(result == 0);
-	result = iio_channel_attr_read_bool(tx_channels[0].dac_i, "input", &bval);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
 	TEST_ASSERT(result == 0);
 	TEST_ASSERT(bval == false);
-	for( i = 0; i < NUM_TX_CH * 2; i++ ) {
-		uval = get_dac_reg(i, DAC_CH_CTRL_OFFSET);
-		TEST_ASSERT(uval == 0x0);
+	TEST_ASSERT(dac_ctrl_all(0x0));
+
+	/**************************************************
+	 * Per channel processed mode, when the driver has processed_mask. The
+	 * first half of the Tx channels take the FPGA path (DMA, 0x2) and the rest
+	 * stay on DDS. Raw only changes the DDS channels, and a buffer can be
+	 * opened on the DDS channels, but not on the processed ones.
+	 **************************************************/
+	half = ad.num_tx_ch / 2;
+	if(half == 0 || iio_channel_attr_read_longlong(ad.tx[0].dac.ch_i, "processed_mask",
+						       &mask_val) < 0) {
+		printf("Skipping the per channel processed_mask tests...\n");
+		goto done;
 	}
+	//Each Tx channel is an I & Q pair of DAC channels
+	mask = (1u << (half * 2)) - 1;
 
+	printf("Setting processed_mask = 0x%X. Verifying Registers...\n", mask);
+	TEST_ASSERT(mask_val == 0);
+	result = iio_channel_attr_write_longlong(ad.tx[0].dac.ch_i, "processed_mask", mask);
+	TEST_ASSERT(result == 0);
+	result = iio_channel_attr_read_longlong(ad.tx[0].dac.ch_i, "processed_mask", &mask_val);
+	TEST_ASSERT(result == 0);
+	TEST_ASSERT(mask_val == mask);
+	result = iio_channel_attr_read_bool(ad.tx[0].dac.ch_i, "input", &bval);
+	TEST_ASSERT(result == 0);
+	TEST_ASSERT(bval == false);
+	TEST_ASSERT(dac_ctrl_split(mask, 0x2, 0x0));
+
+	printf("Verifying Raw only changes the DDS channels...\n");
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", false);
+	TEST_ASSERT(result == 0);
+	TEST_ASSERT(dac_ctrl_split(mask, 0x2, 0x3));
+	result = iio_channel_attr_write_bool(ad.tx[0].dds.tone1.ch_i, "raw", true);
+	TEST_ASSERT(result == 0);
+	TEST_ASSERT(dac_ctrl_split(mask, 0x2, 0x0));
+
+	printf("Verifying Buffers locked out of the processed channels...\n");
+	enable_tx_range(0, 1);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * 2, false);
+	TEST_ASSERT(sample_buff == NULL);
+
+	printf("Creating a DMA buffer on the DDS channels...\n");
+	enable_tx_range(half, ad.num_tx_ch);
+	sample_buff = iio_device_create_buffer(ad.tx_dev, TEST_BUFF_SAMPLES * (ad.num_tx_ch - half) * 2, false);
+	TEST_ASSERT(sample_buff != NULL);
+	TEST_ASSERT(dac_ctrl_all(0x2));
+
+	printf("Verifying processed_mask is locked out...\n");
+	result = iio_channel_attr_write_longlong(ad.tx[0].dac.ch_i, "processed_mask", 0);
+	TEST_ASSERT(result == -EBUSY);
+
+	printf("Destroying the Buffer...\n");
+	iio_buffer_destroy(sample_buff);
+	sample_buff = NULL;
+	TEST_ASSERT(dac_ctrl_wait_split(mask, 0x2, 0x0));
+
+	printf("Clearing processed_mask...\n");
+	result = iio_channel_attr_write_longlong(ad.tx[0].dac.ch_i, "processed_mask", 0);
+	TEST_ASSERT(result == 0);
+	TEST_ASSERT(dac_ctrl_all(0x0));
+
+done:
 	printf("Test Completed Successfully!\n");
+	print_switch_stats();
+
+	/**************************************************
+	 * Timing loop. Every transition is timed over and over, and compared
+	 * with the baseline when there is one.
+	 **************************************************/
+	if(loops > 0) {
+		iio_device_debug_attr_write(ad.tx_dev, "processed_switch_stats", "0");
+		info("Timing %u loops of %d transitions\n", loops, NUM_TRANSITIONS);
+		result = run_timing_loop(loops, csv);
+		if(result >= 0) {
+			info("Completed %d loops, %.1f us per snapshot\n", result,
+			     snap_total * 1e6 / snap_count);
+		}
+		flagged = report_transitions(tol_pct, snap_count ? snap_total / snap_count : 0.0);
+		print_switch_stats();
+		if(result < 0) {
+			goto clean;
+		}
+		if(flagged) {
+			error("%u transitions regressed\n", flagged);
+			goto clean;
+		}
+		if(save_name && save_baseline(save_name) < 0) {
+			goto clean;
+		}
+	}
+	ret = EXIT_SUCCESS;
 
 clean:
+	ad9081_regs_close(&dac_regs);
+	ad9081_ctx_close(&ad);
 	if(ctx) {
 		iio_context_destroy(ctx);
 	}
+	if(csv) {
+		fclose(csv);
+	}
+	for( i = 0; i < NUM_TRANSITIONS; i++ ) {
+		free(transitions[i].latency);
+	}
+	ad9081_trace_close();
 	return ret;
 }
@@ -0,0 +1,696 @@
+/*
+ * Example application monitoring the spectrum of every enabled AD9081 Rx
+ * channel while streaming. Windowed FFTs of the refilled blocks are averaged
+ * per channel, and the peak, SFDR and noise floor are reported at a fixed
+ * rate, without storing any samples.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include <iio.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <fftw3.h>
+
+#include "ad9081_ctx.h"
+#include "ad9081_trace.h"
+
+#define ARGS(fmt, ...)	__VA_ARGS__
+#define FMT(fmt, ...)	fmt
+#define error(...) \
+	printf("%s, %d: ERROR: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+#define info(...) \
+	printf("%s, %d: INFO: " FMT(__VA_ARGS__, 0)"%s", __func__, __LINE__, ARGS(__VA_ARGS__, ""))
+
+/* FFT size in points, a power of 2 */
+#define DEFAULT_FFT_SIZE	8192
+#define MIN_FFT_SIZE		256
+#define MAX_FFT_SIZE		(1024 * 1024)
+
+/* Samples per refill. Only the first FFT size samples of a block are
+ * analyzed, the rest keep the refills long enough to be efficient.
+ */
+#define DEFAULT_SAMPLES		(64 * 1024)
+
+/* Reporting period in ms */
+#define DEFAULT_REPORT_MS	1000
+#define MIN_REPORT_MS		10
+
+#define DEFAULT_WORKERS		2
+#define MAX_WORKERS		16
+
+/* Half width in bins of the main lobe of the 4 term Blackman-Harris window.
+ * A tone's power is summed over its main lobe, and nothing within it counts
+ * as a spur.
+ */
+#define MAIN_LOBE_BINS		4
+
+/* Full scale of the int16 samples. A complex tone of this amplitude is 0 dBFS */
+#define FULL_SCALE		32768.0
+
+/* Spectrum state of one Rx channel pair. The buffers come from fftwf_malloc,
+ * so every channel has the alignment the plan was made for.
+ */
+typedef struct {
+	fftwf_complex* in;	/* Windowed I/Q of the current snapshot */
+	fftwf_complex* out;
+	double* power;		/* Sum of |X|^2 per bin since the last report */
+} spec_chan_t;
+
+/* Metrics of one channel over a report period, in dBFS where a full scale
+ * complex tone is 0 dBFS
+ */
+typedef struct {
+	double peak_hz;		/* Main lobe centroid of the largest tone */
+	double peak_dbfs;
+	double spur_hz;		/* Largest spur outside the peak and DC */
+	double sfdr_dbc;
+	double floor_dbfs;	/* Median bin, in a bin of fs / N */
+	double nsd_dbfs_hz;	/* Noise spectral density, 0 if fs is unknown */
+} spec_metrics_t;
+
+/* Everything shared between the refill loop and the FFT workers. A snapshot
+ * of the first fft_size frames of a block is handed to every worker at once,
+ * and each worker transforms its own channels: w, w + num_workers, ... Blocks
+ * arriving while the workers are busy are only counted, so the refills never
+ * wait on the FFTs.
+ */
+typedef struct {
+	spec_chan_t ch[AD9081_MAX_CH];
+	unsigned int num_ch;
+	unsigned int fft_size;
+	size_t frame_lanes;		/* int16 values per frame */
+	int16_t* snap;			/* [fft_size * frame_lanes] */
+	float* window;
+	double window_sum;		/* Coherent gain of the window, sum(w) */
+	double enbw_bins;		/* Equivalent noise bandwidth of the window */
+	fftwf_plan plan;
+	double* sort;			/* Scratch for the median */
+
+	unsigned int num_workers;
+	pthread_t workers[MAX_WORKERS];
+	unsigned int num_started;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long long gen;		/* Snapshots handed out */
+	unsigned int pending;		/* Workers still on the current snapshot */
+	bool quit;
+
+	/* Owned by the refill loop */
+	unsigned int averaged;		/* Snapshots summed since the last report */
+	unsigned long long blocks;
+	unsigned long long skipped;	/* Refilled while the workers were busy */
+	unsigned long long reports;
+	unsigned long long failed;	/* Channel reports outside the expected peak */
+} spectrum_t;
+
+static spectrum_t spec;
+
+static volatile bool stop_loop = false;
+
+/**
+ * Handle keyboard interrupts to gracefully exit.
+ */
+static void handle_sig(int sig)
+{
+	stop_loop = true;
+}
+
+/**
+ * Helper to get the monotonic time in seconds
+ */
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills the periodic 4 term Blackman-Harris window, which keeps its sidelobes
+ * below -92 dBc so they don't hide the spurs of a 12-bit converter
+ */
+static void make_window(spectrum_t* sp)
+{
+	unsigned int n;
+	double x, w, sum_sq = 0.0;
+
+	sp->window_sum = 0.0;
+	for(n = 0; n < sp->fft_size; n++) {
+		x = 2.0 * M_PI * n / sp->fft_size;
+		w = 0.35875 - 0.48829 * cos(x) + 0.14128 * cos(2.0 * x) - 0.01168 * cos(3.0 * x);
+		sp->window[n] = w;
+		sp->window_sum += w;
+		sum_sq += w * w;
+	}
+	sp->enbw_bins = sp->fft_size * sum_sq / (sp->window_sum * sp->window_sum);
+}
+
+/**
+ * FFT worker. Waits for each snapshot, windows and transforms the I/Q of each
+ * of its channels with the shared plan, and adds the power of every bin into
+ * the channel's sum.
+ */
+static void* fft_worker(void* arg)
+{
+	unsigned int w = (unsigned int)(uintptr_t)arg;
+	unsigned long long seen = 0;
+	unsigned int c, n;
+	spec_chan_t* ch;
+	const int16_t* p;
+
+	pthread_mutex_lock(&spec.lock);
+	for(;;) {
+		while(spec.gen == seen && !spec.quit) {
+			pthread_cond_wait(&spec.start, &spec.lock);
+		}
+		if(spec.quit) {
+			break;
+		}
+		seen = spec.gen;
+		pthread_mutex_unlock(&spec.lock);
+
+		for(c = w; c < spec.num_ch; c += spec.num_workers) {
+			ch = &spec.ch[c];
+			p = spec.snap + 2 * c;
+			for(n = 0; n < spec.fft_size; n++, p += spec.frame_lanes) {
+				ch->in[n][0] = p[0] * spec.window[n];
+				ch->in[n][1] = p[1] * spec.window[n];
+			}
+			//New-array execute is thread safe, the plan is only read
+			fftwf_execute_dft(spec.plan, ch->in, ch->out);
+			for(n = 0; n < spec.fft_size; n++) {
+				ch->power[n] += (double)ch->out[n][0] * ch->out[n][0] +
+						(double)ch->out[n][1] * ch->out[n][1];
+			}
+		}
+
+		pthread_mutex_lock(&spec.lock);
+		if(--spec.pending == 0) {
+			pthread_cond_signal(&spec.done);
+		}
+	}
+	pthread_mutex_unlock(&spec.lock);
+	return NULL;
+}
+
+/**
+ * Hands the first fft_size frames of a refilled block to the workers, unless
+ * they are still busy with the last one
+ */
+static void spectrum_offer(const void* frames)
+{
+	pthread_mutex_lock(&spec.lock);
+	if(spec.pending) {
+		pthread_mutex_unlock(&spec.lock);
+		spec.skipped++;
+		return;
+	}
+	memcpy(spec.snap, frames, spec.fft_size * spec.frame_lanes * sizeof(int16_t));
+	spec.pending = spec.num_workers;
+	spec.gen++;
+	pthread_cond_broadcast(&spec.start);
+	pthread_mutex_unlock(&spec.lock);
+	spec.averaged++;
+}
+
+/**
+ * Waits for the workers to finish the snapshot they are on
+ */
+static void spectrum_wait(void)
+{
+	pthread_mutex_lock(&spec.lock);
+	while(spec.pending) {
+		pthread_cond_wait(&spec.done, &spec.lock);
+	}
+	pthread_mutex_unlock(&spec.lock);
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Distance between two bins, going round the ends of the spectrum
+ */
+static unsigned int bin_dist(unsigned int a, unsigned int b, unsigned int n)
+{
+	unsigned int d = a > b ? a - b : b - a;
+
+	return d < n - d ? d : n - d;
+}
+
+/**
+ * Finds the largest bin more than MAIN_LOBE_BINS away from DC and from the
+ * bin 'avoid', or from DC only when avoid is n
+ */
+static unsigned int find_peak(const double* pw, unsigned int n, unsigned int avoid)
+{
+	unsigned int k, best = 0;
+	double best_pw = -1.0;
+
+	for(k = 0; k < n; k++) {
+		if(bin_dist(k, 0, n) <= MAIN_LOBE_BINS ||
+		   (avoid < n && bin_dist(k, avoid, n) <= MAIN_LOBE_BINS)) {
+			continue;
+		}
+		if(pw[k] > best_pw) {
+			best_pw = pw[k];
+			best = k;
+		}
+	}
+	return best;
+}
+
+/**
+ * Sums the main lobe around bin k, normalized so a full scale tone is 1.0, and
+ * finds its power weighted centre in bins from DC, for a frequency finer than
+ * a bin. Bins within the main lobe of the bin 'avoid' are left out, so a spur
+ * next to the peak doesn't take in the skirt of the peak.
+ */
+static double lobe_power(const double* pw, unsigned int n, unsigned int k, unsigned int avoid,
+			 double enbw, double* centre)
+{
+	int d;
+	unsigned int b;
+	double sum = 0.0, moment = 0.0;
+	int base = k < n / 2 ? (int)k : (int)k - (int)n;
+
+	for(d = -MAIN_LOBE_BINS; d <= MAIN_LOBE_BINS; d++) {
+		b = (k + n + d) % n;
+		if(avoid < n && bin_dist(b, avoid, n) <= MAIN_LOBE_BINS) {
+			continue;
+		}
+		sum += pw[b];
+		moment += pw[b] * d;
+	}
+	*centre = base + (sum > 0.0 ? moment / sum : 0.0);
+	return sum / enbw;
+}
+
+static double to_db(double x)
+{
+	return 10.0 * log10(x > 1e-30 ? x : 1e-30);
+}
+
+/**
+ * Works out the metrics of channel c from its summed power, over
+ * spec.averaged snapshots
+ */
+static void spectrum_metrics(unsigned int c, double fs, spec_metrics_t* m)
+{
+	spec_chan_t* ch = &spec.ch[c];
+	unsigned int n = spec.fft_size;
+	unsigned int k, peak, spur;
+	double scale, bin_hz, tone, spur_pw, centre, floor_bin;
+
+	//Normalize so the peak bin of a full scale tone is 1.0
+	scale = 1.0 / (spec.averaged * spec.window_sum * spec.window_sum * FULL_SCALE * FULL_SCALE);
+	for(k = 0; k < n; k++) {
+		ch->power[k] *= scale;
+	}
+	bin_hz = fs > 0.0 ? fs / n : 1.0;
+
+	peak = find_peak(ch->power, n, n);
+	tone = lobe_power(ch->power, n, peak, n, spec.enbw_bins, &centre);
+	m->peak_hz = centre * bin_hz;
+	m->peak_dbfs = to_db(tone);
+
+	spur = find_peak(ch->power, n, peak);
+	spur_pw = lobe_power(ch->power, n, spur, peak, spec.enbw_bins, &centre);
+	m->spur_hz = centre * bin_hz;
+	m->sfdr_dbc = to_db(tone) - to_db(spur_pw);
+
+	//The median stays on the noise however many tones and spurs there are
+	memcpy(spec.sort, ch->power, n * sizeof(double));
+	qsort(spec.sort, n, sizeof(double), cmp_double);
+	floor_bin = spec.sort[n / 2] / spec.enbw_bins;
+	m->floor_dbfs = to_db(floor_bin);
+	m->nsd_dbfs_hz = fs > 0.0 ? to_db(floor_bin / bin_hz) : 0.0;
+
+	memset(ch->power, 0, n * sizeof(double));
+}
+
+/**
+ * Prints the metrics of every channel and starts the next period. A peak
+ * further than tol_hz from expect_hz counts as a failure, when expect_hz is
+ * given.
+ */
+static void spectrum_report(double t, double fs, bool expect, double expect_hz,
+			    double tol_hz, FILE* csv)
+{
+	spec_metrics_t m;
+	unsigned int c;
+	bool fail;
+	const char* unit = fs > 0.0 ? "MHz" : "bins";
+	double div = fs > 0.0 ? 1e6 : 1.0;
+
+	spectrum_wait();
+	if(spec.averaged == 0) {
+		info("%8.3f s: no blocks analyzed\n", t);
+		return;
+	}
+	spec.reports++;
+	for(c = 0; c < spec.num_ch; c++) {
+		spectrum_metrics(c, fs, &m);
+		fail = expect && fabs(m.peak_hz - expect_hz) > tol_hz;
+		if(fail) {
+			spec.failed++;
+		}
+		info("%8.3f s rx%u: peak %.4f %s %.1f dBFS, SFDR %.1f dBc (spur %.4f %s), floor %.1f dBFS%s\n",
+		     t, c, m.peak_hz / div, unit, m.peak_dbfs, m.sfdr_dbc, m.spur_hz / div, unit,
+		     m.floor_dbfs, fail ? " FAIL" : "");
+		if(csv) {
+			fprintf(csv, "%.3f,%u,%u,%.1f,%.2f,%.1f,%.2f,%.2f,%.2f,%d\n", t, c, spec.averaged,
+				m.peak_hz, m.peak_dbfs, m.spur_hz, m.sfdr_dbc, m.floor_dbfs,
+				m.nsd_dbfs_hz, fail);
+		}
+	}
+	if(csv) {
+		fflush(csv);
+	}
+	spec.averaged = 0;
+}
+
+/**
+ * Allocates the per channel buffers and the window, and makes the plan. With
+ * a wisdom file, the FFTW_MEASURE planning is only done once per FFT size
+ * and machine, later runs load it.
+ */
+static int spectrum_open(const char* wisdom)
+{
+	unsigned int c;
+	size_t n = spec.fft_size;
+	double t;
+
+	spec.snap = fftwf_malloc(n * spec.frame_lanes * sizeof(int16_t));
+	spec.window = fftwf_malloc(n * sizeof(float));
+	spec.sort = malloc(n * sizeof(double));
+	if(!spec.snap || !spec.window || !spec.sort) {
+		return -1;
+	}
+	for(c = 0; c < spec.num_ch; c++) {
+		spec.ch[c].in = fftwf_malloc(n * sizeof(fftwf_complex));
+		spec.ch[c].out = fftwf_malloc(n * sizeof(fftwf_complex));
+		spec.ch[c].power = calloc(n, sizeof(double));
+		if(!spec.ch[c].in || !spec.ch[c].out || !spec.ch[c].power) {
+			return -1;
+		}
+	}
+	make_window(&spec);
+
+	if(wisdom && fftwf_import_wisdom_from_filename(wisdom)) {
+		info("Loaded FFTW wisdom from %s\n", wisdom);
+	}
+	t = now_sec();
+	//Planning overwrites the arrays, which hold nothing yet
+	spec.plan = fftwf_plan_dft_1d(n, spec.ch[0].in, spec.ch[0].out, FFTW_FORWARD, FFTW_MEASURE);
+	if(spec.plan == NULL) {
+		error("Could not make a %zu point FFT plan\n", n);
+		return -1;
+	}
+	info("Planned a %zu point FFT in %.3f s\n", n, now_sec() - t);
+	if(wisdom && !fftwf_export_wisdom_to_filename(wisdom)) {
+		error("Could not save the FFTW wisdom to %s\n", wisdom);
+	}
+	return 0;
+}
+
+static void spectrum_close(void)
+{
+	unsigned int c;
+
+	if(spec.num_started) {
+		pthread_mutex_lock(&spec.lock);
+		spec.quit = true;
+		pthread_cond_broadcast(&spec.start);
+		pthread_mutex_unlock(&spec.lock);
+		for(c = 0; c < spec.num_started; c++) {
+			pthread_join(spec.workers[c], NULL);
+		}
+		spec.num_started = 0;
+	}
+	if(spec.plan) {
+		fftwf_destroy_plan(spec.plan);
+	}
+	for(c = 0; c < AD9081_MAX_CH; c++) {
+		fftwf_free(spec.ch[c].in);
+		fftwf_free(spec.ch[c].out);
+		free(spec.ch[c].power);
+	}
+	fftwf_free(spec.snap);
+	fftwf_free(spec.window);
+	free(spec.sort);
+	fftwf_cleanup();
+}
+
+/**
+ * Prints the command line usage
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-c channels] [-N points] [-s samples] [-r period_ms] [-j workers]\n"
+	       "          [-n reports] [-e freq_hz[:tol_hz]] [-o csvfile] [-w wisdom]\n"
+	       "  -c channels Rx channel pairs to monitor (default all)\n"
+	       "  -N points   FFT size, a power of 2 from %d to %d (default %d)\n"
+	       "  -s samples  Samples per refill, at least the FFT size (default %d)\n"
+	       "  -r period   Report every period ms, averaging every FFT done in the\n"
+	       "              period (min %d, default %d)\n"
+	       "  -j workers  FFT worker threads, 1-%d (default %d)\n"
+	       "  -n reports  Stop after this many reports, 0 until Ctrl-C (default 0)\n"
+	       "  -e freq     Expect the peak of every channel at freq Hz from DC, within\n"
+	       "              tol Hz (default 2 bins), or in bins if the sample rate is\n"
+	       "              unknown. Exits with an error if any missed\n"
+	       "  -o file     Append a CSV line per channel and report to file\n"
+	       "  -w wisdom   Load and save the FFT plan from and to an FFTW wisdom file\n",
+	       name, MIN_FFT_SIZE, MAX_FFT_SIZE, DEFAULT_FFT_SIZE, DEFAULT_SAMPLES,
+	       MIN_REPORT_MS, DEFAULT_REPORT_MS, MAX_WORKERS, DEFAULT_WORKERS);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	int ret = EXIT_FAILURE;
+	unsigned int i;
+	unsigned int num_ch = 0;
+	unsigned int samples = DEFAULT_SAMPLES;
+	unsigned int period_ms = DEFAULT_REPORT_MS;
+	unsigned long long num_reports = 0;
+	bool expect = false;
+	double expect_hz = 0.0, tol_hz = -1.0;
+	const char* csv_name = NULL;
+	const char* wisdom = NULL;
+	char* end;
+	FILE* csv = NULL;
+	long long rate;
+	double fs = 0.0;
+	double t_start, t_report, t;
+	ssize_t result;
+	struct iio_context* ctx = NULL;
+	struct iio_buffer* buff = NULL;
+	ad9081_ctx_t ad;
+	bool ad_open = false;
+
+	spec.fft_size = DEFAULT_FFT_SIZE;
+	spec.num_workers = DEFAULT_WORKERS;
+	while((opt = getopt(argc, argv, "c:N:s:r:j:n:e:o:w:h")) != -1) {
+		switch(opt) {
+		case 'c':
+			num_ch = atoi(optarg);
+			break;
+		case 'N':
+			spec.fft_size = strtoul(optarg, NULL, 0);
+			if(spec.fft_size < MIN_FFT_SIZE || spec.fft_size > MAX_FFT_SIZE ||
+			   (spec.fft_size & (spec.fft_size - 1))) {
+				error("FFT size must be a power of 2 from %d to %d\n",
+				      MIN_FFT_SIZE, MAX_FFT_SIZE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			samples = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			period_ms = strtoul(optarg, NULL, 0);
+			if(period_ms < MIN_REPORT_MS) {
+				error("Report period must be at least %d ms\n", MIN_REPORT_MS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			spec.num_workers = strtoul(optarg, NULL, 0);
+			if(spec.num_workers < 1 || spec.num_workers > MAX_WORKERS) {
+				error("Workers must be 1-%d\n", MAX_WORKERS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			num_reports = strtoull(optarg, NULL, 0);
+			break;
+		case 'e':
+			expect_hz = strtod(optarg, &end);
+			if(*end == ':') {
+				tol_hz = strtod(end + 1, &end);
+			}
+			if(*end != '\0' || end == optarg) {
+				error("Expected peak must be freq_hz or freq_hz:tol_hz\n");
+				return EXIT_FAILURE;
+			}
+			expect = true;
+			break;
+		case 'o':
+			csv_name = optarg;
+			break;
+		case 'w':
+			wisdom = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(samples < spec.fft_size) {
+		error("Samples per refill must be at least the FFT size of %u\n", spec.fft_size);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, handle_sig);
+	if(ad9081_trace_open() < 0) {
+		return EXIT_FAILURE;
+	}
+	ad9081_trace_thread_name("refill");
+	pthread_mutex_init(&spec.lock, NULL);
+	pthread_cond_init(&spec.start, NULL);
+	pthread_cond_init(&spec.done, NULL);
+
+	ctx = iio_create_default_context();
+	if(!ctx) {
+		error("Could not create IIO context\n");
+		goto clean;
+	}
+	if(ad9081_ctx_open(&ad, ctx) < 0) {
+		error("Could not find all the AD9081 channels\n");
+		goto clean;
+	}
+	ad_open = true;
+
+	//Nothing is configured here, the spectrum is whatever the device was
+	//set up for, i.e. by ad9081_fullsetup
+	spec.num_ch = (num_ch == 0 || num_ch > ad.num_rx_ch) ? ad.num_rx_ch : num_ch;
+	for(i = 0; i < spec.num_ch; i++) {
+		iio_channel_enable(ad.rx[i].in.ch_i);
+		iio_channel_enable(ad.rx[i].in.ch_q);
+	}
+	spec.frame_lanes = iio_device_get_sample_size(ad.rx_dev) / sizeof(int16_t);
+	if(iio_channel_attr_read_longlong(ad.rx[0].in.ch_i, "sampling_frequency", &rate) == 0 &&
+	   rate > 0) {
+		fs = rate;
+	} else {
+		info("Sample rate unknown, frequencies are in bins\n");
+	}
+	if(expect && tol_hz < 0.0) {
+		tol_hz = 2.0 * (fs > 0.0 ? fs / spec.fft_size : 1.0);
+	}
+	info("Monitoring %u Rx channels at %.0f Hz, %u point FFT, %.1f Hz per bin\n",
+	     spec.num_ch, fs, spec.fft_size, fs / spec.fft_size);
+
+	if(spectrum_open(wisdom) < 0) {
+		error("Could not set up the FFTs\n");
+		goto clean;
+	}
+	for(i = 0; i < spec.num_workers; i++) {
+		if(pthread_create(&spec.workers[i], NULL, fft_worker, (void*)(uintptr_t)i) != 0) {
+			error("Could not start FFT worker %u\n", i);
+			goto clean;
+		}
+		spec.num_started++;
+	}
+
+	if(csv_name) {
+		if((csv = fopen(csv_name, "a")) == NULL) {
+			error("Could not open %s\n", csv_name);
+			goto clean;
+		}
+		if(ftell(csv) == 0) {
+			fprintf(csv, "time_s,channel,ffts,peak_hz,peak_dbfs,spur_hz,sfdr_dbc,"
+				"floor_dbfs,nsd_dbfs_hz,fail\n");
+		}
+	}
+
+	if((buff = iio_device_create_buffer(ad.rx_dev, samples, false)) == NULL) {
+		error("Could not create data buffer\n");
+		goto clean;
+	}
+
+	ret = EXIT_SUCCESS;
+	t_start = now_sec();
+	t_report = t_start + period_ms / 1000.0;
+	while(!stop_loop && (num_reports == 0 || spec.reports < num_reports)) {
+		if((result = AD9081_TRACED(AD9081_TP_REFILL, samples * iio_buffer_step(buff),
+					   iio_buffer_refill(buff))) < 0) {
+			error("Error code %zd when refilling the buffer\n", result);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		spec.blocks++;
+		spectrum_offer(iio_buffer_start(buff));
+
+		//Reports stay on the fixed schedule, however long a refill takes
+		if((t = now_sec()) >= t_report) {
+			spectrum_report(t - t_start, fs, expect, expect_hz, tol_hz, csv);
+			ad9081_trace_write_metrics();
+			while(t_report <= t) {
+				t_report += period_ms / 1000.0;
+			}
+		}
+	}
+	spectrum_wait();
+
+	info("%llu blocks refilled, %llu skipped while the FFTs were busy, %llu reports\n",
+	     spec.blocks, spec.skipped, spec.reports);
+	if(expect) {
+		info("%llu channel reports missed the expected peak of %.1f +- %.1f %s\n",
+		     spec.failed, expect_hz, tol_hz, fs > 0.0 ? "Hz" : "bins");
+		if(spec.failed) {
+			ret = EXIT_FAILURE;
+		}
+	}
+
+clean:
+	spectrum_close();
+	if(buff) {
+		iio_buffer_destroy(buff);
+	}
+	if(csv) {
+		fclose(csv);
+	}
+	if(ad_open) {
+		ad9081_ctx_close(&ad);
+	}
+	if(ctx) {
+		iio_context_destroy(ctx);
+	}
+	pthread_cond_destroy(&spec.done);
+	pthread_cond_destroy(&spec.start);
+	pthread_mutex_destroy(&spec.lock);
+	ad9081_trace_close();
+	return ret;
+}
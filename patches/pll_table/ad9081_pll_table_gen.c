@@ -0,0 +1,316 @@
+/*
+ * Host tool which generates the AD9081 device clock PLL solution table used by
+ * 0003-AD9081-Use-generated-PLL-solution-table.patch.
+ *
+ * For every reference clock in the supported set, every combination of the
+ * reference divider (R), PLL output divider, N and M within the part's limits
+ * is enumerated with exact rational math, so fractional references such as
+ * 333.33~MHz (1000000000/3) resolve like any other. Each (DAC clock, reference
+ * clock) pair keeps the first solution in the same R, PLL div, N order the
+ * driver's own search uses. The table is emitted sorted for a binary search.
+ *
+ * Copyright © 2025 by Analog Devices, Inc.  All rights reserved.
+ * This software is proprietary to Analog Devices, Inc. and its licensors.
+ * This software is provided on an “as is” basis without any representations,
+ * warranties, guarantees or liability of any kind.
+ * Use of the software is subject to the terms and conditions of the
+ * Clear BSD License ( https://spdx.org/licenses/BSD-3-Clause-Clear.html ).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+/* PLL limits, matching adi_ad9081_device_clk_pll_startup() */
+#define REF_DIV_MAX	4
+#define PLL_DIV_MAX	4
+#define M_DIV_MIN	2
+#define M_DIV_MAX	50
+#define PFD_MIN_HZ	25000000ULL
+#define PFD_MAX_HZ	750000000ULL
+#define VCO_MIN_HZ	5800000000ULL
+#define VCO_MAX_HZ	12000000000ULL
+
+#define MAX_REFS	64
+#define MAX_DACS	256
+
+static const uint8_t n_div_vals[] = { 5, 7, 8, 11 };
+
+/* A reference clock, num/den Hz */
+typedef struct {
+	uint64_t num;
+	uint64_t den;
+} ref_clk_t;
+
+/* Default set of supported reference clocks. These are the HMC7044 outputs
+ * used with the AD9081 designs, including the ones which are not an integer
+ * number of Hz
+ */
+static const ref_clk_t default_refs[] = {
+	{  100000000ULL, 1 },
+	{  122880000ULL, 1 },
+	{  200000000ULL, 1 },
+	{  245760000ULL, 1 },
+	{  250000000ULL, 1 },
+	{  300000000ULL, 1 },
+	{  307200000ULL, 1 },
+	{ 1000000000ULL, 3 },	/* 333.33~MHz */
+	{  368640000ULL, 1 },
+	{  400000000ULL, 1 },
+	{  491520000ULL, 1 },
+	{  500000000ULL, 1 },
+	{ 2000000000ULL, 3 },	/* 666.66~MHz */
+};
+
+typedef struct {
+	uint64_t dac_clk_hz;
+	uint32_t ref_clk_hz;	/* As the driver sees it, whole Hz */
+	uint8_t ref_div;
+	uint8_t pll_div;
+	uint8_t n_div;
+	uint8_t m_div;
+	uint32_t order;		/* Search order, first one wins */
+} pll_solution_t;
+
+/* Solutions carried over from the hand written table of the explicit PLL LUT
+ * patch. These have been validated on hardware, so they are kept in place of
+ * whatever the search finds first.
+ */
+static const pll_solution_t pinned_solutions[] = {
+	{ .dac_clk_hz = 12000000000ULL, .ref_clk_hz = 333333333U,
+	  .ref_div = 2, .pll_div = 1, .n_div = 8, .m_div = 9 },
+	{ .dac_clk_hz = 8000000000ULL, .ref_clk_hz = 333333333U,
+	  .ref_div = 3, .pll_div = 1, .n_div = 8, .m_div = 9 },
+};
+
+static pll_solution_t* solutions = NULL;
+static size_t num_solutions = 0;
+static size_t max_solutions = 0;
+
+static int add_solution(const pll_solution_t* sol)
+{
+	pll_solution_t* grown;
+
+	if(num_solutions == max_solutions) {
+		max_solutions = max_solutions ? max_solutions * 2 : 1024;
+		if((grown = realloc(solutions, max_solutions * sizeof(*solutions))) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		solutions = grown;
+	}
+	solutions[num_solutions++] = *sol;
+	return 0;
+}
+
+static int compare_solutions(const void* a, const void* b)
+{
+	const pll_solution_t* sa = a;
+	const pll_solution_t* sb = b;
+
+	if(sa->dac_clk_hz != sb->dac_clk_hz)
+		return sa->dac_clk_hz < sb->dac_clk_hz ? -1 : 1;
+	if(sa->ref_clk_hz != sb->ref_clk_hz)
+		return sa->ref_clk_hz < sb->ref_clk_hz ? -1 : 1;
+	if(sa->order != sb->order)
+		return sa->order < sb->order ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Returns true when the DAC clock is in the requested set, or no set was given
+ */
+static int dac_wanted(uint64_t dac_clk_hz, const uint64_t* dacs, size_t num_dacs)
+{
+	size_t i;
+
+	if(num_dacs == 0)
+		return 1;
+	for(i = 0; i < num_dacs; i++) {
+		if(dacs[i] == dac_clk_hz)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Enumerates every solution for one reference clock. The driver sees the
+ * reference as whole Hz, so a fractional reference is keyed by both its
+ * truncated and rounded values when they differ.
+ */
+static int solve_ref(const ref_clk_t* ref, unsigned int ref_idx,
+		     const uint64_t* dacs, size_t num_dacs)
+{
+	unsigned int r, p, n, m;
+	uint64_t vco_scaled, den, dac_clk_hz;
+	uint32_t keys[2];
+	unsigned int num_keys, k;
+	pll_solution_t sol;
+
+	keys[0] = (uint32_t)(ref->num / ref->den);
+	keys[1] = (uint32_t)((ref->num + ref->den / 2) / ref->den);
+	num_keys = keys[1] != keys[0] ? 2 : 1;
+
+	for(r = 1; r <= REF_DIV_MAX; r++) {
+		/* PFD = num / (den * R) */
+		if(ref->num < PFD_MIN_HZ * ref->den * r || ref->num > PFD_MAX_HZ * ref->den * r)
+			continue;
+
+		for(p = 1; p <= PLL_DIV_MAX; p++) {
+			for(n = 0; n < sizeof(n_div_vals); n++) {
+				for(m = M_DIV_MIN; m <= M_DIV_MAX; m++) {
+					/* VCO = PFD * N * M, and DAC = VCO / pll_div */
+					vco_scaled = ref->num * n_div_vals[n] * m;
+					den = ref->den * r;
+					if(vco_scaled < VCO_MIN_HZ * den || vco_scaled > VCO_MAX_HZ * den)
+						continue;
+					if(vco_scaled % (den * p) != 0)
+						continue;
+					dac_clk_hz = vco_scaled / (den * p);
+					if(!dac_wanted(dac_clk_hz, dacs, num_dacs))
+						continue;
+
+					sol.dac_clk_hz = dac_clk_hz;
+					sol.ref_div = r;
+					sol.pll_div = p;
+					sol.n_div = n_div_vals[n];
+					sol.m_div = m;
+					sol.order = 1 + (((ref_idx * REF_DIV_MAX + (r - 1)) * PLL_DIV_MAX +
+							  (p - 1)) * sizeof(n_div_vals)) + n;
+					for(k = 0; k < num_keys; k++) {
+						sol.ref_clk_hz = keys[k];
+						if(add_solution(&sol) < 0)
+							return -1;
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Parses a reference clock given as Hz, or as num/den Hz
+ */
+static int parse_ref(const char* arg, ref_clk_t* ref)
+{
+	char* end;
+
+	ref->num = strtoull(arg, &end, 0);
+	ref->den = 1;
+	if(*end == '/')
+		ref->den = strtoull(end + 1, &end, 0);
+	if(*end != '\0' || ref->num == 0 || ref->den == 0 ||
+	   ref->num / ref->den > UINT32_MAX) {
+		fprintf(stderr, "Invalid reference clock %s\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"Usage: %s [-r ref_hz[/den]]... [-d dac_hz]...\n"
+		"  -r ref   Reference clock to solve for, in Hz. Fractional clocks are\n"
+		"           given as a fraction, i.e. 1000000000/3 for 333.33~MHz.\n"
+		"           Replaces the default set\n"
+		"  -d dac   Only emit solutions for these DAC clocks, in Hz\n"
+		"The table is written to stdout\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+	ref_clk_t refs[MAX_REFS];
+	uint64_t dacs[MAX_DACS];
+	size_t num_refs = 0, num_dacs = 0;
+	size_t i, out;
+	int opt;
+
+	while((opt = getopt(argc, argv, "r:d:h")) != -1) {
+		switch(opt) {
+		case 'r':
+			if(num_refs == MAX_REFS || parse_ref(optarg, &refs[num_refs]) < 0)
+				return EXIT_FAILURE;
+			num_refs++;
+			break;
+		case 'd':
+			if(num_dacs == MAX_DACS)
+				return EXIT_FAILURE;
+			dacs[num_dacs++] = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(num_refs == 0) {
+		memcpy(refs, default_refs, sizeof(default_refs));
+		num_refs = sizeof(default_refs) / sizeof(default_refs[0]);
+	}
+
+	/* Pinned solutions sort ahead of any found by the search */
+	for(i = 0; i < sizeof(pinned_solutions) / sizeof(pinned_solutions[0]); i++) {
+		if(dac_wanted(pinned_solutions[i].dac_clk_hz, dacs, num_dacs) &&
+		   add_solution(&pinned_solutions[i]) < 0)
+			return EXIT_FAILURE;
+	}
+	for(i = 0; i < num_refs; i++) {
+		if(solve_ref(&refs[i], i, dacs, num_dacs) < 0)
+			return EXIT_FAILURE;
+	}
+
+	/* Sort, and keep only the first solution of each (DAC, ref) pair */
+	qsort(solutions, num_solutions, sizeof(*solutions), compare_solutions);
+	for(i = 0, out = 0; i < num_solutions; i++) {
+		if(out && solutions[out - 1].dac_clk_hz == solutions[i].dac_clk_hz &&
+		   solutions[out - 1].ref_clk_hz == solutions[i].ref_clk_hz)
+			continue;
+		solutions[out++] = solutions[i];
+	}
+	num_solutions = out;
+
+	printf("/* SPDX-License-Identifier: GPL-2.0 */\n"
+	       "/*\n"
+	       " * AD9081 device clock PLL solutions, sorted by DAC clock then reference\n"
+	       " * clock for a binary search.\n"
+	       " *\n"
+	       " * Generated by ad9081_pll_table_gen. Do not edit, regenerate instead.\n"
+	       " * Reference clocks (Hz):");
+	for(i = 0; i < num_refs; i++) {
+		if(refs[i].den == 1)
+			printf(" %" PRIu64, refs[i].num);
+		else
+			printf(" %" PRIu64 "/%" PRIu64, refs[i].num, refs[i].den);
+	}
+	printf("\n */\n"
+	       "#ifndef __ADI_AD9081_PLL_TABLE_H__\n"
+	       "#define __ADI_AD9081_PLL_TABLE_H__\n"
+	       "\n"
+	       "typedef struct {\n"
+	       "\tuint64_t dac_clk_hz;\n"
+	       "\tuint32_t ref_clk_hz;\n"
+	       "\tuint8_t ref_div;\n"
+	       "\tuint8_t pll_div;\n"
+	       "\tuint8_t n_div;\n"
+	       "\tuint8_t m_div;\n"
+	       "} adi_ad9081_pll_solution_t;\n"
+	       "\n"
+	       "/* dac_clk_hz, ref_clk_hz, ref_div, pll_div, n_div, m_div */\n"
+	       "static const adi_ad9081_pll_solution_t adi_ad9081_pll_solutions[] = {\n");
+	for(i = 0; i < num_solutions; i++) {
+		printf("\t{ %" PRIu64 "ULL, %" PRIu32 "U, %u, %u, %u, %u },\n",
+		       solutions[i].dac_clk_hz, solutions[i].ref_clk_hz,
+		       solutions[i].ref_div, solutions[i].pll_div,
+		       solutions[i].n_div, solutions[i].m_div);
+	}
+	printf("};\n"
+	       "\n"
+	       "#endif /* __ADI_AD9081_PLL_TABLE_H__ */\n");
+
+	fprintf(stderr, "%zu solutions for %zu reference clocks\n", num_solutions, num_refs);
+	free(solutions);
+	return EXIT_SUCCESS;
+}